@@ -69,6 +69,7 @@
 #include <linux/vmalloc.h>
 #include <linux/soundcard.h>
 #include <linux/poll.h>
+#include <linux/wrapper.h>
 #include <asm/segment.h>
 #include <asm/irq.h>
 #include <asm/io.h>
@@ -76,6 +77,7 @@
 #include <asm/arch/SA-1100.h>
 #include <asm/uaccess.h>
 #include <asm/delay.h>
+#include <asm/pgtable.h>
 
 #ifdef	CONFIG_PROC_FS
 #include <linux/stat.h>
@@ -112,11 +114,14 @@
 #define AUDIO_IRQ			IRQ_DMA0 /* DMA channel 0 IRQ */
 
 /* Client parameters */
-#define AUDIO_NOOF_BUFFERS		8	/* Number of audio buffers */
+#define AUDIO_NOOF_BUFFERS		8	/* Default number of audio buffers */
+#define AUDIO_MIN_BUFFERS		4	/* ..and the least we'll go down to */
 #define AUDIO_BUFFER_SIZE		4608	/* User buffer chunk size */
 
 /* Audio overlay specific variables */
-#define AUDIO_OVERLAY_BUFFERS				(16)
+#define AUDIO_OVERLAY_STREAMS				(4)	/* separate O_SYNC writers */
+#define AUDIO_OVERLAY_BUFFERS				(16)	/* ..each with this many buffers */
+#define AUDIO_OVERLAY_GAIN_UNITY			(0x00010000)
 #define MAX_FREE_OVERLAY_BUFFERS			(AUDIO_OVERLAY_BUFFERS - 2)
 #define AUDIO_OVERLAY_BG_VOLUME_FADED		(0x00004000)
 #define AUDIO_OVERLAY_BG_VOLUME_MAX			(0x00010000)
@@ -128,13 +133,35 @@ extern int hijack_overlay_bg_fadestep;
 
 
 int audio_overlay_bg_volume = AUDIO_OVERLAY_BG_VOLUME_MAX;
-signed short audio_zero_sample[ AUDIO_BUFFER_SIZE/2 ] = { 0 };
+
+/* Overlays are mixed into here when the player has nothing queued */
+static signed short audio_overlay_mixbuf[2][ AUDIO_BUFFER_SIZE/2 ];
 extern int sam;
 
 /* Number of audio buffers that can be in use at any one time. This is
    two less since the inactive two are actually still being used by
    DMA while they look like being free. */
-#define MAX_FREE_BUFFERS		(AUDIO_NOOF_BUFFERS - 2)
+#define MAX_FREE_BUFFERS(dev)		((dev)->nbuffers - 2)
+
+/* The buffers live in one block of pages so that they can be mmap()ed,
+   behind a page holding a struct empeg_audio_mmap_info.  Units with
+   extra RAM get a bigger block, for up to ~1.4 seconds of buffering;
+   how much of it is actually used is set by hijack_audio_buffers. */
+#define AUDIO_RING_ORDER		4	/* 64KB: 13 buffers */
+#define AUDIO_RING_ORDER_EXTRA		6	/* 256KB: 55 buffers */
+#define AUDIO_MMAP_SIZE(dev)		(PAGE_SIZE + PAGE_ALIGN(sizeof(audio_buf) * (dev)->maxbuffers))
+
+/* Longest crossfade we'll attempt; in practice it's limited by what's queued */
+#define AUDIO_XFADE_MAX_MS		5000
+
+/* Range of per-track gain accepted by EMPEG_DSP_SET_GAIN, in whole dB */
+#define AUDIO_GAIN_MIN_DB		(-30)
+#define AUDIO_GAIN_MAX_DB		18
+
+/* Telemetry for /proc/audio */
+#define AUDIO_FILL_BUCKETS		16	/* histogram of the lowest fill level seen each second */
+#define AUDIO_FILL_RECENT		60	/* seconds of per-second lowest fill levels kept */
+#define AUDIO_UNDERRUN_LOG		16	/* most recent underruns kept, must be a power of two */
 
 
 #ifndef __KERNEL__
@@ -412,6 +439,8 @@ int voladj_get_multiplier( struct voladj_state *state,
   return desired_mult;
 }
 
+#include "empeg_voladj.h"
+
 /* 
  * This bit of code searches for any samples that will cause clipping
  * in the future.  The reason we read ahead is so that we never
@@ -431,19 +460,12 @@ int voladj_check(
   int upmult;
   int downmult;
   unsigned short max_sample;
-  unsigned short cur_sample;
   unsigned short max_la_sample;
 
   int num_samples = state->buf_size / 2;
-  int i, outputvalue;
+  int outputvalue;
 
-  max_la_sample = 0;
-  for( i = 0; i < num_samples; i++ ) {
-    cur_sample = abs( lookaheadbuf[ i ] );
-    if (cur_sample > max_la_sample) {
-      max_la_sample = cur_sample;
-    }
-  }
+  max_la_sample = voladj_peak( lookaheadbuf, num_samples );
 
   max_sample = max_la_sample;
   if (state->max_sample > max_sample) {
@@ -502,55 +524,52 @@ int voladj_check(
   return desired_multiplier;
 }
 
-void voladj_scale( 
-  struct voladj_state *state, 
-  int desired_multiplier,
-  short *scalebuf 
-  ) {
-
-  int outmult = state->output_multiplier;
-  int output_value,i;
-  short output_sample;
-  int num_samples = state->buf_size / 2;
-
-  /* If there is no scaling to be done, just return immediately.
-   * There's no point going through multiplying every sample by 1!
-   */
-  if ((outmult == (1 << MULT_POINT)) &&
-    (desired_multiplier == (1 << MULT_POINT))) {
-      return;
-  }
-
-  /*
-   * In the previous call to voladj_check we made sure that the
-   * output multiplier was set to a value that will not cause
-   * clipping for any of the samples, so we don't have to worry
-   * about that here.
-   */
-
-  for( i = 0; i < num_samples; i++ ) {
-    if (desired_multiplier != outmult) {
-      outmult = outmult + 
-        ((desired_multiplier - outmult) / (num_samples - i));
-    } 
-    output_value = ((outmult >> MULT_TO_16) 
-      * scalebuf[ i ]) >> (MULT_POINT - MULT_TO_16 ) ;
-
-    /*
-    if ((output_value > MAXSAMPLES)||(output_value < (-1 * (MAXSAMPLES+1)))) {
-      fprintf(stderr, 
-        "Arghh! Got clipping, output_multiplier: %x, insamp: %x, outsamp %x\n", 
-        outmult, scalebuf[i], output_value);
-      fprintf(stderr, 
-        "  output_multiplier: %x, abs(insamp): %x, abs(outsamp) %x\n", 
-        outmult, abs(scalebuf[i]), abs(output_value));
-    }
-    */
-    output_sample = (short)(0x0000ffff & output_value);
-    scalebuf[ i ] = output_sample;
-  }
+/* 10^(dB/20) in 16.16 fixed point, for each whole dB from AUDIO_GAIN_MIN_DB
+   to AUDIO_GAIN_MAX_DB */
+static const int audio_gain_table[AUDIO_GAIN_MAX_DB - AUDIO_GAIN_MIN_DB + 1] = {
+	  2072,   2325,   2609,   2927,   3285,   3685,   4135,   4640,
+	  5206,   5841,   6554,   7353,   8250,   9257,  10387,  11654,
+	 13076,  14672,  16462,  18471,  20724,  23253,  26090,  29274,
+	 32846,  36854,  41350,  46396,  52057,  58409,  65536,  73533,
+	 82505,  92572, 103868, 116541, 130762, 146717, 164619, 184706,
+	207243, 232531, 260904, 292739, 328458, 368536, 413504, 463959,
+	520571 };
+
+/* Per-track gain in 1/256ths of a dB to a voladj multiplier, interpolating
+   linearly between whole dB (good to better than 0.2%) */
+static int audio_gain_from_db(int db)
+{
+	int i, frac, mult;
+
+	if (db < AUDIO_GAIN_MIN_DB * 256)
+		db = AUDIO_GAIN_MIN_DB * 256;
+	else if (db > AUDIO_GAIN_MAX_DB * 256)
+		db = AUDIO_GAIN_MAX_DB * 256;
+	db  -= AUDIO_GAIN_MIN_DB * 256;
+	i    = db >> 8;
+	frac = db & 255;
+	mult = audio_gain_table[i];
+	if (frac)
+		mult += ((audio_gain_table[i + 1] - mult) * frac) >> 8;
+	return mult >> (16 - MULT_POINT);
+}
 
-  state->output_multiplier = outmult;
+/* The multiplier for voladj_scale() to ramp to: voladj's own times the
+   per-track gain, but never so much that the louder of the buffer being
+   scaled and the one after it (which starts from the same multiplier)
+   would clip */
+static int audio_gain_combine(int multiplier, int gain, unsigned int peak)
+{
+	int combined = ((multiplier >> 4) * gain) >> (MULT_POINT - 4);
+
+	if (combined > (1 << (MULT_POINT + MULT_INTBITS)))
+		combined = 1 << (MULT_POINT + MULT_INTBITS);
+	if (peak) {
+		int limit = (MAXSAMPLES << MULT_POINT) / peak;	/* MAXSAMPLES+1 would wrap to -32768 */
+		if (combined > limit)
+			combined = limit;
+	}
+	return combined;
 }
 
 /* statistics */
@@ -563,6 +582,20 @@ typedef struct
 	ulong buffer_hwm;
 	ulong user_underruns;
 	ulong irq_underruns;
+
+	/* Buffer fill levels, sampled at every interrupt */
+	ulong fill_start;			/* jiffies at start of the current second */
+	int   fill_min;				/* lowest fill level so far this second */
+	ulong fill_hist[AUDIO_FILL_BUCKETS];	/* seconds spent at each lowest fill level */
+	unsigned char fill_recent[AUDIO_FILL_RECENT];
+	int   fill_recent_idx;
+
+	/* When did we run dry? */
+	struct {
+		ulong	jiffies;
+		int	irq;			/* irq (rather than user) underrun */
+	} underrun_log[AUDIO_UNDERRUN_LOG];
+	int underrun_idx;
 } audio_stats;
 
 typedef struct
@@ -574,11 +607,39 @@ typedef struct
 	int  count;
 } audio_buf;
 
-struct
+/* One of these per O_SYNC file writing overlay audio (nav prompts, etc.) */
+typedef struct
 {
 	audio_buf *buffers;
-	int used,free,head,tail,initialized;
-} audio_overlay;
+	int used,free,head,tail;
+
+	/* Busy streams below the highest busy priority are ducked, like the player */
+	int priority;
+
+	/* AUDIO_OVERLAY_GAIN_UNITY is full volume */
+	int gain;
+
+	/* The file that owns this stream, or NULL if it's unused */
+	struct file *owner;
+} audio_overlay_t;
+
+static audio_overlay_t audio_overlay[AUDIO_OVERLAY_STREAMS];
+
+/* What audio_mix_streams() works from */
+typedef struct
+{
+	signed short	*data;
+	int		gain;
+} audio_mix_src_t;
+
+typedef struct
+{
+	signed short	*dst;		/* scaled by dst_gain, then the sources are summed into it */
+	int		dst_gain;
+	int		words;		/* stereo sample pairs */
+	int		nsrc;
+	audio_mix_src_t	src[AUDIO_OVERLAY_STREAMS];
+} audio_mix_t;
 
 typedef struct
 {
@@ -586,9 +647,41 @@ typedef struct
 	audio_buf *buffers;
 	int used,free,head,tail,prevhead;
 
+	/* Ring depth: nbuffers in use, out of maxbuffers allocated */
+	int nbuffers, maxbuffers;
+
+	/* Interrupts since DMA last took one of our buffers (max 2) */
+	int dma_idle;
+
+	/* Bytes already written into buffers[head] by a partial write() */
+	int partial;
+
+	/* mmap() support: the page block holding the info page and buffers */
+	unsigned long ring;
+	int ring_order;
+	struct empeg_audio_mmap_info *mmap_info;
+	int mapped;
+
         /* current state of volume adjuster */
         struct voladj_state voladj;   
 
+	/* Crossfade: the retained end of the outgoing track, faded out over
+	   the first "chunks" buffers of the incoming one, which is faded in */
+	struct {
+		unsigned char		*buf;		/* NULL when not crossfading */
+		int			chunks, next;
+		struct voladj_state	in, out;	/* just for voladj_scale() ramps */
+	} xfade;
+
+	/* Per-track gain (EMPEG_DSP_SET_GAIN), folded into the voladj multiply */
+	struct {
+		int			db;		/* as set, in 1/256ths of a dB */
+		int			target;		/* ..as a multiplier */
+		int			prev;		/* target when buffers[prevhead] was queued */
+		unsigned int		prevpeak;	/* peak sample in buffers[prevhead] */
+		struct voladj_state	ramp;		/* combined multiplier actually applied */
+	} gain;
+
 	/* Buffer management */
 	struct wait_queue *waitq;
 
@@ -639,6 +732,9 @@ static int empeg_audio_read_proc(char *buf, char **start, off_t offset,
 				 int length, int *eof, void *private);
 #endif
 static unsigned int empeg_audio_poll(struct file *file, poll_table *wait);
+static int empeg_audio_mmap(struct file *file, struct vm_area_struct *vma);
+static int empeg_audio_release(struct inode *inode, struct file *file);
+static void audio_mix_streams(audio_mix_t *mix);
 
 static struct tq_struct emit_task =
 {
@@ -662,7 +758,9 @@ static struct file_operations audio_fops =
 	write:		empeg_audio_write,
 	poll:		empeg_audio_poll,
 	ioctl:		empeg_audio_ioctl,
+	mmap:		empeg_audio_mmap,
 	open:		empeg_audio_open,
+	release:	empeg_audio_release,
 };
 
 void hijack_voladj_intinit (	int factor_per_second, int minvol, int headroom, int real_silence, int fake_silence)
@@ -687,27 +785,37 @@ int __init empeg_audio_init(void)
 	/* Blank everything to start with */
 	memset(dev, 0, sizeof(audio_dev));
 
-    /*
-	// initialize audio overlay buffers
-	if ((audio_overlay.buffers=kmalloc(sizeof(audio_buf)*AUDIO_OVERLAY_BUFFERS,GFP_KERNEL))==NULL)
-		printk(AUDIO_NAME ": can't get memory for audio overlay buffers");
-	for(i = 0; i < AUDIO_OVERLAY_BUFFERS; i++)
-		audio_overlay.buffers[i].count = 0;
-	audio_overlay.head = audio_overlay.tail = audio_overlay.used = 0;
-	audio_overlay.free = MAX_FREE_OVERLAY_BUFFERS;
-	*/
-    audio_overlay.initialized = 0;
-
-	/* Allocate buffers */
-	if ((dev->buffers = kmalloc(sizeof(audio_buf) * AUDIO_NOOF_BUFFERS,
-				    GFP_KERNEL)) == NULL) {
-		/* No memory */
-		printk(AUDIO_NAME ": can't get memory for buffers");
-		return -ENOMEM;
+	/* Overlay streams get their buffers on their first write */
+	memset(audio_overlay, 0, sizeof(audio_overlay));
+
+	/* Allocate buffers, reserving the pages so they can be mmap()ed */
+	dev->ring_order = AUDIO_RING_ORDER;
+#ifdef CONFIG_EMPEG_EXTRA_RAM
+	if (num_physpages > ((16 * 1024 * 1024) >> PAGE_SHIFT))
+		dev->ring_order = AUDIO_RING_ORDER_EXTRA;
+#endif
+	while ((dev->ring = __get_free_pages(GFP_KERNEL, dev->ring_order)) == 0) {
+		if (dev->ring_order == AUDIO_RING_ORDER) {
+			/* No memory */
+			printk(AUDIO_NAME ": can't get memory for buffers");
+			return -ENOMEM;
+		}
+		dev->ring_order = AUDIO_RING_ORDER;
 	}
+	dev->maxbuffers = ((PAGE_SIZE << dev->ring_order) - PAGE_SIZE) / sizeof(audio_buf);
+	dev->nbuffers = AUDIO_NOOF_BUFFERS;
+	for (i = 0; i < AUDIO_MMAP_SIZE(dev); i += PAGE_SIZE)
+		mem_map_reserve(MAP_NR(dev->ring + i));
+	dev->mmap_info = (struct empeg_audio_mmap_info *)dev->ring;
+	memset(dev->mmap_info, 0, PAGE_SIZE);
+	dev->mmap_info->buffer_count  = dev->nbuffers;
+	dev->mmap_info->buffer_size   = AUDIO_BUFFER_SIZE;
+	dev->mmap_info->buffer_stride = sizeof(audio_buf);
+	dev->mmap_info->data_offset   = PAGE_SIZE;
+	dev->buffers = (audio_buf *)(dev->ring + PAGE_SIZE);
 
 	/* Clear them */
-	for(i = 0; i < AUDIO_NOOF_BUFFERS; i++)
+	for(i = 0; i < dev->maxbuffers; i++)
 		dev->buffers[i].count = 0;
 
         /* Initialise volume adjustment */
@@ -719,11 +827,15 @@ int __init empeg_audio_init(void)
             30,                             /* real_silence */
             80                              /* fake_silence */
             );
+	dev->gain.target = dev->gain.prev = 1 << MULT_POINT;
+	dev->gain.ramp.output_multiplier  = 1 << MULT_POINT;
+	dev->gain.ramp.buf_size = AUDIO_BUFFER_SIZE;
 
 	/* Set up queue: note that two buffers could be DMA'ed any any time,
 	   and so we use two fewer marked as "free" */
 	dev->head = dev->tail = dev->used = 0;
-	dev->free = MAX_FREE_BUFFERS;
+	dev->free = MAX_FREE_BUFFERS(dev);
+	dev->dma_idle = 2;
 
 	/* Request appropriate interrupt line */
 	if((err = request_irq(AUDIO_IRQ, empeg_audio_interrupt, SA_INTERRUPT,
@@ -787,65 +899,519 @@ int empeg_audio_open(struct inode *inode, struct file *file)
         return 0;
 }
 
-static unsigned short *delay_buf[2] = {NULL, NULL}, delay_buf_bytes = 0;
+/* Time alignment delay lines, one per channel, sharing a write position */
+#define DELAY_RING_SIZE	2048		/* samples per channel: must be a power of two */
+#define DELAY_RING_MASK	(DELAY_RING_SIZE - 1)
+#define DELAY_MAX_TIME	254		/* 0.1ms units, ie. 127 from the menu plus 127 from config.ini */
+static short *delay_ring[2] = {NULL, NULL};
+static unsigned int delay_pos = 0;
+static int delay_active[2] = {0, 0};	/* a channel's ring is only written while its delay is in use */
 
 /* Main Time Alignment Code - Christian Hack 2002 - christianh@pdd.edmi.com.au	*/
-/* Gotta offset the first x bytes of one channel by hijack_delaytime (0.1ms units) */
-/* which is calced and hardcoded to 44.1kHz in hijack.c				*/
-/* Doing things 2 bytes at a time so we will be slow. This isn't reflected in	*/
-/* units load averages surprisingly						*/
+/* Delays one or both channels by hijack_delaytime plus hijack_delaytime_base	*/
+/* (0.1ms units), which is calced and hardcoded to 44.1kHz here.		*/
+/* Each incoming sample is written once into a circular delay line, and the	*/
+/* output is read back from behind the write position, interpolating between	*/
+/* neighbouring samples for the fractional part of the delay.  Everything is	*/
+/* done in the same single pass over buf[], whatever the delay.			*/
+static inline short
+delay_tap (short *ring, unsigned int pos, unsigned int frac)
+{
+	int s = ring[pos & DELAY_RING_MASK];
+
+	if (frac)
+		s += ((ring[(pos - 1) & DELAY_RING_MASK] - s) * (int)frac) >> 8;
+	return s;
+}
+
 static void
 delay_one_channel (unsigned short *buf)
 {
-	extern int  hijack_delaytime;
-	unsigned short *bufend, *buftail, *d, *b;
-	int channel = 0, offset = hijack_delaytime;
-	static unsigned int spare = 0;
-
-	if (!offset)
+	extern int  hijack_delaytime, hijack_delaytime_base[2];	// from arch/arm/special/hijack.c
+	short *b, *bufend, *ring0, *ring1;
+	unsigned int pos, whole[2], frac[2];
+	int channel, delay[2];
+
+	delay[0] = hijack_delaytime_base[0];
+	delay[1] = hijack_delaytime_base[1];
+	if (hijack_delaytime < 0)	// Right channel?
+		delay[1] -= hijack_delaytime;
+	else
+		delay[0] += hijack_delaytime;
+	if (!delay[0] && !delay[1]) {
+		delay_active[0] = delay_active[1] = 0;
 		return;
-	if (!delay_buf[0]) {
-		// Allocate two halfsize (for single channel) delay buffers
-		const int max_delay = (127 * 441 / 100 + 3) & ~3;	// align to 4-byte boundary
-		delay_buf_bytes  = 2 * max_delay * sizeof(short);	// number of bytes for two buffers
-		if ((delay_buf[0] = kmalloc(delay_buf_bytes, GFP_KERNEL)) == NULL) {
+	}
+	if (!delay_ring[0]) {
+		if ((delay_ring[0] = kmalloc(2 * DELAY_RING_SIZE * sizeof(short), GFP_KERNEL)) == NULL) {
 			printk(AUDIO_NAME ": no memory for delay buffer");
 			hijack_delaytime = 0;
+			hijack_delaytime_base[0] = hijack_delaytime_base[1] = 0;
 			return;
 		}
 		/* Ensure buffer is clear so we don't get an initial click */
-		delay_buf[1] = delay_buf[0] + (delay_buf_bytes / (2 * sizeof(short)));
-		memset(delay_buf[0], 0, delay_buf_bytes);	// clear both buffers
+		delay_ring[1] = delay_ring[0] + DELAY_RING_SIZE;
+		memset(delay_ring[0], 0, 2 * DELAY_RING_SIZE * sizeof(short));
+	}
+
+	// Convert 0.1ms units into samples, in 1/256ths: 4.41 samples per 0.1ms (no floating point)
+	for (channel = 0; channel <= 1; ++channel) {
+		unsigned int samples;
+		if (delay[channel] > DELAY_MAX_TIME)
+			delay[channel] = DELAY_MAX_TIME;
+		samples = delay[channel] * 441 * 256 / 100;
+		whole[channel] = samples >> 8;
+		frac[channel]  = samples & 0xff;
+
+		/* Don't replay whatever was left in the ring when this channel's delay was last 0 */
+		if (delay[channel] && !delay_active[channel])
+			memset(delay_ring[channel], 0, DELAY_RING_SIZE * sizeof(short));
+		delay_active[channel] = (delay[channel] != 0);
+	}
+
+	pos    = delay_pos;
+	ring0  = delay_ring[0];
+	ring1  = delay_ring[1];
+	b      = (short *)buf;
+	bufend = b + (AUDIO_BUFFER_SIZE / sizeof(short));
+	if (!delay[1]) {
+		for (; b < bufend; b += 2) {
+			ring0[pos] = b[0];
+			b[0] = delay_tap(ring0, pos - whole[0], frac[0]);
+			pos = (pos + 1) & DELAY_RING_MASK;
+		}
+	} else if (!delay[0]) {
+		for (; b < bufend; b += 2) {
+			ring1[pos] = b[1];
+			b[1] = delay_tap(ring1, pos - whole[1], frac[1]);
+			pos = (pos + 1) & DELAY_RING_MASK;
+		}
+	} else {
+		for (; b < bufend; b += 2) {
+			ring0[pos] = b[0];
+			ring1[pos] = b[1];
+			b[0] = delay_tap(ring0, pos - whole[0], frac[0]);
+			b[1] = delay_tap(ring1, pos - whole[1], frac[1]);
+			pos = (pos + 1) & DELAY_RING_MASK;
+		}
+	}
+	delay_pos = pos;
+}
+
+/* Clean a buffer out of the D-cache after we've modified it, so that
+   nothing stale is written back over it once userspace is refilling it
+   through its (uncached) mmap() */
+static inline void audio_buf_clean(audio_dev *dev, int bufind)
+{
+	if (dev->mapped)
+		clean_cache_area(dev->buffers[bufind].data, AUDIO_BUFFER_SIZE);
+}
+
+/* Mirror the ring indices into the page that mmap() clients see */
+static inline void audio_mmap_sync(audio_dev *dev)
+{
+	struct empeg_audio_mmap_info *info = dev->mmap_info;
+
+	if (dev->mapped) {
+		info->head      = dev->head;
+		info->tail      = dev->tail;
+		info->free      = dev->free;
+		info->used      = dev->used;
+		info->underruns = dev->stats.user_underruns;
+		clean_cache_area(info, sizeof(*info));
+	}
+}
+
+/* Stop crossfading, and drop whatever is left of the outgoing track */
+static void empeg_audio_crossfade_end(audio_dev *dev)
+{
+	unsigned char *buf = dev->xfade.buf;
+
+	dev->xfade.buf = NULL;
+	if (buf)
+		kfree(buf);
+}
+
+/* Blend the next retained chunk of the outgoing track into buf[], with
+   linear gain ramps across the whole crossfade, done by voladj_scale().
+   Both sides have already been through voladj/track gain by now. */
+static void empeg_audio_crossfade(audio_dev *dev, short *buf)
+{
+	short *old = (short *)(dev->xfade.buf + dev->xfade.next * AUDIO_BUFFER_SIZE);
+	int in_mult, out_mult;
+	audio_mix_t mix;
+
+	++dev->xfade.next;
+	in_mult  = (dev->xfade.next << MULT_POINT) / dev->xfade.chunks;
+	out_mult = (1 << MULT_POINT) - in_mult;
+	voladj_scale(&dev->xfade.in,  in_mult,  buf);
+	voladj_scale(&dev->xfade.out, out_mult, old);
+
+	mix.dst          = buf;
+	mix.dst_gain     = AUDIO_OVERLAY_GAIN_UNITY;
+	mix.words        = AUDIO_BUFFER_SIZE / 4;
+	mix.nsrc         = 1;
+	mix.src[0].data  = old;
+	mix.src[0].gain  = AUDIO_OVERLAY_GAIN_UNITY;
+	audio_mix_streams(&mix);
+
+	if (dev->xfade.next == dev->xfade.chunks)
+		empeg_audio_crossfade_end(dev);
+}
+
+/* The player has just written the last of a track: take back the most
+   recent msecs of it from the queue (leaving enough to keep the DAC busy),
+   plus anything in a partly written buffer, to be faded out over the start
+   of whatever comes next.  Returns the number of milliseconds actually
+   retained. */
+static int empeg_audio_crossfade_start(audio_dev *dev, int msecs)
+{
+	unsigned long flags;
+	unsigned char *buf;
+	int i, k, chunks, bufind, partial = dev->partial;
+
+	if (msecs < 0 || msecs > AUDIO_XFADE_MAX_MS)
+		return -EINVAL;
+	if (dev->mapped)
+		return -EBUSY;
+	empeg_audio_crossfade_end(dev);
+
+	/* Whole buffers, and keep two queued to cover the gap */
+	k = (msecs * (44100 * 4 / 100) / 10 + AUDIO_BUFFER_SIZE - 1) / AUDIO_BUFFER_SIZE;
+	if (k > dev->used - 2)
+		k = dev->used - 2;
+	if (k < 0)
+		k = 0;
+	chunks = k + (partial != 0);
+	if (chunks == 0)
+		return 0;
+	if ((buf = kmalloc(chunks * AUDIO_BUFFER_SIZE, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	/* Copy out first: the IRQ side only ever takes from the tail, well clear of these */
+	bufind = dev->head - k;
+	if (bufind < 0)
+		bufind += dev->nbuffers;
+	for (i = 0; i < k; ++i) {
+		memcpy(buf + i * AUDIO_BUFFER_SIZE, dev->buffers[bufind].data, AUDIO_BUFFER_SIZE);
+		if (++bufind == dev->nbuffers)
+			bufind = 0;
+	}
+	if (partial) {
+		/* The unfinished buffer at the head follows on, padded with silence */
+		memcpy(buf + k * AUDIO_BUFFER_SIZE, dev->buffers[dev->head].data, partial);
+		memset(buf + k * AUDIO_BUFFER_SIZE + partial, 0, AUDIO_BUFFER_SIZE - partial);
+		delay_one_channel((unsigned short *)(buf + k * AUDIO_BUFFER_SIZE));
+	}
+
+	save_flags_cli(flags);
+	if (k && dev->used - k < 1) {	/* drained while we were copying */
+		restore_flags(flags);
+		kfree(buf);
+		return 0;
+	}
+	dev->used -= k;
+	dev->free += k;
+	dev->head -= k;
+	if (dev->head < 0)
+		dev->head += dev->nbuffers;
+	if (partial) {
+		dev->partial = 0;
+		dev->free++;	/* it was counted out when the partial write began */
+	}
+	audio_mmap_sync(dev);
+	restore_flags(flags);
+
+	/* Everything else queued was scaled as it went, so scale the newest
+	   whole buffer and the partial one to match, at the multiplier the
+	   ramp has reached.  From here on it's the incoming track that gets
+	   scaled, carrying on from the same ramp (see empeg_audio_queue_buffer()) */
+	{
+		struct voladj_state flat = dev->gain.ramp;
+		if (dev->prevhead >= 0) {
+			if (k) {
+				voladj_scale(&flat, flat.output_multiplier, (short *)(buf + (k - 1) * AUDIO_BUFFER_SIZE));
+			} else {
+				/* It's still queued, so do it in place, as empeg_audio_queue_buffer() would */
+				save_flags_cli(flags);
+				if (dev->used > 1) {
+					dev->used--;
+					restore_flags(flags);
+					voladj_scale(&flat, flat.output_multiplier, (short *)dev->buffers[dev->prevhead].data);
+					audio_buf_clean(dev, dev->prevhead);
+					save_flags_cli(flags);
+					dev->used++;
+				}
+				restore_flags(flags);
+			}
+		}
+		if (partial)
+			voladj_scale(&flat, flat.output_multiplier, (short *)(buf + k * AUDIO_BUFFER_SIZE));
+	}
+	dev->prevhead = -1;	/* nothing left queued still needs scaling */
+
+	dev->xfade.chunks = chunks;
+	dev->xfade.next   = 0;
+	dev->xfade.in.buf_size  = dev->xfade.out.buf_size = AUDIO_BUFFER_SIZE;
+	dev->xfade.in.output_multiplier  = 0;
+	dev->xfade.out.output_multiplier = 1 << MULT_POINT;
+	dev->xfade.buf    = buf;
+	return (k * AUDIO_BUFFER_SIZE + partial) / (44100 * 4 / 1000);
+}
+
+/* buffers[bufind] is full of fresh data: time align and volume adjust it,
+   and hand it over to the IRQ side.
+
+   Volume adjustment looks one buffer ahead, so it's buffers[prevhead] that
+   gets scaled here.  The per-track gain rides along in the same multiply:
+   each buffer ramps to the gain that was in force when it was queued, so
+   a gain set just before the first write of a new track ramps in across
+   that track's first buffer. */
+static void empeg_audio_queue_buffer(audio_dev *dev, int bufind)
+{
+	extern void hijack_voladj_update_history(int);
+	extern int  hijack_voladj_enabled;
+	unsigned long flags;
+	int multiplier, scaling;
+	unsigned int peak = 0;
+	short *buf = (short *)dev->buffers[bufind].data;
+
+	delay_one_channel((unsigned short *)buf);
+	audio_buf_clean(dev, bufind);
+
+	scaling = hijack_voladj_enabled
+		|| dev->gain.target != (1 << MULT_POINT)
+		|| dev->gain.prev   != (1 << MULT_POINT)
+		|| dev->gain.ramp.output_multiplier != (1 << MULT_POINT);
+	if (hijack_voladj_enabled) {
+		multiplier = voladj_check( &(dev->voladj), buf );
+		peak = dev->voladj.max_sample;	/* voladj_check() has scanned it already */
+	} else {
+		multiplier = (1 << MULT_POINT);
+		if (scaling)
+			peak = voladj_peak(buf, AUDIO_BUFFER_SIZE / 2);
+	}
+	dev->voladj.desired_multiplier = multiplier;
+	hijack_voladj_update_history(multiplier);
+
+#if AUDIO_DEBUG_VERBOSE
+	printk("mults: des=%x,out=%x\n", dev->voladj.desired_multiplier, dev->voladj.output_multiplier);
+#endif
+	save_flags_cli(flags);
+	if (dev->prevhead < 0) {
+		/* Just after empeg_audio_crossfade_start(): nothing queued needs
+		   scaling, and the ramp carries on from where it got to */
+	} else if (dev->used > 1 && (scaling || dev->xfade.buf)) {
+		short *prev = (short *)dev->buffers[dev->prevhead].data;
+		int target = audio_gain_combine(multiplier, dev->gain.prev,
+				(peak > dev->gain.prevpeak) ? peak : dev->gain.prevpeak);
+		dev->used--;
+		restore_flags(flags);
+		if (scaling) {
+			voladj_scale( &(dev->gain.ramp), target, prev );
+			dev->voladj.output_multiplier = multiplier;
+		}
+		/* The outgoing track was scaled when it was first queued, so
+		   it's blended in only after the incoming one has been too */
+		if (dev->xfade.buf)
+			empeg_audio_crossfade(dev, prev);
+		audio_buf_clean(dev, dev->prevhead);
+		save_flags_cli(flags);
+		dev->used++;
+	} else if (scaling) {
+		dev->voladj.output_multiplier = 1 << MULT_POINT;
+		dev->gain.ramp.output_multiplier = 1 << MULT_POINT;
+	}
+	dev->gain.prev     = dev->gain.target;
+	dev->gain.prevpeak = peak;
+
+	/* Now the buffer is ready, we can tell the IRQ section there's new data */
+	dev->used++;
+	audio_mmap_sync(dev);
+	restore_flags(flags);
+
+	dev->prevhead = bufind;
+
+	/* Update hwm */
+	if (dev->used > dev->stats.buffer_hwm)
+		dev->stats.buffer_hwm=dev->used;
+}
+
+/* Switch to hijack_audio_buffers deep buffering, if that's different from
+   now.  This only happens once the ring has drained and DMA has moved on
+   to zeros, so that no buffer is in flight while the indices are reset. */
+static void empeg_audio_resize(audio_dev *dev)
+{
+	extern int hijack_audio_buffers;	// from arch/arm/special/hijack.c
+	static int clamped = 0;
+	unsigned long flags;
+	int n = hijack_audio_buffers;
+
+	if (n < AUDIO_MIN_BUFFERS)
+		n = AUDIO_MIN_BUFFERS;
+	else if (n > dev->maxbuffers) {
+		if (n != clamped) {	/* just once for each setting */
+			clamped = n;
+			printk(AUDIO_NAME ": audio_buffers=%d limited to %d\n", n, dev->maxbuffers);
+		}
+		n = dev->maxbuffers;
+	}
+	if (n == dev->nbuffers || dev->mapped || dev->partial)
+		return;
+	save_flags_cli(flags);
+	if (dev->used == 0 && dev->dma_idle >= 2) {
+		dev->nbuffers = n;
+		dev->head = dev->tail = dev->prevhead = 0;
+		dev->free = MAX_FREE_BUFFERS(dev);
+		dev->mmap_info->buffer_count = n;
+		if (dev->stats.buffer_hwm > n)
+			dev->stats.buffer_hwm = 0;
+	}
+	restore_flags(flags);
+}
+
+/* Queue up to count buffers that an mmap() client has filled in place,
+   starting at buffers[head].  Returns the number actually queued. */
+static int empeg_audio_mmap_commit(audio_dev *dev, int count)
+{
+	int queued = 0;
+
+	if (!dev->mapped)
+		return -EINVAL;
+	if (dev->partial)	/* don't mix with a half-written buffer */
+		return -EBUSY;
+	while (queued < count && dev->free > 0) {
+		unsigned long flags, data;
+		int bufind;
+
+		save_flags_cli(flags);
+		dev->free--;
+		restore_flags(flags);
+
+		bufind = dev->head++;
+		if (dev->head == dev->nbuffers)
+			dev->head = 0;
+
+		/* Drop any (clean) lines still cached from the last time
+		   round, so that we see what the application wrote */
+		data = (unsigned long)dev->buffers[bufind].data;
+		processor.u.armv3v4._flush_cache_area(data, data + AUDIO_BUFFER_SIZE, 0);
+
+		dev->stats.samples += AUDIO_BUFFER_SIZE;
+		empeg_audio_queue_buffer(dev, bufind);
+		++queued;
 	}
+	if (queued)
+		dev->good_data = 1;
+	return queued;
+}
+
+static void empeg_audio_vma_open(struct vm_area_struct *vma)
+{
+	audio[0].mapped++;
+}
+
+static void empeg_audio_vma_close(struct vm_area_struct *vma)
+{
+	audio[0].mapped--;
+}
 
-	/* First work out which channel to delay */
-	if (offset < 0) {	// Right channel?
-		channel = 1;
-		offset = -offset;
+static struct vm_operations_struct audio_vm_ops =
+{
+	open:		empeg_audio_vma_open,
+	close:		empeg_audio_vma_close,
+};
+
+/* Map the info page and the buffer ring straight into userspace.  The
+   mapping is uncached but bufferable, which suits an application that
+   just streams PCM into it; see audio_buf_clean() for the kernel side. */
+static int empeg_audio_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	audio_dev *dev = &audio[0];
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_offset != 0 || size > AUDIO_MMAP_SIZE(dev))
+		return -EINVAL;
+
+	/* Keep it locked in place, like the display's mapping */
+	vma->vm_flags |= (VM_SHM|VM_LOCKED);
+	pgprot_val(vma->vm_page_prot) &= ~PTE_CACHEABLE;
+
+	if (remap_page_range(vma->vm_start, virt_to_phys(dev->ring), size, vma->vm_page_prot))
+		return -EAGAIN;
+	vma->vm_ops = &audio_vm_ops;
+	if (!dev->mapped++) {
+		/* Nothing cached may be written back over the application's data from now on */
+		processor.u.armv3v4._flush_cache_area((unsigned long)dev->buffers,
+			(unsigned long)dev->buffers + sizeof(audio_buf) * dev->maxbuffers, 0);
 	}
+	audio_mmap_sync(dev);
+	return 0;
+}
 
-	// Convert 0.1ms units into samples: 4.41 samples per 0.1ms (no floating point)
-       	offset *= 441;
-       	offset /= 100;
-       	offset *= 2;	// offset is doubled here because buf[] contains pairs of (Left,Right) samples
+/* Find (or set up) the overlay stream belonging to an O_SYNC file.
+   Returns ERR_PTR(-EBUSY) when all the streams are taken. */
+static audio_overlay_t *empeg_audio_overlay_get(struct file *file)
+{
+	audio_overlay_t *ov = file->private_data;
+	audio_buf *buffers;
+	unsigned long flags;
+	int i;
 
-	bufend  = buf + (AUDIO_BUFFER_SIZE / sizeof(short));
-	buftail = bufend - offset + channel;
+	if (ov)
+		return ov;
+	if ((buffers = kmalloc(sizeof(audio_buf) * AUDIO_OVERLAY_BUFFERS, GFP_KERNEL)) == NULL) {
+		printk(AUDIO_NAME ": can't get memory for audio overlay buffers");
+		return ERR_PTR(-ENOMEM);
+	}
+	save_flags_cli(flags);
+	for (i = 0; i < AUDIO_OVERLAY_STREAMS; ++i) {
+		ov = &audio_overlay[i];
+		if (ov->owner == NULL) {
+			ov->buffers = buffers;
+			ov->head = ov->tail = ov->used = 0;
+			ov->free = MAX_FREE_OVERLAY_BUFFERS;
+			ov->priority = 0;
+			ov->gain = AUDIO_OVERLAY_GAIN_UNITY;
+			ov->owner = file;
+			restore_flags(flags);
+			file->private_data = ov;
+#if AUDIO_OVERLAY_DEBUG
+			printk("audio overlay stream %d initialized\n", i);
+#endif
+			return ov;
+		}
+	}
+	restore_flags(flags);
+	kfree(buffers);
+	return ERR_PTR(-EBUSY);	/* quietly: the writer may well retry */
+}
 
-	// copy tail of delayed channel from buf[] into spare delay_buf[];
-	d = delay_buf[spare];	// select the spare buffer
-	for (b = buftail; b < bufend; b += 2)
-		*d++ = *b;
+/* Drop whatever is still queued on a closing file's overlay stream.  Mixing
+   happens entirely within the interrupt, so once the stream is unhooked
+   nothing else can be looking at its buffers. */
+static void empeg_audio_overlay_put(struct file *file)
+{
+	audio_overlay_t *ov = file->private_data;
+	audio_buf *buffers;
+	unsigned long flags;
 
-	// shift body of delayed channel in buf[] towards its tail
-	for (b = buftail - 2; b >= buf; b -= 2)
-		b[offset] = b[0];
+	if (ov == NULL)
+		return;
+	save_flags_cli(flags);
+	buffers = ov->buffers;
+	ov->buffers = NULL;
+	ov->used = ov->free = 0;
+	ov->owner = NULL;
+	restore_flags(flags);
+	file->private_data = NULL;
+	kfree(buffers);
+}
 
-	// move active delay_buf[] contents into head of delayed channel in buf[]
-	d = delay_buf[spare = !spare];	// select the active buffer: becomes the spare buffer after we finish here
-	bufend = buf + offset;
-	for (b = buf + channel; b < bufend; b += 2)
-		*b = *d++;
+static int empeg_audio_release(struct inode *inode, struct file *file)
+{
+	empeg_audio_overlay_put(file);
+	return 0;
 }
 
 static int empeg_audio_write(struct file *file,
@@ -864,12 +1430,6 @@ static int empeg_audio_write(struct file *file,
 	if((ret = verify_area(VERIFY_READ, buffer, count)) != 0)
 		return ret;
 	
-	/* Count must be a multiple of the buffer size */
-	if (count % AUDIO_BUFFER_SIZE) {
-	        printk("non-4608 byte write (%d)\n", count);
-		return -EINVAL;
-	}
-
 	if (count == 0) {
 		printk("zero byte write\n");
 		return 0;
@@ -877,34 +1437,23 @@ static int empeg_audio_write(struct file *file,
 
 	if( (file->f_flags & O_SYNC) )
 	{
-      if ( !audio_overlay.initialized )
-      {
-        int i;
-        unsigned long flags;
-#if AUDIO_OVERLAY_DEBUG
-        printk("audio overlay initializing\n");
-#endif
+		audio_overlay_t *ov;
 
-        save_flags_cli(flags);
-        if ((audio_overlay.buffers=kmalloc(sizeof(audio_buf)*AUDIO_OVERLAY_BUFFERS,GFP_KERNEL))==NULL)
-            printk(AUDIO_NAME ": can't get memory for audio overlay buffers");
-        for(i = 0; i < AUDIO_OVERLAY_BUFFERS; i++)
-            audio_overlay.buffers[i].count = 0;
-        audio_overlay.head = audio_overlay.tail = audio_overlay.used = 0;
-        audio_overlay.free = MAX_FREE_OVERLAY_BUFFERS;
-        restore_flags(flags);
-        audio_overlay.initialized = 1;
-#if AUDIO_OVERLAY_DEBUG
-        printk("audio overlay initialized\n");
-#endif
-      }
+		/* Overlay writes must still be a multiple of the buffer size */
+		if (count % AUDIO_BUFFER_SIZE) {
+			printk("non-4608 byte overlay write (%d)\n", count);
+			return -EINVAL;
+		}
 
-		if (audio_overlay.free==0) {
+		ov = empeg_audio_overlay_get(file);
+		if (IS_ERR(ov))
+			return PTR_ERR(ov);
+		if (ov->free==0) {
 		    struct wait_queue wait = { current, NULL };
 	
 		    add_wait_queue(&dev->waitq, &wait);
 		    current->state = TASK_INTERRUPTIBLE;
-		    while (audio_overlay.free == 0) {
+		    while (ov->free == 0) {
 			schedule();
 		    }
 		    current->state = TASK_RUNNING;
@@ -912,30 +1461,33 @@ static int empeg_audio_write(struct file *file,
 
 		}
 		// fill data to overlay buffers instead
-		while( count > 0 && audio_overlay.free > 0 )
+		while( count > 0 && ov->free > 0 )
 		{
 			unsigned long flags;
 			save_flags_cli(flags);
-			audio_overlay.free--;
+			ov->free--;
 			restore_flags(flags);
 
-			copy_from_user( audio_overlay.buffers[ audio_overlay.head++ ].data, buffer, AUDIO_BUFFER_SIZE );
-			if( audio_overlay.head == AUDIO_OVERLAY_BUFFERS )
-				audio_overlay.head = 0;
+			copy_from_user( ov->buffers[ ov->head++ ].data, buffer, AUDIO_BUFFER_SIZE );
+			if( ov->head == AUDIO_OVERLAY_BUFFERS )
+				ov->head = 0;
+			buffer += AUDIO_BUFFER_SIZE;
 			total += AUDIO_BUFFER_SIZE;
 			count -= AUDIO_BUFFER_SIZE;
 			
 			save_flags_cli(flags);
-			audio_overlay.used++;
+			ov->used++;
 			restore_flags(flags);
 		}
 		return total;
 	}
 
+	empeg_audio_resize(dev);
+
 	/* Any space left? (No need to disable IRQs: we're just checking for a
 	   full buffer condition) */
 	/* This version doesn't have races, see p209 of Linux Device Drivers */
-	if (dev->free == 0) {
+	if (dev->free == 0 && !dev->partial) {
 	    struct wait_queue wait = { current, NULL };
 
 	    add_wait_queue(&dev->waitq, &wait);
@@ -947,73 +1499,44 @@ static int empeg_audio_write(struct file *file,
 	    remove_wait_queue(&dev->waitq, &wait);
 	}
 
-	/* Fill as many buffers as we can */
-	while(count > 0 && dev->free > 0) {
-		unsigned long flags;
-		unsigned short *buf;
-                int multiplier;
-		extern void hijack_voladj_update_history(int);
-		extern int  hijack_voladj_enabled;
+	/* Fill as many buffers as we can.  Writes needn't be a multiple of
+	   the buffer size: any odd bytes stay in buffers[head] (already
+	   counted out of dev->free) until the next write completes it. */
+	while(count > 0 && (dev->partial || dev->free > 0)) {
+		int n;
 
-		/* Critical sections kept as short as possible to give good
-		   latency for other tasks */
-		save_flags_cli(flags);
-		dev->free--;
-		restore_flags(flags);
+		if (!dev->partial) {
+			unsigned long flags;
+
+			/* Critical sections kept as short as possible to give good
+			   latency for other tasks */
+			save_flags_cli(flags);
+			dev->free--;
+			restore_flags(flags);
+		}
 
-                thisbufind = dev->head;
-		/* Copy chunk of data from user-space. We're safe updating the
+		/* Copy chunk of data from user-space. We're safe using the
 		   head when not in cli() as this is the only place the head
 		   gets twiddled */
-
-                dev->head++;
-		if (dev->head == AUDIO_NOOF_BUFFERS)
-			dev->head = 0;
-
-		buf = (unsigned short *)dev->buffers[thisbufind].data;
-		copy_from_user(dev->buffers[thisbufind].data,buffer,AUDIO_BUFFER_SIZE);
-		delay_one_channel(buf);
-		total += AUDIO_BUFFER_SIZE;
-		/* Oops, we missed this in previous versions */
-		buffer += AUDIO_BUFFER_SIZE;
-		dev->stats.samples += AUDIO_BUFFER_SIZE;
-		count -= AUDIO_BUFFER_SIZE;
-
-		if (hijack_voladj_enabled)
-			multiplier = voladj_check( &(dev->voladj), (short *) (dev->buffers[thisbufind].data) );
-		else
-			multiplier = (1 << MULT_POINT);
-		dev->voladj.desired_multiplier = multiplier;
-		hijack_voladj_update_history(multiplier);
-
-#if AUDIO_DEBUG_VERBOSE
-	printk("mults: des=%x,out=%x\n", dev->voladj.desired_multiplier, dev->voladj.output_multiplier);
-#endif
-		save_flags_cli(flags);
-		if (hijack_voladj_enabled) {
-			if (dev->used > 1) {
-				dev->used--;
-				restore_flags(flags);
-				voladj_scale( &(dev->voladj), dev->voladj.desired_multiplier,
-						(short *) (dev->buffers[ dev->prevhead ].data) );
-				save_flags_cli(flags);
-				dev->used++;
-			} else {
-				dev->voladj.output_multiplier = 1 << MULT_POINT;
-			}
+		n = AUDIO_BUFFER_SIZE - dev->partial;
+		if (n > count)
+			n = count;
+		copy_from_user(dev->buffers[dev->head].data + dev->partial, buffer, n);
+		total += n;
+		buffer += n;
+		dev->stats.samples += n;
+		count -= n;
+		dev->partial += n;
+
+		if (dev->partial == AUDIO_BUFFER_SIZE) {
+			dev->partial = 0;
+			thisbufind = dev->head++;
+			if (dev->head == dev->nbuffers)
+				dev->head = 0;
+			empeg_audio_queue_buffer(dev, thisbufind);
 		}
-
-		/* Now the buffer is ready, we can tell the IRQ section there's new data */
-		dev->used++;
-		restore_flags(flags);
-
-		dev->prevhead = thisbufind;
 	}
 
-	/* Update hwm */
-	if (dev->used > dev->stats.buffer_hwm)
-		dev->stats.buffer_hwm=dev->used;
-
 	/* We have data (houston) */
 	dev->good_data = 1;
 
@@ -1030,6 +1553,8 @@ static unsigned int empeg_audio_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &dev->waitq, wait);
 
 	/* Now we check our state and return corresponding flags */
+	if( file->private_data )
+		return ((audio_overlay_t *)file->private_data)->free > 0 ? (POLLOUT | POLLWRNORM) : 0;
 	if( dev->free > 0 )
 	        return POLLOUT | POLLWRNORM;
 	else
@@ -1051,12 +1576,16 @@ static int empeg_audio_purge(audio_dev *dev)
 	bytes=dev->used*AUDIO_BUFFER_SIZE;
 
 	/* Empty buffers */
-	dev->head=dev->tail=dev->used=0;
-	dev->free=MAX_FREE_BUFFERS;
+	dev->head=dev->tail=dev->used=dev->partial=0;
+	dev->free=MAX_FREE_BUFFERS(dev);
+	audio_mmap_sync(dev);
+
+	/* A crossfade in progress would only be faded into the wrong thing */
+	empeg_audio_crossfade_end(dev);
 	
 	/* Clear delay buffer out otherwise we get it when the next data comes through */
-	if (delay_buf[0])
-		memset(delay_buf[0], 0, delay_buf_bytes);	// clear both buffers
+	if (delay_ring[0])
+		memset(delay_ring[0], 0, 2 * DELAY_RING_SIZE * sizeof(short));	// clear both delay lines
 
 	/* Let it run again */
 	restore_flags(flags);
@@ -1091,12 +1620,57 @@ static int empeg_audio_ioctl(struct inode *inode, struct file *file,
 	{
 	        int pretail = dev->tail - 1;
 	        if( pretail < 0 )
-	            pretail += AUDIO_NOOF_BUFFERS;
+	            pretail += dev->nbuffers;
 
 		return copy_to_user((char *) arg,
 		                    dev->buffers[pretail].data,
 				    AUDIO_BUFFER_SIZE);
         }	
+	case EMPEG_DSP_MMAP_COMMIT:
+		return empeg_audio_mmap_commit(dev, (int)arg);
+
+	case EMPEG_DSP_SET_BUFFERS:
+	{
+		extern int hijack_audio_buffers;	// from arch/arm/special/hijack.c
+		int n;
+		get_user_ret(n, (int *)arg, -EFAULT);
+		if (n < AUDIO_MIN_BUFFERS || n > dev->maxbuffers)
+			return -EINVAL;
+		hijack_audio_buffers = n;	/* takes effect once the ring drains */
+		empeg_audio_resize(dev);
+		return 0;
+	}
+	case EMPEG_DSP_GET_BUFFERS:
+		put_user_ret(dev->nbuffers, (int *)arg, -EFAULT);
+		return 0;
+
+	case EMPEG_DSP_CROSSFADE:
+		return empeg_audio_crossfade_start(dev, (int)arg);
+
+	case EMPEG_DSP_SET_GAIN:
+		if ((int)arg < AUDIO_GAIN_MIN_DB * 256 || (int)arg > AUDIO_GAIN_MAX_DB * 256)
+			return -EINVAL;
+		dev->gain.db     = (int)arg;
+		dev->gain.target = audio_gain_from_db((int)arg);
+		return 0;
+
+	case EMPEG_DSP_OVERLAY_SET:
+	{
+		struct empeg_dsp_overlay_t parms;
+		audio_overlay_t *ov;
+		if (!(file->f_flags & O_SYNC))	/* only overlay writers, never the player's own fd */
+			return -EINVAL;
+		if (copy_from_user(&parms, (void *)arg, sizeof(parms)))
+			return -EFAULT;
+		if (parms.gain < 0 || parms.gain > AUDIO_OVERLAY_GAIN_UNITY)
+			return -EINVAL;
+		ov = empeg_audio_overlay_get(file);
+		if (IS_ERR(ov))
+			return PTR_ERR(ov);
+		ov->priority = parms.priority;
+		ov->gain     = parms.gain;
+		return 0;
+	}
 	}
 
 	/* invalid command */
@@ -1223,65 +1797,137 @@ static void empeg_audio_beep_end_sched(void *unused)
 	dsp_write(Y_sinusMode, 0x89a);
 }
 
-// consumes 1.7% of CPU time on 220MHz SA1100 when processing 176400 bytes/second
-void audio_mix( signed short* pDstSample, signed short* pSrcSample )
+// Scales mix->dst by mix->dst_gain and sums every mix->src into it, with
+// saturation, in a single pass over the buffer.  Gains are 16.16 fixed
+// point, no more than 1.0.  Each source costs about ten instructions per
+// stereo pair on top of the fixed cost of the destination.
+static void audio_mix_streams( audio_mix_t *mix )
 {
 
-__asm__ (
+__asm__ __volatile__ (
 		"stmfd	r13!, {r0-r12,r14}\n\t"
 		
 		// initialize registers
-		"ldr	r1, %0\n\t"				// r1 = audio_overlay_bg_volume
-		"ldr	r4, %1\n\t"				// r4 = pDstSample
-		"ldr	r5, %2\n\t"				// r5 = pSrcSample
-		"mov	r6, #2304\n\t"			// r6 = loop counter
-		"sub	r6, r6, #1\n\t"			// r6 -= 1
-		"mov	r7, #65280\n\t"			// r7 = ...
-		"add	r7, r7, #255\n\t"		// r7 = 0xFFFF
-		"mov	r8, #32512\n\t"			// r8 = ...
-		"add	r8, r8, #255\n\t"		// r8 = 32767
-
-		".MixLoopStart:\n\t"
-
-		// scale destination sample down by fixed-point multiplier
-		"ldrsh	r0, [r4]\n\t"			// r0 = *pDstSample
-		"mov	r0, r0, lsl#16\n\t"		// r0 <<= 16
-		"smull  r2, r3, r1, r0\n\t"		// r2 = lo(r1 * r0), r3 = hi(r1 * r0)
-		"adc	r2, r2, #32768\n\t"		// r2 += 32768 + carry
-		"mov	r2, r2, lsr#16\n\t"		// r2 >>= 16
-		"and	r3, r3, r7\n\t"			// r3 &= r7
-		"orr	r0, r2, r3, lsl#16\n\t"	// r0 = r2 | (r3 << 16)
-		
-		// add source sample to scaled destination sample
-		"ldrsh	r2, [r5]\n\t"			// r2 = *pSrcSample
-		"add	r2, r2, r0, asr#16\n\t"	// r2 += (r0 >> 16)
-	
-		// clamp destination sample up
-		"cmp	r2, r8\n\t"				// if( r2 > 32767 )
-		"movgt	r2, r8\n\t"				//     r2 = 32767
-
-		// clamp destination sample down
-		"cmn	r2, r8\n\t"				// if( r2 < -32768 )
-		"mvnlt	r2, r8\n\t"				//     r2 = -32768
-
-		// put processed sample back to memory
-		"strh	r2, [r4]\n\t"			// *pDstSample = r2
-
-		"add	r4, r4, #2\n\t"			// r4 += 2 (get next dst sample pointer)
-		"add	r5, r5, #2\n\t"			// r5 += 2 (get next src sample pointer)
+		"mov	r12, %0\n\t"			// r12 = mix
+		"ldmia	r12, {r0-r2}\n\t"		// r0 = dst, r1 = dst_gain, r2 = words
+		"mov	r3, #0\n\t"			// r3 = byte offset into the sources
+
+		"1:\n\t"
+
+		// scale destination pair by dst_gain into r4 (left), r5 (right)
+		"ldr	r10, [r0]\n\t"
+		"mov	r11, r10, lsl#16\n\t"
+		"mov	r11, r11, asr#16\n\t"		// r11 = left
+		"mul	r4, r11, r1\n\t"
+		"mov	r4, r4, asr#16\n\t"
+		"mov	r11, r10, asr#16\n\t"		// r11 = right
+		"mul	r5, r11, r1\n\t"
+		"mov	r5, r5, asr#16\n\t"
+
+		// add in each source
+		"ldr	r7, [r12, #12]\n\t"		// r7 = nsrc
+		"add	r6, r12, #16\n\t"		// r6 = &src[0]
+		"cmp	r7, #0\n\t"
+		"beq	3f\n\t"
+		"2:\n\t"
+		"ldmia	r6!, {r8-r9}\n\t"		// r8 = data, r9 = gain
+		"ldr	r10, [r8, r3]\n\t"
+		"mov	r11, r10, lsl#16\n\t"
+		"mov	r11, r11, asr#16\n\t"
+		"mul	r14, r11, r9\n\t"
+		"add	r4, r4, r14, asr#16\n\t"	// left += (left * gain) >> 16
+		"mov	r11, r10, asr#16\n\t"
+		"mul	r14, r11, r9\n\t"
+		"add	r5, r5, r14, asr#16\n\t"	// right += (right * gain) >> 16
+		"subs	r7, r7, #1\n\t"
+		"bne	2b\n\t"
+		"3:\n\t"
+
+		// clamp to -32768..32767: out of range if bits 31..15 differ
+		"mov	r14, r4, asr#15\n\t"
+		"teq	r14, r4, asr#31\n\t"
+		"movne	r14, r4, asr#31\n\t"		// r14 = 0 or -1
+		"eorne	r4, r14, #0x7f00\n\t"
+		"eorne	r4, r4, #0xff\n\t"		// r4 = 0x7fff or 0x...8000
+		"mov	r14, r5, asr#15\n\t"
+		"teq	r14, r5, asr#31\n\t"
+		"movne	r14, r5, asr#31\n\t"
+		"eorne	r5, r14, #0x7f00\n\t"
+		"eorne	r5, r5, #0xff\n\t"
+
+		// put processed pair back to memory
+		"strh	r4, [r0], #2\n\t"
+		"strh	r5, [r0], #2\n\t"
+		"add	r3, r3, #4\n\t"
 
 		// loop back
-		"subs	r6, r6, #1\n\t"			// r6 -= 1
-		"bpl	.MixLoopStart\n\t"
+		"subs	r2, r2, #1\n\t"
+		"bne	1b\n\t"
 
 		"ldmfd	r13!, {r0-r12,r14}\n\t"
 		: // no outputs
-		: "m" (audio_overlay_bg_volume), "m" (pDstSample), "m" (pSrcSample) );
+		: "r" (mix)
+		: "cc", "memory" );
+}
+
+// returns the number of overlay streams with data queued
+static int audio_overlay_busy(void)
+{
+	int i, busy = 0;
+
+	for (i = 0; i < AUDIO_OVERLAY_STREAMS; ++i) {
+		if (audio_overlay[i].used > 0)
+			++busy;
+	}
+	return busy;
 }
 
 int audio_overlay_in_use()
 {
-	return audio_overlay.used > 0;
+	return audio_overlay_busy() > 0;
+}
+
+// scales dst by dst_gain, and (if consume is set) mixes in the next buffer
+// from every busy overlay stream, ducking those below the top priority
+static void audio_overlay_mix( signed short *dst, int dst_gain, int consume )
+{
+	audio_mix_t mix;
+	audio_overlay_t *ov;
+	int i, top = 0, first = 1;
+
+	mix.dst      = dst;
+	mix.dst_gain = dst_gain;
+	mix.words    = AUDIO_BUFFER_SIZE / 4;
+	mix.nsrc     = 0;
+	if (consume) {
+		for (i = 0; i < AUDIO_OVERLAY_STREAMS; ++i) {
+			ov = &audio_overlay[i];
+			if (ov->used > 0 && (first || ov->priority > top)) {
+				top = ov->priority;
+				first = 0;
+			}
+		}
+		for (i = 0; i < AUDIO_OVERLAY_STREAMS; ++i) {
+			ov = &audio_overlay[i];
+			if (ov->used > 0) {
+				audio_mix_src_t *src = &mix.src[mix.nsrc++];
+				src->data = (signed short *)ov->buffers[ov->tail].data;
+				src->gain = ov->gain;
+				if (ov->priority < top)
+					src->gain = (src->gain >> 8) * (hijack_overlay_bg_min >> 8);
+			}
+		}
+	}
+	audio_mix_streams(&mix);
+	if (consume) {
+		for (i = 0; i < AUDIO_OVERLAY_STREAMS; ++i) {
+			ov = &audio_overlay[i];
+			if (ov->used > 0) {
+				if( ++ov->tail == AUDIO_OVERLAY_BUFFERS ) ov->tail = 0;
+				ov->used--; ov->free++;
+			}
+		}
+	}
 }
 
 // copies audio data to dma; if audio buffer and overlay buffer both has
@@ -1290,18 +1936,24 @@ int audio_overlay_in_use()
 // parameter: dma_register == 0 == DBSA0/DBTA0, dma_register == 1 == DBSB0/DBTB0
 void audio_data_to_dma( int dma_register )
 {
+	extern void hijack_spectrum_feed(const short *buf);	// from arch/arm/special/hijack.c
 	static int iSwitchToPCM = 0;
 	static int iFadeVolumeUp = 0;
 	static int iStoredVolume = 0;
 	static int iSam = 0;  // Did we change SAM?
-	int iPreviousOverlayUsed = audio_overlay.used;
+	int iOverlayBusy = audio_overlay_busy();
 	audio_dev *dev=&audio[0];
 
-	if ( audio_overlay.used > 0 && !iSam ) {
+	if (dev->used)
+		dev->dma_idle = 0;
+	else if (dev->dma_idle < 2)
+		dev->dma_idle++;
+
+	if ( iOverlayBusy && !iSam ) {
 		iSam = 1;
 		empeg_mixer_setsam(0); // Disable SAM whilst overlay is active.
 	}
-	else if ( audio_overlay.used == 0 && iSam ) {
+	else if ( !iOverlayBusy && iSam ) {
 		iSam = 0;
 		empeg_mixer_setsam(sam); // Restore player's SAM setting.
 	}
@@ -1310,10 +1962,10 @@ void audio_data_to_dma( int dma_register )
 
 	if( empeg_mixer_get_input() != 1 ) // INPUT_PCM
 	{
-		if( audio_overlay.used > 0 && !iSwitchToPCM )
+		if( iOverlayBusy && !iSwitchToPCM )
 		{
 #if AUDIO_OVERLAY_DEBUG
-            printk("audio_overlay.used > 0 && !iSwitchToPCM\n");
+            printk("iOverlayBusy && !iSwitchToPCM\n");
 #endif
 			if( !iFadeVolumeUp )
 				iStoredVolume = empeg_mixer_getvolume();
@@ -1329,7 +1981,7 @@ void audio_data_to_dma( int dma_register )
 		    	DBSB0=(unsigned char*)virt_to_phys(dev->buffers[dev->tail].data);
 		    else
 		    	DBSA0=(unsigned char*)virt_to_phys(dev->buffers[dev->tail].data);
-			if (++dev->tail==AUDIO_NOOF_BUFFERS) dev->tail=0;
+			if (++dev->tail==dev->nbuffers) dev->tail=0;
 			dev->used--; dev->free++;
 		}
 		else
@@ -1346,7 +1998,7 @@ void audio_data_to_dma( int dma_register )
 		// dsp mode is PCM
 		if( dev->used == 0 )
 		{
-			if( audio_overlay.used == 0 )
+			if( !iOverlayBusy )
 			{
 				if( dma_register )
 					DBSB0=(unsigned char*)_ZeroMem;
@@ -1357,17 +2009,19 @@ void audio_data_to_dma( int dma_register )
 			{
 				//audio_overlay_bg_volume = AUDIO_OVERLAY_BG_VOLUME_FADED;
                 audio_overlay_bg_volume = hijack_overlay_bg_min;
+				// nothing from the player: mix the overlays on their own
+				audio_overlay_mix( audio_overlay_mixbuf[dma_register], 0, 1 );
+				clean_cache_area( audio_overlay_mixbuf[dma_register], AUDIO_BUFFER_SIZE );
+				hijack_spectrum_feed( audio_overlay_mixbuf[dma_register] );
 				if( dma_register )
-		    		DBSB0=(unsigned char*)virt_to_phys(audio_overlay.buffers[audio_overlay.tail].data);
+		    		DBSB0=(unsigned char*)virt_to_phys(audio_overlay_mixbuf[1]);
 		    	else
-		    		DBSA0=(unsigned char*)virt_to_phys(audio_overlay.buffers[audio_overlay.tail].data);
-				if( ++audio_overlay.tail == AUDIO_OVERLAY_BUFFERS ) audio_overlay.tail = 0;
-				audio_overlay.used--; audio_overlay.free++;
+		    		DBSA0=(unsigned char*)virt_to_phys(audio_overlay_mixbuf[0]);
 			}
 		}
 		else
 		{
-			if( audio_overlay.used > 0 )
+			if( iOverlayBusy )
 			{
 
 				//if( audio_overlay_bg_volume > AUDIO_OVERLAY_BG_VOLUME_FADED )
@@ -1378,15 +2032,11 @@ void audio_data_to_dma( int dma_register )
 					audio_overlay_bg_volume -= hijack_overlay_bg_fadestep;
 					if( audio_overlay_bg_volume < hijack_overlay_bg_min )
 						audio_overlay_bg_volume = hijack_overlay_bg_min;
-					audio_mix( (signed short*)dev->buffers[ dev->tail ].data, &audio_zero_sample[0] );
+					audio_overlay_mix( (signed short*)dev->buffers[ dev->tail ].data, audio_overlay_bg_volume, 0 );
 				}
 				else
 				{
-					audio_mix( (signed short*)dev->buffers[ dev->tail ].data, 
-							   (signed short*)audio_overlay.buffers[ audio_overlay.tail ].data );
-
-					if( ++audio_overlay.tail == AUDIO_OVERLAY_BUFFERS ) audio_overlay.tail = 0;
-					audio_overlay.used--; audio_overlay.free++;
+					audio_overlay_mix( (signed short*)dev->buffers[ dev->tail ].data, audio_overlay_bg_volume, 1 );
 				}
 			}
 			else
@@ -1397,21 +2047,23 @@ void audio_data_to_dma( int dma_register )
                     audio_overlay_bg_volume += hijack_overlay_bg_fadestep;
 					if( audio_overlay_bg_volume > hijack_overlay_bg_max )
 						audio_overlay_bg_volume = hijack_overlay_bg_max;
-					audio_mix( (signed short*)dev->buffers[ dev->tail ].data, &audio_zero_sample[0] );
+					audio_overlay_mix( (signed short*)dev->buffers[ dev->tail ].data, audio_overlay_bg_volume, 0 );
 
 				}
 			}
 			
+			audio_buf_clean(dev, dev->tail);
+			hijack_spectrum_feed( (short*)dev->buffers[ dev->tail ].data );
             if( dma_register )
 		    	DBSB0=(unsigned char*)virt_to_phys(dev->buffers[dev->tail].data);
 		    else
 		    	DBSA0=(unsigned char*)virt_to_phys(dev->buffers[dev->tail].data);
-			if (++dev->tail==AUDIO_NOOF_BUFFERS) dev->tail=0;
+			if (++dev->tail==dev->nbuffers) dev->tail=0;
 			dev->used--; dev->free++;
 		}
         
 		// if all overlay buffers are played and user DSP mode is different, do a change		
-		if( audio_overlay.used == 0 && iPreviousOverlayUsed > 0 &&
+		if( !audio_overlay_busy() && iOverlayBusy &&
 		    empeg_mixer_get_input() != empeg_mixer_get_user_input() )
 		{
 			if( !iFadeVolumeUp )
@@ -1470,6 +2122,41 @@ void audio_data_to_dma( int dma_register )
 	}
 }
 
+/* Note an underrun, with a timestamp, for /proc/audio */
+static void empeg_audio_log_underrun(audio_dev *dev, int irq)
+{
+	int i = dev->stats.underrun_idx++ & (AUDIO_UNDERRUN_LOG - 1);
+
+	if (irq)
+		dev->stats.irq_underruns++;
+	else
+		dev->stats.user_underruns++;
+	dev->stats.underrun_log[i].jiffies = jiffies;
+	dev->stats.underrun_log[i].irq = irq;
+}
+
+extern unsigned long jiffies_since(unsigned long past_jiffies);	// arch/arm/special/empeg_input.c
+
+/* Track the lowest fill level seen in each second */
+static inline void empeg_audio_log_fill(audio_dev *dev)
+{
+	audio_stats *stats = &dev->stats;
+
+	if (dev->used < stats->fill_min)
+		stats->fill_min = dev->used;
+	if (jiffies_since(stats->fill_start) >= HZ) {
+		int level = stats->fill_min;
+		if (level >= AUDIO_FILL_BUCKETS)
+			level = AUDIO_FILL_BUCKETS - 1;
+		stats->fill_hist[level]++;
+		stats->fill_recent[stats->fill_recent_idx] = stats->fill_min;
+		if (++stats->fill_recent_idx == AUDIO_FILL_RECENT)
+			stats->fill_recent_idx = 0;
+		stats->fill_start = jiffies;
+		stats->fill_min = dev->used;
+	}
+}
+
 /*                      
  * Interrupt processing 
  */
@@ -1482,6 +2169,7 @@ static void empeg_audio_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 #if AUDIO_DEBUG_STATS
 	dev->stats.interrupts++;
 #endif
+	empeg_audio_log_fill(dev);
 
 	/* Work out which DMA buffer we need to attend to first */
 	dofirst = ( ((status & DCSR_BIU) && (status & DCSR_STRTB)) ||
@@ -1496,13 +2184,13 @@ static void empeg_audio_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 		if( dev->used == 0 && dev->good_data )
 		{
 			dev->good_data = 0;
-			dev->stats.user_underruns++;
+			empeg_audio_log_underrun(dev, 0);
 		}
 		audio_data_to_dma( 0 );
 		
 		if (!(status & DCSR_STRTB)) {
 			/* Filling both buffers: possible IRQ underrun */
-			dev->stats.irq_underruns++;
+			empeg_audio_log_underrun(dev, 1);
 			audio_data_to_dma( 1 );
 			
 			/* Start both channels */
@@ -1520,13 +2208,13 @@ static void empeg_audio_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 		if( dev->used == 0 && dev->good_data )
 		{
 			dev->good_data = 0;
-			dev->stats.user_underruns++;
+			empeg_audio_log_underrun(dev, 0);
 		}
 		audio_data_to_dma( 1 );
 		
 		if (!(status & DCSR_STRTA)) {
 			/* Filling both buffers: possible IRQ underrun */
-			dev->stats.irq_underruns++;
+			empeg_audio_log_underrun(dev, 1);
 			audio_data_to_dma( 0 );
 
 			/* Start both channels */
@@ -1539,6 +2227,7 @@ static void empeg_audio_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	}
 
 	trigger_display_redraw();
+	audio_mmap_sync(dev);
 
 	/* Wake up waiter */
 	wake_up_interruptible(&dev->waitq);
@@ -1596,6 +2285,7 @@ static int empeg_audio_read_proc(char *buf, char **start, off_t offset,
 				 int length, int *eof, void *private )
 {
 	audio_dev *dev = &audio[0];
+	int i;
 
 	length = 0;
 	length += sprintf(buf + length,
@@ -1613,6 +2303,35 @@ static int empeg_audio_read_proc(char *buf, char **start, off_t offset,
 			  dev->stats.buffer_hwm,
 			  dev->stats.user_underruns,
 			  dev->stats.irq_underruns);
+
+	length += sprintf(buf + length, "buffers   : %d of %d (%d bytes each)\n",
+			  dev->nbuffers, dev->maxbuffers, AUDIO_BUFFER_SIZE);
+	length += sprintf(buf + length, "track gain: %d/256 dB, multiplier %d/%d\n",
+			  dev->gain.db, dev->gain.ramp.output_multiplier, 1 << MULT_POINT);
+
+	/* Seconds spent with each lowest fill level, and the last minute of them */
+	length += sprintf(buf + length, "fill hist :");
+	for (i = 0; i < AUDIO_FILL_BUCKETS; ++i) {
+		if (dev->stats.fill_hist[i])
+			length += sprintf(buf + length, " %d%s:%lu", i,
+				(i == AUDIO_FILL_BUCKETS - 1) ? "+" : "", dev->stats.fill_hist[i]);
+	}
+	length += sprintf(buf + length, "\nfill 60s  :");
+	for (i = 0; i < AUDIO_FILL_RECENT; ++i)
+		length += sprintf(buf + length, " %d",
+			dev->stats.fill_recent[(dev->stats.fill_recent_idx + i) % AUDIO_FILL_RECENT]);
+	length += sprintf(buf + length, "\n");
+
+	/* Most recent underruns, oldest first, in seconds since boot */
+	i = dev->stats.underrun_idx - AUDIO_UNDERRUN_LOG;
+	if (i < 0)
+		i = 0;
+	for (; i < dev->stats.underrun_idx; ++i) {
+		unsigned long when = dev->stats.underrun_log[i & (AUDIO_UNDERRUN_LOG - 1)].jiffies;
+		length += sprintf(buf + length, "underrun  : %lu.%02lu %s\n", when / HZ,
+			(when % HZ) * 100 / HZ,
+			dev->stats.underrun_log[i & (AUDIO_UNDERRUN_LOG - 1)].irq ? "irq" : "user");
+	}
 	
 	return length;
 }
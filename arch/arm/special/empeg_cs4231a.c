@@ -48,6 +48,9 @@
 #include <asm/hardware.h>
 #include <linux/proc_fs.h>
 #include <linux/poll.h>
+#include <linux/wrapper.h>
+#include <asm/uaccess.h>
+#include <asm/pgtable.h>
 
 /* For the userspace interface */
 #include <linux/empeg.h>
@@ -85,7 +88,7 @@ static struct file_operations cs4231_fops = {
   NULL, /* readdir */
   cs4231_poll,
   cs4231_ioctl,
-  NULL, /* mmap */
+  cs4231_mmap,
   cs4231_open,
   NULL, /* flush */
   cs4231_release,
@@ -111,6 +114,129 @@ extern unsigned long jiffies_since(unsigned long past_jiffies);	// arch/arm/spec
 static int cs4231a_not_found = 0;
 static struct timer_list simulate_timer;
 
+#if CS4231_PERIODS > EMPEG_AUDIOIN_MAX_PERIODS
+#error "CS4231_PERIODS is too big for struct empeg_audioin_mmap_info"
+#endif
+
+static inline unsigned char *cs4231_period(struct cs4231_dev *dev, int period)
+{
+	return dev->rx_buffer + (period * CS4231_PERIOD_SIZE);
+}
+
+/* Mirror the ring indices into the page that mmap() clients see */
+static inline void cs4231_mmap_sync(struct cs4231_dev *dev)
+{
+	struct empeg_audioin_mmap_info *info = dev->mmap_info;
+
+	if (dev->mapped) {
+		info->head     = dev->rx_head;
+		info->tail     = dev->rx_tail;
+		info->used     = dev->rx_used;
+		info->overruns = dev->overruns;
+		clean_cache_area(info, sizeof(*info));
+	}
+}
+
+/* Empty the capture ring, and start the next FIQ bufferload afresh */
+static void cs4231_reset_ring(struct cs4231_dev *dev)
+{
+	unsigned long flags;
+	struct pt_regs regs;
+
+	save_flags_clif(flags);
+	if (!cs4231a_not_found) {
+		get_fiq_regs(&regs);
+		regs.ARM_r8=(int)dev->fiq_buffer[dev->fiq_index];
+		regs.ARM_r9=((int)dev->fiq_buffer[dev->fiq_index])+CS4231_FIQ_BYTES;
+		set_fiq_regs(&regs);
+	}
+	dev->rx_head = dev->rx_tail = 0;
+	dev->rx_fill = dev->rx_offset = 0;
+	dev->rx_used = 0;
+	dev->rx_seq  = 0;
+	dev->dec_count = dev->dec_ch = 0;
+	dev->dec_sum[0] = dev->dec_sum[1] = 0;
+	cs4231_mmap_sync(dev);
+	restore_flags(flags);
+}
+
+/* File "n" samples away into the capture ring, decimating them on the
+ * way in if asked to.  This runs from the IRQ with FIQs enabled, so the
+ * FIQ can already be filling the other half of fiq_buffer.  A NULL buffer
+ * means silence (for when the chip isn't there).
+ */
+static void cs4231_capture(struct cs4231_dev *dev, short *p, int n)
+{
+	dev->samples += n;
+	if (dev->decimate > 1) {
+		if (!p) {
+			n /= dev->decimate;
+		} else {
+			/* In place: the output never overtakes the input */
+			int channels = dev->stereo ? 2 : 1, i;
+			short *out = p;
+			for (i = 0; i < n; ++i) {
+				dev->dec_sum[dev->dec_ch] += p[i];
+				if (++dev->dec_ch == channels) {
+					dev->dec_ch = 0;
+					if (++dev->dec_count == dev->decimate) {
+						int c;
+						for (c = 0; c < channels; ++c) {
+							*out++ = (dev->dec_sum[c] * dev->dec_recip) >> 15;
+							dev->dec_sum[c] = 0;
+						}
+						dev->dec_count = 0;
+					}
+				}
+			}
+			n = out - p;
+		}
+	}
+
+	n *= 2;		/* bytes from here on */
+	while (n > 0) {
+		unsigned char *dst;
+		int chunk;
+
+		if (dev->rx_used == CS4231_PERIODS) {
+			/* Ring full: the rest of this bufferload is lost */
+			dev->overruns += n;
+			break;
+		}
+		dst = cs4231_period(dev, dev->rx_head) + dev->rx_fill;
+		chunk = CS4231_PERIOD_SIZE - dev->rx_fill;
+		if (chunk > n)
+			chunk = n;
+		if (p) {
+			memcpy(dst, p, chunk);
+			p += chunk / 2;
+		} else {
+			memset(dst, 0, chunk);
+		}
+		if (dev->mapped)
+			clean_cache_area(dst, chunk);
+		n -= chunk;
+		dev->rx_fill += chunk;
+
+		if (dev->rx_fill == CS4231_PERIOD_SIZE) {
+			/* Period complete: stamp it and make it available */
+			struct timeval tv;
+			int period = dev->rx_head;
+
+			do_gettimeofday(&tv);
+			dev->mmap_info->period[period].seq  = dev->rx_seq++;
+			dev->mmap_info->period[period].sec  = tv.tv_sec;
+			dev->mmap_info->period[period].usec = tv.tv_usec;
+			dev->mmap_info->period[period].rate = dev->samplerate / dev->decimate;
+			dev->rx_fill = 0;
+			if (++dev->rx_head == CS4231_PERIODS)
+				dev->rx_head = 0;
+			dev->rx_used++;
+			cs4231_mmap_sync(dev);
+		}
+	}
+}
+
 /* When the cs4231a chip is "not responding" (hung or not present),
  * we have to simulate sampling from it, normally
  * the rate is 29400 stereo (4-byte) samples/sec.
@@ -124,12 +250,10 @@ static void cs4231a_simulate_irq (unsigned long unused)
 	elapsed = jiffies_since(timestamp);
 	timestamp  += elapsed;
 	hz_samples += elapsed * dev->samplerate;
-	samples = (hz_samples / HZ) * 4;
+	samples = (hz_samples / HZ) * 2;
 	hz_samples %= HZ;
-	dev->rx_used += samples;
-	dev->samples += samples;
-	if (dev->rx_used > CS4231_BUFFER_SIZE)
-		dev->rx_used = CS4231_BUFFER_SIZE;
+	if (dev->open)
+		cs4231_capture(dev, NULL, samples);
 	wake_up_interruptible(&dev->rx_wq);
 	simulate_timer.expires = jiffies + 1;
 	add_timer(&simulate_timer);
@@ -140,10 +264,10 @@ static void cs4231a_simulate_irq (unsigned long unused)
 /**********************************************************************/
 void cs4231_irq(int irq,void *dev_id, struct pt_regs *iregs)
 {
-	int a=0; unsigned char d,*p;
 	struct cs4231_dev *dev=cs4231_devices;
 	struct pt_regs regs;
 	unsigned long flags;
+	short *p, *q, *end;
 
 	/* Disable FIQs: this should be a formality as we're the only
 	   FIQ user on the empeg */
@@ -155,41 +279,35 @@ void cs4231_irq(int irq,void *dev_id, struct pt_regs *iregs)
 	/* Clear edge */
 	GEDR=EMPEG_CRYSTALDRQ;
 
-	/* Buffer bytes which FIQ has fetched */
+	/* Samples which FIQ has fetched */
 	get_fiq_regs(&regs);
-	p=(unsigned char*)dev->fiq_buffer;
-	a=(regs.ARM_r8-((int)dev->fiq_buffer));
-	dev->samples+=a/2;
-	if (a>dev->rx_free) a=dev->rx_free;
-	dev->rx_used+=a;
-	dev->rx_free-=a;
-	while(a--) {
-		dev->rx_buffer[dev->rx_head++]=*p++;
-		if (dev->rx_head==CS4231_BUFFER_SIZE) dev->rx_head=0;
-	}
+	p=dev->fiq_buffer[dev->fiq_index];
+	q=(short*)regs.ARM_r8;
+	end=p+(sizeof(dev->fiq_buffer[0])/sizeof(short));
 
-	/* Read bytes until DRQ low */
+	/* Read samples until DRQ low, into the overrun space */
 	do {
-		d=READDMA();
-		if (dev->rx_free) {
-			dev->rx_buffer[dev->rx_head++]=d;
-			if (dev->rx_head==CS4231_BUFFER_SIZE) dev->rx_head=0;
-			dev->rx_used++;
-			dev->rx_free--;
-		}
-		dev->samples++;
+		unsigned char lo=READDMA(), hi=READDMA();
+		if (q<end)
+			*q++=lo|(hi<<8);
+		else
+			dev->overruns+=2;
 	} while((GPLR&EMPEG_CRYSTALDRQ)==0);
 
-	/* Wait up waiters */
-	wake_up_interruptible(&dev->rx_wq);
-
-	/* Set up registers for next bufferload */
-	regs.ARM_r8=(int)dev->fiq_buffer;
-	regs.ARM_r9=((int)dev->fiq_buffer)+512;
+	/* Set up registers for next bufferload, in the other half */
+	dev->fiq_index^=1;
+	regs.ARM_r8=(int)dev->fiq_buffer[dev->fiq_index];
+	regs.ARM_r9=((int)dev->fiq_buffer[dev->fiq_index])+CS4231_FIQ_BYTES;
 	set_fiq_regs(&regs);
 
 	/* Re-enable FIQs - may cause an instant FIQ */
 	restore_flags(flags);
+
+	/* ..and file this one away while that fills */
+	cs4231_capture(dev,p,q-p);
+
+	/* Wait up waiters */
+	wake_up_interruptible(&dev->rx_wq);
 }
 
 static struct { short samplerate; char setup; } samplerates[]={
@@ -208,7 +326,7 @@ static int setmode(struct cs4231_dev *dev, int channel, int rate, int stereo,
 		if (rate >= 0)
 			dev->samplerate = rate;
 		if ((stereo >= 0 || rate >= 0) && dev->open)
-			dev->rx_used=0;
+			cs4231_reset_ring(dev);
 		return 0;
 	}
 
@@ -318,22 +436,10 @@ static int setmode(struct cs4231_dev *dev, int channel, int rate, int stereo,
 
 	/* Reset capture if device is open */
 	if (stopped && dev->open) {
-		unsigned long flags;
-		struct pt_regs regs;
 		int a;
 
-		/* Dump buffer */
-		save_flags_clif(flags);
-		get_fiq_regs(&regs);
-		regs.ARM_r8=(int)dev->fiq_buffer;
-		regs.ARM_r9=((int)dev->fiq_buffer)+512;
-		set_fiq_regs(&regs);
-		
-		/* Nothing in our buffer */
-		dev->rx_head=dev->rx_tail=0;
-		dev->rx_used=0;
-		dev->rx_free=CS4231_BUFFER_SIZE;
-		restore_flags(flags);
+		/* Dump buffer: nothing in our ring */
+		cs4231_reset_ring(dev);
 		
 		/* Sync up fifo by emptying it */
 		for(a=0;a<64;a++) READDMA();
@@ -350,6 +456,10 @@ static int cs4231_read_procmem(char *buf, char **start, off_t offset, int len, i
 {
 	struct cs4231_dev *dev = cs4231_devices;
 	len = sprintf(buf,"samples: %d\n",dev->samples);
+	len+=sprintf(buf+len,"periods: %d of %d used (%d bytes each), %u completed\n",
+		dev->rx_used,(int)CS4231_PERIODS,CS4231_PERIOD_SIZE,dev->rx_seq);
+	len+=sprintf(buf+len,"overruns: %u bytes\n",dev->overruns);
+	len+=sprintf(buf+len,"decimate: %d\n",dev->decimate);
 
 	LOG(0);
 	len+=sprintf(buf+len,"Log: %s",log);
@@ -374,12 +484,31 @@ void __init empeg_cs4231_init(void)
         struct cs4231_dev *dev=cs4231_devices;
 	int result,version;
 	extern int hijack_cs4231a_failed;	// hijack.c
+	int i;
+
+	/* Allocate the capture ring: an info page, then the periods.  The
+	   pages are reserved so that they can be mmap()ed */
+	dev->ring = __get_free_pages(GFP_KERNEL, CS4231_RING_ORDER);
+	if (!dev->ring) {
+		printk(KERN_WARNING "Could not allocate memory for audio input buffer\n");
+		return;
+	}
+	for (i = 0; i < CS4231_MMAP_SIZE; i += PAGE_SIZE)
+		mem_map_reserve(MAP_NR(dev->ring + i));
+	dev->mmap_info = (struct empeg_audioin_mmap_info *)dev->ring;
+	memset(dev->mmap_info, 0, PAGE_SIZE);
+	dev->mmap_info->period_count = CS4231_PERIODS;
+	dev->mmap_info->period_size  = CS4231_PERIOD_SIZE;
+	dev->mmap_info->data_offset  = PAGE_SIZE;
+	dev->rx_buffer = (unsigned char *)(dev->ring + PAGE_SIZE);
 
 	/* Initialise buffer bits */
 	dev->rx_head = dev->rx_tail = 0;
+	dev->rx_fill = dev->rx_offset = 0;
 	dev->rx_used = 0;
-	dev->rx_free = CS4231_BUFFER_SIZE;
 	dev->rx_wq   = NULL;
+	dev->decimate  = 1;
+	dev->dec_recip = 32768;
 
 	MECR=(MECR&0xffff0000)|0x0007;
 
@@ -422,13 +551,6 @@ void __init empeg_cs4231_init(void)
 	/* 22kHz, aux input, mono, no gain */
 	setmode(dev,EMPEG_AUDIOIN_CHANNEL_AUXIN,22050,0,0);
 
-	/* Allocate buffers */
-	dev->rx_buffer=vmalloc(CS4231_BUFFER_SIZE);
-	if (!dev->rx_buffer) {
-		printk(KERN_WARNING "Could not allocate memory for audio input buffer\n");
-		return;
-	}
-	
 	/* Claim IRQ: this gets called when the DMA (FIQ) buffer is full
 	   and does the less time-critical work */
        	result=request_irq(2,cs4231_irq,0,"empeg_cs4231",dev);
@@ -441,8 +563,8 @@ void __init empeg_cs4231_init(void)
 		unsigned long flags;
 
 		/* Install DMA handler */
-		regs.ARM_r8=(int)dev->fiq_buffer;
-		regs.ARM_r9=((int)dev->fiq_buffer)+512;
+		regs.ARM_r8=(int)dev->fiq_buffer[dev->fiq_index];
+		regs.ARM_r9=((int)dev->fiq_buffer[dev->fiq_index])+CS4231_FIQ_BYTES;
 		regs.ARM_r10=0xe0000060; /* Where to read from */
 		regs.ARM_fp=(int)&GPLR; /* r11 */
 		set_fiq_regs(&regs);
@@ -539,14 +661,45 @@ static int cs4231_release(struct inode *inode, struct file *flip)
 	return 0;
 }
 
+/* Bytes that read() can take from the tail period right now.  With no
+   complete periods, that's whatever has arrived in the one being filled.
+   rx_used and rx_fill must be sampled together: if a period completes in
+   between, rx_fill drops back to zero and we'd go negative */
+static int cs4231_readable(struct cs4231_dev *dev)
+{
+	unsigned long flags;
+	int readable;
+
+	save_flags_cli(flags);
+	if (dev->rx_used)
+		readable = CS4231_PERIOD_SIZE - dev->rx_offset;
+	else
+		readable = dev->rx_fill - dev->rx_offset;
+	restore_flags(flags);
+	return (readable > 0) ? readable : 0;
+}
+
+/* Done with the tail period: give it back to the IRQ side */
+static void cs4231_release_period(struct cs4231_dev *dev)
+{
+	unsigned long flags;
+
+	save_flags_cli(flags);
+	dev->rx_offset = 0;
+	if (++dev->rx_tail == CS4231_PERIODS)
+		dev->rx_tail = 0;
+	dev->rx_used--;
+	cs4231_mmap_sync(dev);
+	restore_flags(flags);
+}
+
 /* Read data from audio buffer */
 static ssize_t cs4231_read(struct file *flip, char *dest, size_t count, loff_t *ppos)
 {
 	struct cs4231_dev *dev=flip->private_data;
-	unsigned long flags;
-	size_t bytes;
+	size_t copied = 0;
 
-	while (dev->rx_used==0) {
+	while (cs4231_readable(dev)<=0) {
 		if (flip->f_flags & O_NONBLOCK)
 			return -EAGAIN;
       
@@ -556,30 +709,27 @@ static ssize_t cs4231_read(struct file *flip, char *dest, size_t count, loff_t *
 			return -ERESTARTSYS;
 	}
 
-	/* We can copy data out of the sound buffer without disabling IRQs, as
+	/* We can copy data out of the ring without disabling IRQs, as
 	   we're the only people who will be fiddling with the tail */
-	if (count>dev->rx_used) count=dev->rx_used;
-	if (cs4231a_not_found) {
-		memset(dest, 0, count);
-		goto done;
-	}
-	bytes=count;
-	while (bytes--) {
-		*dest++ = dev->rx_buffer[dev->rx_tail++];
-		if (dev->rx_tail==CS4231_BUFFER_SIZE)
-			dev->rx_tail=0;
+	while (copied < count) {
+		int readable = cs4231_readable(dev);
+		size_t chunk;
+		if (readable <= 0)
+			break;
+		chunk = readable;
+		if (chunk > (count - copied))
+			chunk = count - copied;
+		if (copy_to_user(dest + copied, cs4231_period(dev, dev->rx_tail) + dev->rx_offset, chunk))
+			return copied ? copied : -EFAULT;
+		copied += chunk;
+
+		/* After the time consuming stuff has been done, we can now
+		   let the IRQ routine know that there's more room in the ring */
+		dev->rx_offset += chunk;
+		if (dev->rx_offset == CS4231_PERIOD_SIZE)
+			cs4231_release_period(dev);
 	}
-
-	/* After the time consuming stuff has been done, we can now let the
-	   rest of the world (ie, the IRQ routine) know that there's more
-	   room in the buffer */
-   done:
-	save_flags_cli(flags);
-	dev->rx_free+=count;
-	dev->rx_used-=count;
-	restore_flags(flags);
-
-	return count;
+	return copied;
 }
 
 static unsigned int cs4231_poll(struct file *filp, poll_table *wait)
@@ -590,12 +740,51 @@ static unsigned int cs4231_poll(struct file *filp, poll_table *wait)
 	poll_wait(filp, &dev->rx_wq, wait);
 
 	/* Is there stuff in the read buffer? */
-	if (dev->rx_used)
+	if (cs4231_readable(dev))
 		mask |= POLLIN | POLLRDNORM;
 
 	return mask;
 }
 
+static void cs4231_vma_open(struct vm_area_struct *vma)
+{
+	cs4231_devices[0].mapped++;
+}
+
+static void cs4231_vma_close(struct vm_area_struct *vma)
+{
+	cs4231_devices[0].mapped--;
+}
+
+static struct vm_operations_struct cs4231_vm_ops =
+{
+	open:		cs4231_vma_open,
+	close:		cs4231_vma_close,
+};
+
+/* Map the info page and the capture ring straight into userspace,
+   uncached, so that the application sees each period as soon as the
+   IRQ has cleaned it out of the cache */
+static int cs4231_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct cs4231_dev *dev = filp->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_offset != 0 || size > CS4231_MMAP_SIZE)
+		return -EINVAL;
+
+	vma->vm_flags |= (VM_SHM|VM_LOCKED);
+	pgprot_val(vma->vm_page_prot) &= ~PTE_CACHEABLE;
+
+	if (remap_page_range(vma->vm_start, virt_to_phys(dev->ring), size, vma->vm_page_prot))
+		return -EAGAIN;
+	vma->vm_ops = &cs4231_vm_ops;
+	if (!dev->mapped++)
+		clean_cache_area(dev->ring, CS4231_MMAP_SIZE);
+	cs4231_mmap_sync(dev);
+	return 0;
+}
+
 static int cs4231_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct cs4231_dev *dev = filp->private_data;
@@ -641,6 +830,29 @@ static int cs4231_ioctl(struct inode *inode, struct file *filp, unsigned int cmd
 		/* Set gain */
 		get_user_ret(parm, (int*)arg, -EFAULT);
 		return setmode(dev,-1,-1,-1,parm);
+
+	case EMPEG_AUDIOIN_READ_DECIMATE:
+		put_user_ret(dev->decimate, (int*)arg, -EFAULT);
+		return 0;
+
+	case EMPEG_AUDIOIN_WRITE_DECIMATE:
+		/* Average each "parm" samples into one: data already
+		   in the ring is at the old rate, so it goes */
+		get_user_ret(parm, (int*)arg, -EFAULT);
+		if (parm < 1 || parm > CS4231_MAX_DECIMATE)
+			return -EINVAL;
+		dev->decimate  = parm;
+		dev->dec_recip = 32768 / parm;
+		cs4231_reset_ring(dev);
+		return 0;
+
+	case EMPEG_AUDIOIN_RELEASE:
+		/* mmap() clients are done with the oldest "arg" periods */
+		if ((int)arg < 0 || (int)arg > dev->rx_used)
+			return -EINVAL;
+		for (parm = arg; parm > 0; --parm)
+			cs4231_release_period(dev);
+		return 0;
 	}
 
 	return -EINVAL;
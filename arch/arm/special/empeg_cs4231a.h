@@ -3,16 +3,29 @@
 
 struct cs4231_dev
 {
-	/* Receive buffer for audio data */
-	char *rx_buffer;
-	int rx_head;
-	int rx_tail;
-	int rx_used;
-	int rx_free;
-	int rx_count;
+	/* Capture ring: an info page, followed by CS4231_PERIODS periods */
+	unsigned long ring;
+	struct empeg_audioin_mmap_info *mmap_info;
+	unsigned char *rx_buffer;	/* period 0 */
+	int rx_head;			/* period being filled */
+	int rx_fill;			/* bytes in it so far */
+	int rx_tail;			/* period being read */
+	int rx_offset;			/* bytes of it already read */
+	int rx_used;			/* complete periods waiting */
+	unsigned int rx_seq;		/* periods completed since the last reset */
+	unsigned int overruns;		/* bytes dropped because the ring was full */
+	int mapped;
 
-	/* Queue for FIQ - 128 bytes for overrun */
-	short fiq_buffer[256+64];
+	/* Optional decimation (boxcar average) on the way into the ring */
+	int decimate;
+	int dec_recip;			/* 32768 / decimate */
+	int dec_count, dec_ch;
+	int dec_sum[2];
+
+	/* Queues for FIQ - 128 bytes for overrun each.  The FIQ fills
+	   one while the IRQ files the other away */
+	short fiq_buffer[2][256+64];
+	int fiq_index;
 
 	/* Blocking queue */
 	struct wait_queue *rx_wq;
@@ -29,7 +42,12 @@ struct cs4231_dev
 };
 
 /* Buffer sizes */
-#define CS4231_BUFFER_SIZE          65536
+#define CS4231_FIQ_BYTES	512
+#define CS4231_RING_ORDER	4	/* 64KB */
+#define CS4231_MMAP_SIZE	(PAGE_SIZE << CS4231_RING_ORDER)
+#define CS4231_PERIOD_SIZE	2048
+#define CS4231_PERIODS		((CS4231_MMAP_SIZE - PAGE_SIZE) / CS4231_PERIOD_SIZE)
+#define CS4231_MAX_DECIMATE	4
 
 /* Declarations */
 static ssize_t cs4231_read(struct file*,char*,size_t,loff_t*);
@@ -37,6 +55,7 @@ static int cs4231_ioctl(struct inode*,struct file*,unsigned int,unsigned long);
 static int cs4231_open(struct inode*,struct file*);
 static int cs4231_release(struct inode*,struct file*);
 static unsigned int cs4231_poll(struct file *filp, poll_table *table);
+static int cs4231_mmap(struct file *filp, struct vm_area_struct *vma);
 
 /* External initialisation */
 void empeg_cs4231_init(void);
@@ -507,11 +507,57 @@ static void composite_board_output(unsigned char *source_buffer)
 
 /* Do a direct refresh straight to the screen */
 
+/* Bumped, and waiters woken, whenever a different frame is blatted:
+   used by /proc/empeg_screen_stream in notify.c */
+unsigned long display_frame_generation = 0;
+struct wait_queue *display_frame_waitq = NULL;
+
+/* Most frames handed to display_blat() are the same as the one before,
+   so check a quick hash of the logical frame first.  This walks the
+   2048 bytes with ldmia, four words at a time, in around 1300 cycles,
+   against roughly 12000 for the transpose below (25000 when it was in C),
+   and a great deal more for the LCD/composite outputs.  Returns 0 if the
+   frame can be skipped. */
+
+static int display_frame_changed(struct display_dev *dev, unsigned char *source_buffer)
+{
+	unsigned long hash = 5381, *s = (unsigned long *)source_buffer;
+	int blocks = EMPEG_SCREEN_SIZE / 16;
+
+	/* A frame from an odd place (eg. on the stack) is just drawn */
+	if (((unsigned long)s & 3)) {
+		dev->blat_valid = 0;
+		return 1;
+	}
+	__asm__ __volatile__(
+		"1:\n\t"
+		"ldmia	%1!, {r4-r7}\n\t"
+		"add	%0, %0, %0, lsl #5\n\t"	// hash = (hash * 33) ^ word
+		"eor	%0, %0, r4\n\t"
+		"add	%0, %0, %0, lsl #5\n\t"
+		"eor	%0, %0, r5\n\t"
+		"add	%0, %0, %0, lsl #5\n\t"
+		"eor	%0, %0, r6\n\t"
+		"add	%0, %0, %0, lsl #5\n\t"
+		"eor	%0, %0, r7\n\t"
+		"subs	%2, %2, #1\n\t"
+		"bne	1b\n\t"
+		: "+r" (hash), "+r" (s), "+r" (blocks)
+		: // no inputs
+		: "r4", "r5", "r6", "r7", "cc", "memory");
+
+	if (dev->blat_valid && hash == dev->blat_hash)
+		return 0;
+	dev->blat_hash  = hash;
+	dev->blat_valid = 1;
+	return 1;
+}
+
 /* Plot a pixel on the actual display */
 /* Screen-blatting function to move data from virtual screen buffer to actual
    screen buffer, translating the pixel layout to the one which makes your
    head hurt */
-void display_blat(struct display_dev *dev, unsigned char *source_buffer)
+static void display_blat_frame(struct display_dev *dev, unsigned char *source_buffer)
 {
 #ifdef CONFIG_EMPEG_DISPLAY_INVERTED
 	int x,y,p;
@@ -547,17 +593,36 @@ void display_blat(struct display_dev *dev, unsigned char *source_buffer)
 	/* The main body of the screen is logical */
 	for(c=0;c<63;c++) {
 		/* Do one pair of columns: non-special case ones (ie not the
-		   ends of the display). Start at the bottom... */
-		s+=(64*32);
-		for(r=0;r<32;r++) {
-			/* Next line is 64 bytes away (screen is 128 wide,
-			   4bpp) */
-			s-=64;
-			
-			/* Take pixel pair */
-			*d++=s[0]>>4;
-			*d++=s[1];
-		}
+		   ends of the display). Start at the bottom, and work up
+		   four lines (64 bytes apart) at a time, storing each as
+		   (s[0]>>4) | (s[1]<<16): the two shorts the C used to do */
+		unsigned char *p=s+(64*31);
+		int rows=32;
+
+		__asm__ __volatile__(
+			"1:\n\t"
+			"ldrb	r8, [%1, #1]\n\t"
+			"ldrb	r4, [%1], #-64\n\t"
+			"ldrb	r9, [%1, #1]\n\t"
+			"ldrb	r5, [%1], #-64\n\t"
+			"mov	r4, r4, lsr #4\n\t"
+			"orr	r4, r4, r8, lsl #16\n\t"
+			"ldrb	r8, [%1, #1]\n\t"
+			"ldrb	r6, [%1], #-64\n\t"
+			"mov	r5, r5, lsr #4\n\t"
+			"orr	r5, r5, r9, lsl #16\n\t"
+			"ldrb	r9, [%1, #1]\n\t"
+			"ldrb	r7, [%1], #-64\n\t"
+			"mov	r6, r6, lsr #4\n\t"
+			"orr	r6, r6, r8, lsl #16\n\t"
+			"mov	r7, r7, lsr #4\n\t"
+			"orr	r7, r7, r9, lsl #16\n\t"
+			"stmia	%0!, {r4-r7}\n\t"
+			"subs	%2, %2, #4\n\t"
+			"bne	1b\n\t"
+			: "+r" (d), "+r" (p), "+r" (rows)
+			: // no inputs
+			: "r4", "r5", "r6", "r7", "r8", "r9", "cc", "memory");
 		
 		/* Next column is two pixels to the right */
 		s++;
@@ -582,6 +647,15 @@ void display_blat(struct display_dev *dev, unsigned char *source_buffer)
 #endif
 }
 
+void display_blat(struct display_dev *dev, unsigned char *source_buffer)
+{
+	if (display_frame_changed(dev, source_buffer)) {
+		display_blat_frame(dev, source_buffer);
+		++display_frame_generation;
+		wake_up_interruptible(&display_frame_waitq);
+	}
+}
+
 /* Clear the screen */
 static void display_clear(struct display_dev *dev)
 {	
@@ -101,6 +101,10 @@ struct display_dev
 	int queue_used;
 	int queue_free;
 
+	/* Hash of the last frame blatted, so that repeats can be skipped */
+	unsigned long blat_hash;
+	unsigned blat_valid : 1;
+
 	unsigned power : 1;
 };
 
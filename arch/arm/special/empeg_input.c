@@ -68,7 +68,13 @@
  * So, in summary:
  *
  *   0000 0000 mmmm mmmm  mmmm mmmm xxxx xxxx = Button down
- *   1000 0000 mmmm mmmm  mmmm mmmm xxxx xxxx = Button up */
+ *   1000 0000 mmmm mmmm  mmmm mmmm xxxx xxxx = Button up
+ *
+ * Remotes decoded through ir_protocols[] (Sony, RC5, RC6) use a fixed
+ * "manufacturer" byte per protocol, followed by up to 16 bits of
+ * their own address and command:
+ *
+ *   0000 0000 pppp pppp  aaaa aaaa cccc cccc */
 
 /* Since we now use jiffies for the repeat handling we're assuming
    that the device won't be up for 497 days :-) */
@@ -103,6 +109,8 @@
 #define US_TO_TICKS(US) ((368 * (US))/100)
 #define TICKS_TO_US(T) ((100 * (T))/368)
 
+#include "empeg_ir_decode.h"
+
 #define IR_DEBUG 0
 
 #define USE_TIMING_QUEUE 1
@@ -184,7 +192,17 @@ struct input_dev
 	unsigned long count_missed;
 #if USE_TIMING_QUEUE
 	unsigned long timings_hwm;
+
+	/* The bottom half only runs when there are edges to decode, and a
+	   timer only while a button is held, for the button up timeout */
+	struct timer_list up_timer;
+	unsigned long count_wakeups;
+	unsigned long start_jiffies;
+	unsigned long latency[8];	/* edge to decode: <128us, <256us, .. >=8ms */
 #endif
+
+	/* Table driven decoders, one per entry in ir_protocols[] */
+	struct ir_decoder decoders[IR_PROTOCOLS];
 };
 
 /* Rotary control deglitching support. When the rotary controls get
@@ -202,6 +220,10 @@ static struct input_dev input_devices[1];
 
 /* Used to disallow multiple opens. */
 static int users = 0;
+
+/* OSCR time of the edge being decoded (0 if none), for the button
+ * latency tracer in hijack.c */
+unsigned long input_edge_time;
 #if USE_TIMING_QUEUE_FIQS
 static struct fiq_handler fh = { NULL, "empeg_input", NULL, NULL };
 #endif
@@ -715,6 +737,33 @@ static inline void input_kenwood_interrupt(struct input_dev *dev, int level,
 	}
 }
 
+extern int hijack_ir_decoders; /* in hijack.c */
+
+/* Results from the table driven decoders in empeg_ir_decode.h */
+static void ir_decoder_malformed(struct input_dev *dev)
+{
+	++dev->count_malformed;
+}
+
+static void ir_decoder_code(struct input_dev *dev, struct ir_decoder *d,
+			    unsigned long data, unsigned long code)
+{
+	/* These remotes resend the whole frame while a button is held,
+	   which we treat like a Kenwood repeat code.  RC5/RC6 flip a
+	   toggle bit for each new press, so the frames differ then. */
+	if (data == d->last_data && dev->current_button_down == code
+	    && jiffies_since(d->last_jiffies) < IR_REPEAT_TIMEOUT) {
+		input_on_remote_repeat(dev);
+		++dev->count_repeat;
+	} else {
+		input_on_remote_code(dev, code);
+		++dev->count_valid;
+		++d->count_valid;
+	}
+	d->last_data = data;
+	d->last_jiffies = jiffies;
+}
+
 static inline void input_capture_interrupt(struct input_dev *dev, int level,
 					unsigned long span)
 {
@@ -740,8 +789,17 @@ static inline void ir_transition(struct input_dev *dev, int level, unsigned long
 		input_capture_interrupt(dev, level, span);
 		break;
 	case IR_TYPE_KENWOOD:
-		input_kenwood_interrupt(dev, level, span);
+	{
+		int decoders = hijack_ir_decoders, i;
+
+		if (decoders & 1)
+			input_kenwood_interrupt(dev, level, span);
+		for (i = 0; (decoders >>= 1) && i < IR_PROTOCOLS; ++i) {
+			if (decoders & 1)
+				ir_decoder_transition(dev, &ir_protocols[i], &dev->decoders[i], level, span);
+		}
 		break;
+	}
 	default:
 		/* Hmm, I wonder what it was supposed to be */
 		dev->remote_type = IR_TYPE_KENWOOD;
@@ -780,10 +838,44 @@ static void input_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	}
 
 	restore_flags(flags);
-	
+
+	/* Wake the bottom half if the queue was empty */
+	if (dev->timings_used == 1) {
+		queue_task(&dev->timer, &tq_immediate);
+		mark_bh(IMMEDIATE_BH);
+	}
 }
 #endif
 
+#if USE_TIMING_QUEUE_FIQS
+/* OS timer 2 matched: the FIQ has queued an edge into an empty queue */
+static void input_doorbell_interrupt(int irq, void *dev_id, struct pt_regs *regs)
+{
+	struct input_dev *dev = dev_id;
+
+	OSSR = OSSR_M2;
+	queue_task(&dev->timer, &tq_immediate);
+	mark_bh(IMMEDIATE_BH);
+}
+#endif
+
+/* If we haven't had a repeat code for a while send a button up,
+ * otherwise come back when we might need to. */
+static void input_check_button_up(struct input_dev *dev)
+{
+	if (dev->current_button_down != 0) {
+		if (jiffies_since(dev->last_ir_jiffies) > REMOTE_BUTTON_UP_TIMEOUT)
+			input_on_remote_up(dev);
+		else
+			mod_timer(&dev->up_timer, dev->last_ir_jiffies + REMOTE_BUTTON_UP_TIMEOUT + 1);
+	}
+}
+
+static void input_up_timeout(unsigned long data)
+{
+	input_check_button_up((struct input_dev *)data);
+}
+
 static void input_check_buffer(void *dev_id)
 {
 	/* This stores the time of the last actual interrupt, not the time this
@@ -793,6 +885,7 @@ static void input_check_buffer(void *dev_id)
 	
 	struct input_dev *dev = dev_id;
 
+	++dev->count_wakeups;
 	while (dev->timings_used) {
 		unsigned long flags;
 		unsigned long entry;
@@ -826,16 +919,24 @@ static void input_check_buffer(void *dev_id)
 		span = interrupt_time - last_interrupt;
 		last_interrupt = interrupt_time;
 
+		/* How long it sat in the queue */
+		{
+			unsigned long us = TICKS_TO_US(OSCR - interrupt_time) >> 7;
+			int bucket = 0;
+			while (us && bucket < 7) {
+				us >>= 1;
+				++bucket;
+			}
+			++dev->latency[bucket];
+		}
+
 		//printk("Transition(%d): %d %5ld\n", dev->timings_tail, level, span);
+		input_edge_time = interrupt_time | 1;
 		ir_transition(dev, level, span);
 	}
+	input_edge_time = 0;
 
-	/* If we haven't had a repeat code for a while send a button up. */
-	if ((dev->current_button_down != 0) && (jiffies_since(dev->last_ir_jiffies) > REMOTE_BUTTON_UP_TIMEOUT))
-		input_on_remote_up(dev);
-	
-	/* Requeue me */
-	queue_task(&dev->timer, &tq_timer);
+	input_check_button_up(dev);
 }
 
 static int input_open(struct inode *inode, struct file *filp)
@@ -988,6 +1089,8 @@ static struct file_operations input_fops = {
 int input_read_procmem(char *buf, char **start, off_t offset, int len, int unused)
 {
 	struct input_dev *dev = input_devices;
+	unsigned long ticks = jiffies - dev->start_jiffies;
+	int i;
 	len = 0;
 
 	len += sprintf(buf+len, "Valid sequences:      %ld\n", dev->count_valid);
@@ -997,6 +1100,17 @@ int input_read_procmem(char *buf, char **start, off_t offset, int len, int unuse
 	len += sprintf(buf+len, "Spurious transitions: %ld\n", dev->count_spurious);
 	len += sprintf(buf+len, "Missed interrupts:    %ld\n", dev->count_missed);
 	len += sprintf(buf+len, "Timings buffer hwm:   %ld\n", dev->timings_hwm);
+	len += sprintf(buf+len, "Decoder wakeups:      %ld (%ld ticks saved)\n", dev->count_wakeups,
+		       ticks > dev->count_wakeups ? ticks - dev->count_wakeups : 0);
+	len += sprintf(buf+len, "Edge to decode (us):  ");
+	for (i = 0; i < 7; ++i)
+		len += sprintf(buf+len, "<%d:%ld ", 128 << i, dev->latency[i]);
+	len += sprintf(buf+len, ">=%d:%ld\n", 128 << 6, dev->latency[7]);	// the last bucket takes the rest
+	for (i = 0; i < IR_PROTOCOLS; ++i) {
+		if (hijack_ir_decoders & (2 << i))
+			len += sprintf(buf+len, "%-4s sequences:       %ld\n",
+				       ir_protocols[i].name, dev->decoders[i].count_valid);
+	}
 
 	return len;
 }
@@ -1044,6 +1158,7 @@ void __init empeg_input_init(void)
 	dev->count_spurious = 0;
 	dev->count_malformed = 0;
 	dev->count_missed = 0;
+	memset(dev->decoders, 0, sizeof(dev->decoders));
 
 #if USE_TIMING_QUEUE
 	dev->timings_hwm = 0;
@@ -1054,11 +1169,17 @@ void __init empeg_input_init(void)
 	dev->timings_tail = 0;
 	dev->timings_buffer = vmalloc(TIMINGS_BUFFER_SIZE * sizeof(unsigned long));
 	
-	/* Set up timer routine to check the buffer */
+	/* Set up the bottom half to decode the buffer: this is queued
+	   when the first edge goes into an empty buffer */
 	dev->timer.sync = 0;
 	dev->timer.routine = input_check_buffer;
 	dev->timer.data = dev;
-	queue_task(&dev->timer, &tq_timer);
+	init_timer(&dev->up_timer);
+	dev->up_timer.function = input_up_timeout;
+	dev->up_timer.data = (unsigned long)dev;
+	dev->count_wakeups = 0;
+	dev->start_jiffies = jiffies;
+	memset(dev->latency, 0, sizeof(dev->latency));
 
 #if USE_TIMING_QUEUE_FIQS
 	/* Install FIQ handler */
@@ -1088,6 +1209,17 @@ void __init empeg_input_init(void)
 	}
 
 #if USE_TIMING_QUEUE_FIQS
+	/* The FIQ's doorbell to the bottom half */
+	OIER &= ~OIER_E2;
+	OSSR = OSSR_M2;
+	result = request_irq(IRQ_OST2, input_doorbell_interrupt, SA_INTERRUPT,
+			     "empeg_input", dev);
+	if (result != 0) {
+		printk(KERN_ERR "Can't get empeg IR doorbell IRQ %d.\n", IRQ_OST2);
+		return;
+	}
+	OIER |= OIER_E2;
+
 	/* It's a FIQ not an IRQ */
 	ICLR|=EMPEG_IRINPUT;
 
@@ -1126,6 +1258,11 @@ static inline void empeg_input_cleanup(void)
 	/* No longer require interrupts */
 	GRER&=~(EMPEG_IRINPUT);
 	GFER&=~(EMPEG_IRINPUT);
+#if USE_TIMING_QUEUE_FIQS
+	OIER &= ~OIER_E2;
+	free_irq(IRQ_OST2, dev);
+#endif
+	del_timer(&dev->up_timer);
 
 	result = unregister_chrdev(EMPEG_IR_MAJOR, "empeg_ir");
 	if (result < 0)
@@ -9,4 +9,9 @@
 
 #define TIMINGS_BUFFER_SIZE 64
 
+/* The FIQ can't queue the bottom half itself, so when the queue goes
+ * from empty to non-empty it sets OS timer 2 to match this many ticks
+ * later, and the match IRQ does it instead. */
+#define TIMINGS_DOORBELL_TICKS 16
+
 #endif
@@ -0,0 +1,207 @@
+/*
+ * empeg-car table driven IR remote decoders
+ */
+
+#ifndef EMPEG_IR_DECODE_H
+#define EMPEG_IR_DECODE_H 1
+
+/* Table driven decoders for other remotes.
+ *
+ * Each transition is first turned into a whole number of the protocol's
+ * time unit (rounded, so +/- half a unit is accepted), and then run
+ * through a small state machine that is shared by all protocols:
+ *
+ *   IR_CODING_PULSE:   Sony SIRC, the bit is in the length of each mark
+ *   IR_CODING_BIPHASE: Philips RC5/RC6, Manchester coded half bits
+ *
+ * NEC remotes are handled by input_kenwood_interrupt() in empeg_input.c,
+ * which is really an NEC decoder with a 16-bit address.
+ *
+ * Protocols are enabled with the "ir_decoders" bitmask in config.ini:
+ * 1 for Kenwood/NEC, plus 2 << (index into ir_protocols[]).
+ *
+ * This lives in a header so that scripts/ir_replay.c can run the very
+ * same decoders over recorded or synthetic edge timings on the build
+ * host.  The includer defines US_TO_TICKS(), and provides
+ * ir_decoder_code() and ir_decoder_malformed() to take the results.
+ */
+
+#define IR_CODING_PULSE		0
+#define IR_CODING_BIPHASE	1
+
+#define IR_DEC_IDLE		0
+#define IR_DEC_LEAD		1	/* had the leading mark, want the space */
+#define IR_DEC_BITS		2
+
+#define IR_UNITS_MAX		16	/* anything longer is a gap */
+#define IR_NO_WIDE_BIT		0xff
+
+struct ir_protocol {
+	const char *name;
+	unsigned long unit;		/* ticks: bit time, or half bit for biphase */
+	unsigned char coding;
+	unsigned char nbits;		/* data bits per frame, start bits included */
+	unsigned char lead_mark;	/* leader in units, 0 if none */
+	unsigned char lead_space;
+	unsigned char zero;		/* PULSE: units for a 0, a 1, and between bits */
+	unsigned char one;		/* BIPHASE: 1 if a "1" is mark then space */
+	unsigned char sync;
+	unsigned char wide_bit;		/* BIPHASE: bit with double length halves */
+	unsigned char lsb_first;
+	unsigned char tag;		/* "manufacturer" byte for our codes */
+	unsigned long check_mask;	/* (data & check_mask) must equal check */
+	unsigned long check;
+	unsigned long code_mask;	/* what ends up in the low 16 bits: not the toggle bit */
+};
+
+static const struct ir_protocol ir_protocols[] = {
+	/* Sony SIRC-12: 2.4ms leader, 7 command then 5 address bits */
+	{"Sony", US_TO_TICKS(600), IR_CODING_PULSE,   12, 4, 0, 1, 2, 1, IR_NO_WIDE_BIT,
+	 1, 0xfd, 0, 0, 0x0fff},
+	/* RC5: S1 S2 T A4..A0 C5..C0, S1's first half is lost in the idle space */
+	{"RC5",  US_TO_TICKS(889), IR_CODING_BIPHASE, 14, 0, 0, 0, 0, 0, IR_NO_WIDE_BIT,
+	 0, 0xfe, 0x2000, 0x2000, 0x17ff},
+	/* RC6 mode 0: leader, start, 3 mode bits, double length toggle, A7..A0 C7..C0 */
+	{"RC6",  US_TO_TICKS(444), IR_CODING_BIPHASE, 21, 6, 2, 0, 1, 0, 4,
+	 0, 0xff, 0x1e0000, 0x100000, 0xffff},
+};
+
+#define IR_PROTOCOLS	(sizeof(ir_protocols) / sizeof(ir_protocols[0]))
+
+/* Per protocol decoder state, kept in struct input_dev */
+struct ir_decoder {
+	unsigned char state;
+	unsigned char bits;	/* data bits so far */
+	unsigned char half;	/* biphase: first half of bit seen (1 + level) */
+	unsigned long data;
+	unsigned long last_data;
+	unsigned long last_jiffies;
+	unsigned long count_valid;
+};
+
+struct input_dev;
+
+/* Provided by the includer: a frame passed its check, or didn't */
+static void ir_decoder_code(struct input_dev *dev, struct ir_decoder *d,
+			    unsigned long data, unsigned long code);
+static void ir_decoder_malformed(struct input_dev *dev);
+
+/* Round a span to the nearest whole number of units, without a divide */
+static inline unsigned int ir_units(unsigned long span, unsigned long unit)
+{
+	unsigned int n = 0;
+
+	span += unit >> 1;
+	while (span >= unit && n < IR_UNITS_MAX) {
+		span -= unit;
+		++n;
+	}
+	return n;
+}
+
+static void ir_decoder_frame(struct input_dev *dev, const struct ir_protocol *p,
+			     struct ir_decoder *d)
+{
+	unsigned long data = d->data;
+
+	d->state = IR_DEC_IDLE;
+	if ((data & p->check_mask) != p->check)
+		ir_decoder_malformed(dev);
+	else
+		ir_decoder_code(dev, d, data, (p->tag << 16) | (data & p->code_mask));
+}
+
+/* Add a data bit, and return non-zero when the frame is complete */
+static inline int ir_decoder_bit(const struct ir_protocol *p, struct ir_decoder *d, int bit)
+{
+	if (p->lsb_first)
+		d->data |= bit << d->bits;
+	else
+		d->data = (d->data << 1) | bit;
+	return ++d->bits >= p->nbits;
+}
+
+/* Feed one (mark or space) element of n units into a biphase decoder.
+   Returns 0 if it doesn't fit. */
+static int ir_decoder_halves(struct input_dev *dev, const struct ir_protocol *p,
+			     struct ir_decoder *d, int mark, unsigned int n)
+{
+	while (n) {
+		unsigned int need = (d->bits == p->wide_bit) ? 2 : 1;
+		if (n < need)
+			return 0;
+		n -= need;
+		if (!d->half) {
+			d->half = 1 + mark;
+			/* A frame ending in mark,space is complete right away,
+			   rather than when the idle space finally ends */
+			if (mark && d->bits == p->nbits - 1) {
+				d->half = 0;
+				if (ir_decoder_bit(p, d, p->one))
+					ir_decoder_frame(dev, p, d);
+				return 1;
+			}
+		} else {
+			if (d->half == 1 + mark)
+				return 0;	/* no transition mid-bit */
+			d->half = 0;
+			if (ir_decoder_bit(p, d, mark ? !p->one : p->one)) {
+				ir_decoder_frame(dev, p, d);
+				return 1;	/* the rest is inter-frame gap */
+			}
+		}
+	}
+	return 1;
+}
+
+static void ir_decoder_transition(struct input_dev *dev, const struct ir_protocol *p,
+				  struct ir_decoder *d, int level, unsigned long span)
+{
+	/* The level is the new one, so a rising edge ends a mark */
+	int mark = level, ok, retried = 0;
+	unsigned int n = ir_units(span, p->unit);
+
+ retry:
+	switch (d->state) {
+	case IR_DEC_IDLE:
+		if (!mark)
+			break;
+		d->bits = 0;
+		d->half = 0;
+		d->data = 0;
+		if (p->lead_mark) {
+			/* Leaders are long, so allow a whole unit either way */
+			if (n + 1 >= p->lead_mark && n <= p->lead_mark + 1)
+				d->state = p->lead_space ? IR_DEC_LEAD : IR_DEC_BITS;
+			break;
+		}
+		/* No leader: the mark is already part of the data */
+		d->state = IR_DEC_BITS;
+		d->half = 1;	/* the space half that went before it */
+		goto retry;
+
+	case IR_DEC_LEAD:
+		d->state = (!mark && n == p->lead_space) ? IR_DEC_BITS : IR_DEC_IDLE;
+		break;
+
+	case IR_DEC_BITS:
+		if (p->coding == IR_CODING_BIPHASE) {
+			ok = ir_decoder_halves(dev, p, d, mark, n);
+		} else if (mark) {
+			ok = (n == p->zero || n == p->one);
+			if (ok && ir_decoder_bit(p, d, n == p->one))
+				ir_decoder_frame(dev, p, d);
+		} else {
+			ok = (n == p->sync);
+		}
+		if (!ok) {
+			d->state = IR_DEC_IDLE;
+			/* A mark that didn't fit might start the next frame */
+			if (mark && !retried++)
+				goto retry;
+		}
+		break;
+	}
+}
+
+#endif
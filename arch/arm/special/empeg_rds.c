@@ -26,6 +26,12 @@
  *
  * 20000304 hugo@empeg.com
  *      Initialisation code marked as discardable
+ *
+ * The checkword syndrome is now rolled along with the shift register, one
+ * step per bit, instead of being recomputed over all 16 data bits of the
+ * window on every clock.  Good groups are also decoded here (PS, RadioText,
+ * CT, PTY, TA/TP, AF) into /proc/empeg_rds_state; /dev/rds still gets the
+ * raw 8-byte groups as before.
  */
 
 #define __KERNEL_SYSCALLS__
@@ -88,12 +94,99 @@ static struct file_operations rds_fops = {
   rds_release,
 };
 
+static void rds_reset_info(struct rds_info *info, unsigned short pi)
+{
+	memset(info, 0, sizeof(*info));
+	memset(info->ps, ' ', sizeof(info->ps));
+	memset(info->rt, ' ', sizeof(info->rt));
+	info->pi = pi;
+}
+
+static void rds_add_af(struct rds_info *info, int code)
+{
+	int a;
+
+	/* 1..204 are VHF frequencies; fillers, counts and LF/MF are ignored */
+	if (code < 1 || code > 204)
+		return;
+	for (a = 0; a < info->af_count; a++)
+		if (info->af[a] == code)
+			return;
+	if (info->af_count < RDS_AF_MAX)
+		info->af[info->af_count++] = code;
+}
+
+/* Decode a good group from dev->buffer (blocks A,B,C,D, big endian) */
+static void rds_decode_group(struct rds_dev *dev)
+{
+	struct rds_info *info = &dev->info;
+	unsigned char *buf = dev->buffer;
+	unsigned int a = (buf[0] << 8) | buf[1];
+	unsigned int b = (buf[2] << 8) | buf[3];
+	unsigned int c = (buf[4] << 8) | buf[5];
+	unsigned int d = (buf[6] << 8) | buf[7];
+	int seg;
+
+	/* New station: forget everything we knew about the old one */
+	if (a != info->pi)
+		rds_reset_info(info, a);
+	info->groups++;
+	info->last_group = jiffies;
+	info->tp  = (b >> 10) & 1;
+	info->pty = (b >> 5) & 0x1f;
+
+	switch (b >> 11) {	/* group type and version */
+	case 0x00: /* 0A: basic tuning, with AFs in block C */
+		if ((c >> 8) != 250)	/* not an LF/MF pair */
+			rds_add_af(info, c & 0xff);
+		rds_add_af(info, c >> 8);
+		/* fall through */
+	case 0x01: /* 0B: basic tuning */
+		info->ta = (b >> 4) & 1;
+		info->ms = (b >> 3) & 1;
+		seg = (b & 3) << 1;
+		info->ps[seg]     = d >> 8;
+		info->ps[seg + 1] = d & 0xff;
+		break;
+
+	case 0x04: /* 2A: RadioText, 4 characters per group */
+	case 0x05: /* 2B: RadioText, 2 characters per group */
+		if (((b >> 4) & 1) != info->rt_ab) {
+			info->rt_ab = (b >> 4) & 1;
+			memset(info->rt, ' ', sizeof(info->rt));
+		}
+		if (b & 0x800) {
+			seg = (b & 0xf) << 1;
+			info->rt[seg]     = d >> 8;
+			info->rt[seg + 1] = d & 0xff;
+		} else {
+			seg = (b & 0xf) << 2;
+			info->rt[seg]     = c >> 8;
+			info->rt[seg + 1] = c & 0xff;
+			info->rt[seg + 2] = d >> 8;
+			info->rt[seg + 3] = d & 0xff;
+		}
+		break;
+
+	case 0x08: /* 4A: clock time and date */
+		info->ct_mjd    = ((b & 3) << 15) | (c >> 1);
+		info->ct_hour   = ((c & 1) << 4) | (d >> 12);
+		info->ct_minute = (d >> 6) & 0x3f;
+		info->ct_offset = (d & 0x20) ? -(d & 0x1f) : (d & 0x1f);
+		break;
+	}
+}
+
 /* Our own IRQs are disabled as we're being called from our IRQ handler */
 static void rds_processpacket(struct rds_dev *dev)
 {
 	int a,last_used=dev->rx_used;
 	char buffer[64];
 	
+	rds_decode_group(dev);
+	if (!dev->in_use)
+		return;
+
 	/* Got a whole packet, log it and buffer */
 	sprintf(buffer,"pkt %02x/%02x/%02x/%02x %02x/%02x/%02x/%02x\n",
 		dev->buffer[0],dev->buffer[1],dev->buffer[2],dev->buffer[3],
@@ -401,13 +494,16 @@ static int rds_crc_correct(struct rds_dev *dev, int rdsbits)
 
 static __inline__ void rds_processbit_cooked(struct rds_dev *dev, int rdsbit)
 {
-	static char tmp[256];
-	unsigned int rdsdata,rdscrc,b,correct,correct2;
+	unsigned int rdsdata,rdscrc,correct,correct2;
 
-	static const unsigned int g[]={ 0x1b9, 0x372, 0x35d, 0x303,
-					0x3bf, 0x2c7, 0x037, 0x06e,
-					0x0dc, 0x1b8, 0x370, 0x359,
-					0x30b, 0x3af, 0x2e7, 0x077 };
+	/* The syndrome is the 26-bit window mod the generator polynomial.
+	 * Shifting a bit in multiplies by x and adds the bit; the bit that
+	 * drops off the top took x^26 mod g(x) with it.
+	 */
+	rdscrc=(dev->syndrome<<1)|rdsbit;
+	if (rdscrc&0x400) rdscrc^=RDS_POLY;
+	if (dev->rdsstream&0x02000000) rdscrc^=RDS_X26;
+	dev->syndrome=rdscrc;
 
 	/* Stick into shift register */
 	dev->rdsstream=((dev->rdsstream<<1)|rdsbit)&0x03ffffff;
@@ -416,11 +512,7 @@ static __inline__ void rds_processbit_cooked(struct rds_dev *dev, int rdsbit)
 	/* A FIFOful? If not, we can't process packets */
 	if (dev->bitsinfifo<26) return;
 	
-	/* Calculate checksum on this fifo */
 	rdsdata=dev->rdsstream&0x03fffc00;
-	rdscrc=dev->rdsstream&0x3ff;
-	for(b=0;b<16;b++)
-	    if (dev->rdsstream&(1<<(b+10))) rdscrc^=g[b];
 
 	switch(dev->state) {
 	case 0: /* Look for type A as start - we're not in sync, so we can't correct */
@@ -501,7 +593,7 @@ static __inline__ void rds_processbit_cooked(struct rds_dev *dev, int rdsbit)
 				dev->bitsinfifo=0;
 				break;
 			}
-			rdsdata = correct & 0x03fffc00;
+			rdsdata = ((correct & 0x3ff) ? correct2 : correct) & 0x03fffc00;
 		}
 		else dev->good_packets++;
 
@@ -549,11 +641,6 @@ static __inline__ void rds_processbit_cooked(struct rds_dev *dev, int rdsbit)
 		dev->bitsinfifo=26;	// resync a bit faster
 		dev->state=0;
 	}
-
-	sprintf(tmp, "Sync: %d  Good: %d  Bad: %d  Ugly: %d\n",
-		dev->sync_lost_packets, dev->good_packets,
-		dev->bad_packets, dev->recovered_packets);
-	LOGS(tmp);
 }
 
 static __inline__ void rds_processbit_raw(struct rds_dev *dev, int rdsbit)
@@ -568,11 +655,10 @@ static __inline__ void rds_processbit_raw(struct rds_dev *dev, int rdsbit)
 
 static __inline__ void rds_processbit(struct rds_dev *dev, int rdsbit)
 {
-	if(!dev->in_use) return;
-
+	/* Cooked groups are decoded for /proc even with nobody reading */
 	if(dev->interface == EMPEG_RDS_INTERFACE_COOKED)
 		rds_processbit_cooked(dev, rdsbit);
-	else if(dev->interface == EMPEG_RDS_INTERFACE_RAW)
+	else if(dev->in_use && dev->interface == EMPEG_RDS_INTERFACE_RAW)
 		rds_processbit_raw(dev, rdsbit);
 }
 
@@ -586,8 +672,13 @@ void rds_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 
 static int rds_read_procmem(char *buf, char **start, off_t offset, int len, int unused)
 {
+	struct rds_dev *dev=rds_devices;
+
 	len = 0;
 
+	len+=sprintf(buf+len,"Sync: %d  Good: %d  Bad: %d  Ugly: %d\n",
+		     dev->sync_lost_packets, dev->good_packets,
+		     dev->bad_packets, dev->recovered_packets);
 	LOG(0);
 	log[1023] = 0;
 	len+=sprintf(buf+len,"Log: %s\n",log);
@@ -606,6 +697,79 @@ static struct proc_dir_entry rds_proc_entry = {
 	&rds_read_procmem, 	/* function used to read data */
 };
 
+static int rds_printable(int c)
+{
+	return (c < ' ' || c > '~' || c == '"') ? '?' : c;
+}
+
+static int rds_state_read_procmem(char *buf, char **start, off_t offset, int len, int unused)
+{
+	struct rds_info info;
+	unsigned long flags;
+	int a;
+
+	/* Take a consistent snapshot: groups are decoded at interrupt time */
+	save_flags_cli(flags);
+	info = rds_devices[0].info;
+	restore_flags(flags);
+
+	len = 0;
+	if (!info.groups) {
+		len+=sprintf(buf+len,"Groups=0\n");
+		return len;
+	}
+	len+=sprintf(buf+len,"Groups=%u\nAge=%lu\nPI=%04X\nPTY=%d\nTP=%d\nTA=%d\nMS=%d\n",
+		     info.groups, (jiffies - info.last_group) / HZ, info.pi,
+		     info.pty, info.tp, info.ta, info.ms);
+
+	len+=sprintf(buf+len,"PS=\"");
+	for (a = 0; a < sizeof(info.ps); a++)
+		buf[len++] = rds_printable(info.ps[a]);
+	len+=sprintf(buf+len,"\"\nRT=\"");
+	for (a = 0; a < sizeof(info.rt) && info.rt[a] != 0x0d; a++)
+		buf[len++] = rds_printable(info.rt[a]);
+	len+=sprintf(buf+len,"\"\n");
+
+	if (info.ct_mjd >= 40587) {
+		/* Days since 1970 to a civil date, valid for the Gregorian calendar */
+		unsigned int z = info.ct_mjd - 40587 + 719468;
+		unsigned int era = z / 146097, doe = z - era * 146097;
+		unsigned int yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+		unsigned int doy = doe - (365*yoe + yoe/4 - yoe/100);
+		unsigned int mp = (5*doy + 2) / 153;
+		unsigned int day = doy - (153*mp + 2)/5 + 1;
+		unsigned int month = (mp < 10) ? mp + 3 : mp - 9;
+		unsigned int year = yoe + era * 400 + (month <= 2);
+		int offset = info.ct_offset, sign = '+';
+
+		if (offset < 0) {
+			offset = -offset;
+			sign = '-';
+		}
+		len+=sprintf(buf+len,"CT=%04u-%02u-%02u %02u:%02u UTC %c%d.%d\n",
+			     year, month, day, info.ct_hour, info.ct_minute,
+			     sign, offset / 2, (offset & 1) * 5);
+	}
+
+	len+=sprintf(buf+len,"AF=");
+	for (a = 0; a < info.af_count; a++)
+		len+=sprintf(buf+len,"%s%d.%d", a ? " " : "",
+			     (875 + info.af[a]) / 10, (875 + info.af[a]) % 10);
+	len+=sprintf(buf+len,"\n");
+
+	return len;
+}
+
+static struct proc_dir_entry rds_state_proc_entry = {
+	0,			/* inode (dynamic) */
+	15, "empeg_rds_state", 	/* length and name */
+	S_IFREG | S_IRUGO, 	/* mode */
+	1, 0, 0, 		/* links, owner, group */
+	0, 			/* size */
+	NULL, 			/* use default operations */
+	&rds_state_read_procmem, /* function used to read data */
+};
+
 /* Device initialisation */
 void __init empeg_rds_init(void)
 {
@@ -643,6 +807,7 @@ void __init empeg_rds_init(void)
 	dev->state=0;
 	dev->bitsinfifo=0;
 	dev->in_use=0;
+	rds_reset_info(&dev->info, 0);
 
 	/* Dad's home! */
 	printk("empeg RDS driver initialised\n");
@@ -657,6 +822,7 @@ void __init empeg_rds_init(void)
 
 #ifdef CONFIG_PROC_FS
 	proc_register(&proc_root, &rds_proc_entry);
+	proc_register(&proc_root, &rds_state_proc_entry);
 #endif
 }
 
@@ -3,6 +3,27 @@
 #ifndef EMPEG_RDS_H
 #define EMPEG_RDS_H
 
+/* Most AF lists are 25 entries or fewer */
+#define RDS_AF_MAX	25
+
+/* Decoded RDS state, as shown in /proc/empeg_rds_state */
+struct rds_info
+{
+	unsigned short pi;		/* programme identification */
+	unsigned char pty;		/* programme type */
+	unsigned char tp, ta, ms;	/* traffic programme/announcement, music/speech */
+	unsigned char rt_ab;		/* RadioText A/B flag: a change clears the text */
+	char ps[8];			/* programme service name */
+	char rt[64];			/* RadioText, 0x0d terminated if shorter */
+	unsigned char af[RDS_AF_MAX];	/* alternative frequencies, 87.5MHz + code*100kHz */
+	int af_count;
+	unsigned int ct_mjd;		/* clock time: modified julian day, UTC */
+	unsigned char ct_hour, ct_minute;
+	signed char ct_offset;		/* local time offset in half hours */
+	unsigned int groups;		/* good groups decoded */
+	unsigned long last_group;	/* jiffies */
+};
+
 /* There are multiple instances of this structure for the different
    channels provided */
 struct rds_dev
@@ -22,6 +43,7 @@ struct rds_dev
 	int interface;
 	int state;
 	unsigned int rdsstream;
+	unsigned int syndrome;		/* of rdsstream, kept up to date bit by bit */
         int bitsinfifo;
 	unsigned char buffer[8];
         int badcrccount;
@@ -32,6 +54,8 @@ struct rds_dev
 	int bad_packets;
 	int sync_lost_packets;
 	int in_use;
+
+	struct rds_info info;
 };
 
 /* Buffer size */
@@ -55,5 +79,9 @@ void empeg_rds_init(void);
 #define RDS_OFFSETCP	0x350
 #define RDS_OFFSETD	0x1b4
 
+/* Checkword generator polynomial x^10+x^8+x^7+x^5+x^4+x^3+1, and x^26 mod it */
+#define RDS_POLY	0x5b9
+#define RDS_X26		0x0ee
+
 #endif
 
@@ -0,0 +1,172 @@
+/*
+ * empeg-car voladj inner loops: buffer peak scan and multiplier ramp
+ */
+
+#ifndef EMPEG_VOLADJ_H
+#define EMPEG_VOLADJ_H 1
+
+/* These live in a header so that scripts/voladj_bench.c can check them
+ * against the original per-sample-divide voladj_scale() and time them.
+ * The includer defines MULT_POINT and MULT_TO_16, and struct voladj_state
+ * (see empeg_audio3.c).  On the ARM the loops are in assembler; anywhere
+ * else they fall back to C doing the same arithmetic.
+ */
+
+/*
+ * Largest absolute sample value in buf[].  The buffer must be word
+ * aligned (audio_buf data always is).  The bulk of it is scanned eight
+ * samples at a time with ldmia, folding both halves of each word into
+ * the running peak without any branches; any leftover samples are
+ * done in C.  The order in which the words arrive doesn't matter here.
+ *
+ * Off the ARM (ie. in scripts/voladj_bench.c), the blocks are done in C too.
+ */
+static unsigned int voladj_peak( short *buf, int num_samples )
+{
+  unsigned int peak = 0, t;
+  int blocks = num_samples >> 3;
+
+  if (blocks) {
+#ifdef __arm__
+    __asm__ __volatile__(
+		"1:\n\t"
+		"ldmia	%1!, {r4-r7}\n\t"		// eight samples
+
+#define VOLADJ_PEAK_WORD(reg) \
+		"movs	%3, " reg ", lsl #16\n\t"	/* low sample << 16 */ \
+		"rsbmi	%3, %3, #0\n\t"		/* abs(); -32768 becomes 0x80000000 */ \
+		"cmp	%0, %3, lsr #16\n\t" \
+		"movlo	%0, %3, lsr #16\n\t"		/* peak = max(peak, abs) */ \
+		"movs	%3, " reg ", asr #16\n\t"	/* high sample */ \
+		"rsbmi	%3, %3, #0\n\t" \
+		"cmp	%0, %3\n\t" \
+		"movlo	%0, %3\n\t"
+
+		VOLADJ_PEAK_WORD("r4")
+		VOLADJ_PEAK_WORD("r5")
+		VOLADJ_PEAK_WORD("r6")
+		VOLADJ_PEAK_WORD("r7")
+#undef VOLADJ_PEAK_WORD
+
+		"subs	%2, %2, #1\n\t"
+		"bne	1b\n\t"
+		: "+r" (peak), "+r" (buf), "+r" (blocks), "=&r" (t)
+		: // no inputs
+		: "r4", "r5", "r6", "r7", "cc", "memory");
+#else
+    for (blocks <<= 3; blocks > 0; --blocks) {
+      t = abs( *buf++ );
+      if (t > peak)
+        peak = t;
+    }
+#endif
+  }
+  for (num_samples &= 7; num_samples > 0; --num_samples) {
+    t = abs( *buf++ );
+    if (t > peak)
+      peak = t;
+  }
+  return peak;
+}
+
+void voladj_scale( 
+  struct voladj_state *state, 
+  int desired_multiplier,
+  short *scalebuf 
+  ) {
+
+  int outmult = state->output_multiplier;
+  int output_value, ramp, step, pairs;
+#ifdef __arm__
+  int word, mult, sample;
+#endif
+  int num_samples = state->buf_size / 2;
+
+  /* If there is no scaling to be done, just return immediately.
+   * There's no point going through multiplying every sample by 1!
+   */
+  if ((outmult == (1 << MULT_POINT)) &&
+    (desired_multiplier == (1 << MULT_POINT))) {
+      return;
+  }
+
+  /*
+   * In the previous call to voladj_check we made sure that the
+   * output multiplier was set to a value that will not cause
+   * clipping for any of the samples, so we don't have to worry
+   * about that here.
+   *
+   * The multiplier ramps linearly from outmult to desired_multiplier
+   * across the buffer, arriving on the final sample.  Rather than
+   * dividing the remaining distance for every sample, we work out a
+   * fixed step up front, carrying RAMP_FRAC extra bits so that it
+   * doesn't round away to nothing on gentle ramps.
+   *
+   * The loop does one stereo pair (one word) per iteration, so the
+   * buffer must be word aligned and hold an even number of samples.
+   */
+#define RAMP_FRAC 8
+#if (RAMP_FRAC + MULT_TO_16) != 10 || (MULT_POINT - MULT_TO_16) != 10
+#error "voladj_scale: shift counts in the assembler below need updating"
+#endif
+  ramp = outmult << RAMP_FRAC;
+  step = ((desired_multiplier - outmult) << RAMP_FRAC) / num_samples;
+  pairs = num_samples >> 1;
+
+  if (pairs) {
+#ifdef __arm__
+    __asm__ __volatile__(
+		"1:\n\t"
+		"ldr	%3, [%0]\n\t"			// %3 = left | (right << 16)
+
+		// left sample
+		"add	%1, %1, %7\n\t"		// ramp += step
+		"mov	%4, %1, asr #10\n\t"		// %4 = multiplier >> MULT_TO_16
+		"mov	%5, %3, lsl #16\n\t"
+		"mov	%5, %5, asr #16\n\t"		// %5 = (signed) left sample
+		"mul	%6, %4, %5\n\t"
+
+		// right sample
+		"add	%1, %1, %7\n\t"		// ramp += step
+		"mov	%4, %1, asr #10\n\t"
+		"mov	%5, %3, asr #16\n\t"		// %5 = (signed) right sample
+		"mul	%3, %4, %5\n\t"
+
+		// repack as (short)(left >> 10) | (right >> 10) << 16
+		"mov	%6, %6, lsl #6\n\t"
+		"mov	%6, %6, lsr #16\n\t"
+		"mov	%3, %3, asr #10\n\t"
+		"orr	%6, %6, %3, lsl #16\n\t"
+		"str	%6, [%0], #4\n\t"
+
+		"subs	%2, %2, #1\n\t"
+		"bne	1b\n\t"
+		: "+r" (scalebuf), "+r" (ramp), "+r" (pairs),
+		  "=&r" (word), "=&r" (mult), "=&r" (sample), "=&r" (output_value)
+		: "r" (step)
+		: "cc", "memory");
+#else
+    /* The same arithmetic in C, one sample at a time */
+    for (pairs <<= 1; pairs > 0; --pairs) {
+      ramp += step;
+      output_value = ((ramp >> (RAMP_FRAC + MULT_TO_16))
+        * *scalebuf) >> (MULT_POINT - MULT_TO_16 ) ;
+      *scalebuf++ = (short)(0x0000ffff & output_value);
+    }
+#endif
+  }
+  if (num_samples & 1) {
+    ramp += step;
+    output_value = ((ramp >> (RAMP_FRAC + MULT_TO_16)) 
+      * *scalebuf) >> (MULT_POINT - MULT_TO_16 ) ;
+    *scalebuf = (short)(0x0000ffff & output_value);
+  }
+#undef RAMP_FRAC
+
+  /* Land exactly on the target, whatever the step rounding did */
+  outmult = desired_multiplier;
+
+  state->output_multiplier = outmult;
+}
+
+#endif /* EMPEG_VOLADJ_H */
@@ -33,7 +33,7 @@ static unsigned long crc_table[256] = {
 	0xb3667a2e,0xc4614ab8,0x5d681b02,0x2a6f2b94,0xb40bbe37,0xc30c8ea1,0x5a05df1b,0x2d02ef8d};
 
 static inline unsigned long
-crc32 (unsigned char *buf, int len)
+fast_crc32 (unsigned char *buf, int len)
 {
 	unsigned long c = 0xffffffff;
 	int n;
@@ -20,11 +20,13 @@ const char hijack_vXXX_by_Mark_Lord[] = "Hijack "HIJACK_VERSION" by Mark Lord";
 #include <linux/unistd.h>
 #include <linux/dirent.h>
 #include <linux/random.h>
+#include <linux/proc_fs.h>
 
 #include <linux/empeg.h>
 #include <asm/uaccess.h>
 
 #include <asm/arch/hijack.h>		// for ioctls, IR_ definitions, etc..
+#include <asm/arch/hardware.h>		// for OSCR
 #include <linux/soundcard.h>		// for SOUND_MASK_*
 #include "../../../drivers/block/ide.h"	// for ide_hwifs[]
 #include "empeg_display.h"
@@ -36,6 +38,7 @@ extern int hijack_exec(const char *, const char *);			// arch/arm/special/kexec.
 extern void *hijack_get_state_read_buffer (void);			// arch/arm/special/empeg_state.c
 extern void save_current_volume(void);					// arch/arm/special/empeg_state.c
 extern void input_wakeup_waiters(void);					// arch/arm/special/empeg_input.c
+extern unsigned long input_edge_time;					// arch/arm/special/empeg_input.c
 extern int display_sendcontrol_part1(int);				// arch/arm/special/empeg_display.c
 extern int display_sendcontrol_part2(int);				// arch/arm/special/empeg_display.c
 extern void display_animation_frame(unsigned char *buf, unsigned char *frame); // arch/arm/special/empeg_display.c
@@ -314,6 +317,25 @@ static struct {
 static ir_translation_t *ir_current_longpress = NULL;
 static unsigned int *ir_translate_table = NULL;
 
+// An open-addressed index over ir_translate_table[], built along with it,
+// so that ir_next_match() needn't walk every translation on each button.
+// Each slot holds a button code, and the run of entries[] listing the word
+// offsets of its translations within the table, in table order.
+typedef struct ir_index_slot_s {
+	unsigned int	button;
+	unsigned short	first;		// index into entries[]
+	unsigned short	count;		// 0 == empty slot
+} ir_index_slot_t;
+
+typedef struct ir_index_s {
+	unsigned int	mask;		// number of slots - 1
+	unsigned short	*entries;
+	ir_index_slot_t	slots[0];
+} ir_index_t;
+
+static ir_index_t *ir_translate_index = NULL;
+static unsigned int ir_match_cost;	// slots probed + entries examined, for ir_debug
+
 // Fixme (someday): serial-port-"w" == "pause" (not pause/play): create a fake button for this.
 
 static button_name_t button_names[] = {
@@ -498,11 +520,21 @@ static	int hijack_option_stalk_enabled;	// 0 == ignore (drop) all stalk input
 // button -> interrupt -> input_append_code() -> inputq -> hijack_handle_button() -> userq -> ioctl()
 //
 // Currently, userq[] does not hold useful timing information
+//
+// For /proc/empeg_button_latency, queued buttons also carry OSCR timestamps
+// from each stage of the first flow above (0 == not traced).
+
+typedef struct hijack_stamps_s {
+	unsigned long edge;	// IR/button edge, from the timing queue in empeg_input.c
+	unsigned long queued;	// input_append_code()
+	unsigned long handled;	// hijack_handle_buttons()
+} hijack_stamps_t;
 
 #define HIJACK_BUTTONQ_SIZE	48
 typedef struct hijack_buttondata_s {
 	unsigned long delay;	// inter-button delay interval
 	unsigned int button;	// button press/release code
+	hijack_stamps_t stamps;	// latency tracing
 } hijack_buttondata_t;
 
 typedef struct hijack_buttonq_s {
@@ -523,6 +555,9 @@ typedef struct hijack_buttonq_s {
 
 int hijack_voladj_enabled = 0;	// used by voladj code in empeg_audio3.c
 int hijack_delaytime = 0;	// used by delay code in empeg_audio3.c
+int hijack_audio_buffers = 8;	// ring depth used by empeg_audio3.c
+int hijack_delaytime_base[2];	// fixed left/right delays, added to hijack_delaytime by empeg_audio3.c
+static int delaytime_base_default[] = {0, 0};
 static const char  *voladj_names[] = {"[Off]", "Low", "Medium", "High"};
 static unsigned int voladj_history[VOLADJ_HISTSIZE] = {0,}, voladj_last_histx = 0, voladj_histx = 0;
 static unsigned int hijack_voladj_parms[(1<<VOLADJ_BITS)-1][5];
@@ -550,6 +585,8 @@ static	int hijack_decimal_fidentry;		// 1 == fidentry uses base10 instead of hex
 	int hijack_extmute_off;			// buttoncode to inject when EXT-MUTE goes inactive
 	int hijack_extmute_on;			// buttoncode to inject when EXT-MUTE goes active
 	int hijack_ir_debug;			// printk() for every ir press/release code
+	int hijack_ir_decoders;			// bitmask of IR protocols to decode: 1=Kenwood/NEC, 2=Sony, 4=RC5, 8=RC6
+static	int hijack_button_fastpath;		// 1 == pass untranslated buttons on without waiting for a display frame
 static	int hijack_spindown_seconds;		// drive spindown timeout in seconds
 	int hijack_fake_tuner;			// pretend we have a tuner, when we really don't have one
 	int hijack_trace_tuner;			// dump incoming tuner/stalk packets onto console
@@ -562,11 +599,19 @@ static	int hijack_stalk_debug;			// trace button in/out actions to/from Stalk?
 	char hijack_khttpd_full[20];		// khttpd "user:password" for unrestricted web access
 	int hijack_kftpd_control_port;		// kftpd control port
 	int hijack_kftpd_data_port;		// kftpd data port
+	int hijack_kftpd_pasv_ports[2];		// kftpd port range for PASV/EPSV data connections
+static	int kftpd_pasv_ports_default[] = {50000, 50031};
 	int hijack_kftpd_verbose;		// kftpd verbosity
 	int hijack_rootdir_dotdot;		// 1 == show '..' in rootdir listings
 	int hijack_kftpd_show_dotfiles;		// 1 == show '.*' in rootdir listings
 	int hijack_khttpd_show_dotfiles;	// 1 == show '.*' in rootdir listings
 	int hijack_max_connections;		// restricts memory use
+	int hijack_khttpd_slots;		// number of preallocated khttpd connection slots
+	int hijack_khttpd_keepalive_timeout;	// seconds to hold an idle persistent connection open; 0 == disabled
+	int hijack_khttpd_keepalive_max;	// max requests per persistent connection
+	int hijack_khttpd_tagcache;		// max number of parsed tagfiles cached for playlists
+	int hijack_khttpd_gzip;			// compression level for generated pages; 0 == never compress
+	int hijack_khttpd_screen_fps;		// max frames/second pushed to each /proc/empeg_screen_stream client
 	int hijack_khttpd_port;			// khttpd port
 	int hijack_khttpd_verbose;		// khttpd verbosity
 	int hijack_ktelnetd_port;		// ktelnetd port
@@ -659,10 +704,13 @@ static const hijack_option_t hijack_option_table[] =
 {
 // config.ini string		address-of-variable		default			howmany	min	max
 //===========================	==========================	=========		=======	===	================
+{"audio_buffers",		&hijack_audio_buffers,		8,			1,	4,	55},	// 13 without extra RAM
 {"buttonled_off",		&hijack_buttonled_off_level,	1,			1,	0,	7},
 {"buttonled_dim",		&hijack_buttonled_dim_level,	0,			1,	0,	7},
+{"button_fastpath",		&hijack_button_fastpath,	0,			1,	0,	1},
 {"dc_servers",			&hijack_dc_servers,		0,			1,	0,	1},
 {"decimal_fidentry",		&hijack_decimal_fidentry,	0,			1,	0,	1},
+{"delaytime_base",		hijack_delaytime_base,		(int)delaytime_base_default,2,	0,	127},
 {"disable_emplode",		&hijack_disable_emplode,	0,			1,	0,	1},
 {"spindown_seconds",		&hijack_spindown_seconds,	30,			1,	0,	(239 * 5)},
 {"extmute_off",			&hijack_extmute_off,		0,			-1,	0,	IR_NULL_BUTTON},
@@ -674,16 +722,24 @@ static const hijack_option_t hijack_option_table[] =
 {"fan_high",			&fan_control_high,		50,			1,	0,	100},
 #endif // CONFIG_EMPEG_I2C_FAN_CONTROL
 {"ir_debug",			&hijack_ir_debug,		0,			1,	0,	1},
+{"ir_decoders",			&hijack_ir_decoders,		1,			1,	0,	15},
 {"keypress_flash",		&hijack_keypress_flash,		0,			1,	0,	65535},
 #ifdef CONFIG_NET_ETHERNET
 {"kftpd_control_port",		&hijack_kftpd_control_port,	21,			1,	0,	65535},
 {"kftpd_data_port",		&hijack_kftpd_data_port,	20,			1,	0,	65535},
+{"kftpd_pasv_ports",		hijack_kftpd_pasv_ports,	(int)kftpd_pasv_ports_default,2,	1024,	65535},
 {"kftpd_password",		&hijack_kftpd_password,		(int)"",		0,	0,	sizeof(hijack_kftpd_password)-1},
 {"kftpd_verbose",		&hijack_kftpd_verbose,		0,			1,	0,	1},
 {"rootdir_dotdot",		&hijack_rootdir_dotdot,		0,			1,	0,	1},
 {"kftpd_show_dotfiles",		&hijack_kftpd_show_dotfiles,	0,			1,	0,	1},
 {"khttpd_basic",		&hijack_khttpd_basic,		(int)"",		0,	0,	sizeof(hijack_khttpd_basic)-1},
 {"khttpd_full",			&hijack_khttpd_full,		(int)"",		0,	0,	sizeof(hijack_khttpd_full)-1},
+{"khttpd_gzip",			&hijack_khttpd_gzip,		3,			1,	0,	9},
+{"khttpd_keepalive_max",	&hijack_khttpd_keepalive_max,	50,			1,	1,	1000},
+{"khttpd_keepalive_timeout",	&hijack_khttpd_keepalive_timeout,15,			1,	0,	300},
+{"khttpd_tagcache",		&hijack_khttpd_tagcache,	256,			1,	0,	4096},
+{"khttpd_slots",		&hijack_khttpd_slots,		12,			1,	1,	32},
+{"khttpd_screen_fps",		&hijack_khttpd_screen_fps,	5,			1,	1,	25},
 {"khttpd_show_dotfiles",	&hijack_khttpd_show_dotfiles,	1,			1,	0,	1},
 {"khttpd_root_index",		&hijack_khttpd_root_index,	(int)"/index.html",	0,	0,	sizeof(hijack_khttpd_root_index)-1},
 {"khttpd_port",			&hijack_khttpd_port,		80,			1,	0,	65535},
@@ -1147,6 +1203,90 @@ draw_number (unsigned int rowcol, unsigned int number, const char *format, int c
 
 }
 
+// Button latency tracing.  Whatever is being queued picks up the stamps
+// in hijack_trace, which input_append_code() and hijack_handle_buttons()
+// set (with interrupts off) for the button they are working on.  When the
+// player read()s a button, each stage it went through goes into a
+// histogram of doubling microsecond buckets, from <2us up to >=0.5s.
+#define LATENCY_STAGES		4
+#define LATENCY_BUCKETS		20
+
+static hijack_stamps_t hijack_trace;
+static unsigned long latency_hist[LATENCY_STAGES][LATENCY_BUCKETS];
+static unsigned long latency_max[LATENCY_STAGES];
+static const char *latency_names[LATENCY_STAGES] = {"edge-decode", "decode-handle", "handle-read", "edge-read"};
+
+static inline unsigned long
+latency_stamp (void)
+{
+	return OSCR | 1;	// never zero
+}
+
+static void
+latency_add (int stage, unsigned long from, unsigned long to)
+{
+	unsigned long ticks = to - from, us;
+	int bucket = 0;
+
+	if (!from || !to)
+		return;
+	if (ticks > 40000000)	// about 10 seconds: keep the multiply below in range
+		ticks = 40000000;
+	us = (ticks * 100) / 368;
+	if (us > latency_max[stage])
+		latency_max[stage] = us;
+	while ((us >>= 1) && bucket < (LATENCY_BUCKETS - 1))
+		++bucket;
+	++latency_hist[stage][bucket];
+}
+
+static void
+latency_record (hijack_stamps_t *t)
+{
+	unsigned long now = latency_stamp();
+
+	latency_add(0, t->edge,    t->queued);
+	latency_add(1, t->queued,  t->handled);
+	latency_add(2, t->handled, now);
+	latency_add(3, t->edge,    now);
+}
+
+// /proc/empeg_button_latency read() routine:
+static int
+latency_proc_read (char *buf, char **start, off_t offset, int len, int unused)
+{
+	static const int percent[3] = {50, 90, 99};
+	int stage, i, b;
+
+	len = sprintf(buf, "# microseconds, percentiles are bucket upper bounds\n"
+			   "# stage          count    p50    p90    p99    max\n");
+	for (stage = 0; stage < LATENCY_STAGES; ++stage) {
+		unsigned long count = 0, sum, *hist = latency_hist[stage];
+		for (b = 0; b < LATENCY_BUCKETS; ++b)
+			count += hist[b];
+		len += sprintf(buf+len, "%-13s %8lu", latency_names[stage], count);
+		for (i = 0; i < 3; ++i) {
+			for (sum = b = 0; b < (LATENCY_BUCKETS - 1) && (sum += hist[b]) * 100 < count * percent[i]; ++b);
+			len += sprintf(buf+len, " %6lu", count ? (2UL << b) : 0);
+		}
+		len += sprintf(buf+len, " %6lu\n", latency_max[stage]);
+	}
+	len += sprintf(buf+len, "fastpath: %s\n", hijack_button_fastpath ? "on" : "off");
+	return len;
+}
+
+// /proc/empeg_button_latency directory entry:
+static struct proc_dir_entry proc_latency_entry = {
+	0,			/* inode (dynamic) */
+	20,			/* length of name */
+	"empeg_button_latency",	/* name */
+	S_IFREG | S_IRUGO, 	/* mode */
+	1, 0, 0, 		/* links, owner, group */
+	0,			/* size */
+	NULL, 			/* use default operations */
+	&latency_proc_read,	/* get_info() */
+};
+
 static void
 hijack_initq (hijack_buttonq_t *q, unsigned char qname)
 {
@@ -1229,6 +1369,7 @@ hijack_enq_button (hijack_buttonq_t *q, unsigned int button, unsigned long hold_
 		hijack_buttondata_t *data = &q->data[q->head = head];
 		data->button = button;
 		data->delay  = hold_time;
+		data->stamps = hijack_trace;
 		if (hijack_ir_debug)
 			printk("%lu: ENQ.%c: @%p: %08x.%ld\n", jiffies, q->qname, data, button, hold_time);
 	}
@@ -1322,6 +1463,7 @@ hijack_button_deq (hijack_buttonq_t *q, hijack_buttondata_t *rdata, int nowait)
 		if (nowait || !data->delay || jiffies_since(q->last_deq) > data->delay) {
 			rdata->button = data->button;
 			rdata->delay  = data->delay;
+			rdata->stamps = data->stamps;
 			q->tail = tail;
 			q->last_deq = jiffies;
 			if (hijack_ir_debug)
@@ -1379,6 +1521,7 @@ hijack_playerq_deq (unsigned int *rbutton)	// for use by empeg_input.c
 			//
 			if (rbutton) {
 				*rbutton = button;
+				latency_record(&data->stamps);
 				hijack_playerq.tail = tail;
 				hijack_playerq.last_deq = jiffies;
 				if (hijack_ir_debug)
@@ -2862,20 +3005,61 @@ knobseek_display (int firsttime)
 	return NO_REFRESH;	// gets overridden if overlay still active
 }
 
+static inline unsigned int
+ir_index_hash (unsigned int button, unsigned int mask)
+{
+	return ((button * 0x9e3779b1) >> 16) & mask;
+}
+
+static ir_index_slot_t *
+ir_index_lookup (ir_index_t *index, unsigned int button)
+{
+	unsigned int i = ir_index_hash(button, index->mask);
+	ir_index_slot_t *slot;
+
+	while ((slot = &index->slots[i])->count) {
+		++ir_match_cost;
+		if (slot->button == button)
+			return slot;
+		i = (i + 1) & index->mask;
+	}
+	return NULL;
+}
+
 static ir_translation_t *
 ir_next_match (ir_translation_t *table, unsigned int button)
 {
+	unsigned int *base = ir_translate_table;
+	ir_index_t *index = ir_translate_index;
+	ir_index_slot_t *slot;
+	unsigned short *e, *end;
+
 	button &= ~BUTTON_FLAGS;
-	while (1) {
-		if (table == NULL)
-			table = (ir_translation_t *)ir_translate_table;
-		else
-			((unsigned int *)table) += (sizeof(ir_translation_t) / sizeof(unsigned int)) + table->count;
-		if (!table || table->old == -1)
-			return NULL;
-		if ((table->old & ~BUTTON_FLAGS) == button)
-			return table;
+	if (!base)
+		return NULL;
+	if (!index) {	// no index (eg. no memory for it): search the table itself
+		while (1) {
+			if (table == NULL)
+				table = (ir_translation_t *)base;
+			else
+				((unsigned int *)table) += (sizeof(ir_translation_t) / sizeof(unsigned int)) + table->count;
+			if (table->old == -1)
+				return NULL;
+			++ir_match_cost;
+			if ((table->old & ~BUTTON_FLAGS) == button)
+				return table;
+		}
+	}
+	if (!(slot = ir_index_lookup(index, button)))
+		return NULL;
+	e   = &index->entries[slot->first];
+	end = e + slot->count;
+	if (table) {	// carry on after the previous match
+		unsigned int prev = (unsigned int *)table - base;
+		while (e < end && *e++ != prev)
+			++ir_match_cost;
 	}
+	return (e < end) ? (ir_translation_t *)(base + *e) : NULL;
 }
 
 static int		popup_index;
@@ -3673,6 +3857,7 @@ static int
 showbutton_display (int firsttime)
 {
 	static unsigned int *saved_table, prev[4], counter;
+	static ir_index_t *saved_index;
 	hijack_buttondata_t data;
 	unsigned long flags;
 	int i;
@@ -3683,9 +3868,11 @@ showbutton_display (int firsttime)
 		prev[0] = prev[1] = prev[2] = prev[3] = IR_NULL_BUTTON;
 		hijack_buttonlist = intercept_all_buttons;
 		hijack_initq(&hijack_userq, 'U');
-		// disable IR translations
+		// disable IR translations; the index must always go with its table
 		saved_table = ir_translate_table;
+		saved_index = ir_translate_index;
 		ir_translate_table = NULL;
+		ir_translate_index = NULL;
 	}
 	if (hijack_button_deq(&hijack_userq, &data, 0)) {
 		int released = IS_RELEASE(data.button);
@@ -3694,7 +3881,18 @@ showbutton_display (int firsttime)
 		if (prev[0] == IR_NULL_BUTTON && released) {
 			// ignore it: left over from selecting us off the menu
 		} else if (released && data.button == prev[1]) {
-			ir_translate_table = saved_table;
+			if (ir_translate_table) {
+				// [ir_translate] was re-parsed meanwhile: keep the new one
+				if (saved_table)
+					kfree(saved_table);
+				if (saved_index)
+					kfree(saved_index);
+			} else {
+				ir_translate_table = saved_table;
+				ir_translate_index = saved_index;
+			}
+			saved_table = NULL;
+			saved_index = NULL;
 			ir_selected = 1; // return to main menu
 		} else {
 			for (i = 2; i >= 0; --i)
@@ -3734,6 +3932,255 @@ showbutton_display (int firsttime)
 	return NO_REFRESH;
 }
 
+// Spectrum analyser: a fixed-point radix-2 FFT of whatever is currently going out to the DAC.
+//
+// The DMA interrupt in empeg_audio3.c hands us each buffer as it is queued for output,
+// and we grab one decimated frame from it, but only while somebody (the display or
+// /proc/empeg_spectrum) is actually looking, and no more than once per SPECTRUM_INTERVAL.
+// The FFT itself runs later, from the display refresh or the /proc reader, never from the interrupt.
+//
+// Cycle budget (SA1100 @ 220MHz): copying a frame costs roughly 1000 cycles in the interrupt.
+// The 128-point FFT is 448 butterflies at ~25 cycles each, plus windowing, bit-reversal and
+// magnitudes: under 20000 cycles (~90usec) per frame, or about 0.15% of the CPU at 15 frames/sec.
+//
+#define SPECTRUM_BITS		7			// 6 (64-point) or 7 (128-point)
+#define SPECTRUM_POINTS		(1 << SPECTRUM_BITS)
+#define SPECTRUM_DECIMATE	2			// 44100/2 = 22050Hz sampling
+#define SPECTRUM_RATE		(44100 / SPECTRUM_DECIMATE)
+#define SPECTRUM_INTERVAL	(HZ/15)			// at most 15 frames per second
+#define SPECTRUM_BANDS		16
+#define SPECTRUM_BARWIDTH	(EMPEG_SCREEN_COLS / SPECTRUM_BANDS)
+#define SPECTRUM_DB_TOP		78			// approx level of a full-scale sine
+#define SPECTRUM_DB_RANGE	48			// bottom of the display is this far below the top
+
+#if (SPECTRUM_BITS < 6) || (SPECTRUM_BITS > 7)
+#error "SPECTRUM_BITS must be 6 or 7"
+#endif
+
+#define SPECTRUM_EMPTY	0	// waiting for hijack_spectrum_feed()
+#define SPECTRUM_FULL	1	// spectrum_samples[] holds a fresh frame
+#define SPECTRUM_BUSY	2	// spectrum_compute() is using spectrum_samples[], spectrum_fftbuf[] and spectrum_db[]
+
+static volatile int spectrum_state = SPECTRUM_EMPTY;
+static unsigned long spectrum_wanted = 0, spectrum_last = 0, spectrum_frames = 0;
+static short spectrum_samples[SPECTRUM_POINTS];
+static int spectrum_fftbuf[2 * SPECTRUM_POINTS];	// {re,im} pairs
+static unsigned char spectrum_db[SPECTRUM_BANDS], spectrum_bars[SPECTRUM_BANDS];
+
+// sin(2*pi*i/128) in Q15, for i = 0..96; cos(2*pi*i/128) is spectrum_sine[i+32]
+static const short spectrum_sine[97] = {
+	     0,   1608,   3212,   4808,   6393,   7962,   9512,  11039,
+	 12539,  14010,  15446,  16846,  18204,  19519,  20787,  22005,
+	 23170,  24279,  25329,  26319,  27245,  28105,  28898,  29621,
+	 30273,  30852,  31356,  31785,  32137,  32412,  32609,  32728,
+	 32767,  32728,  32609,  32412,  32137,  31785,  31356,  30852,
+	 30273,  29621,  28898,  28105,  27245,  26319,  25329,  24279,
+	 23170,  22005,  20787,  19519,  18204,  16846,  15446,  14010,
+	 12539,  11039,   9512,   7962,   6393,   4808,   3212,   1608,
+	     0,  -1608,  -3212,  -4808,  -6393,  -7962,  -9512, -11039,
+	-12539, -14010, -15446, -16846, -18204, -19519, -20787, -22005,
+	-23170, -24279, -25329, -26319, -27245, -28105, -28898, -29621,
+	-30273, -30852, -31356, -31785, -32137, -32412, -32609, -32728,
+	-32767};
+
+// Band edges, in 128-point FFT bins of 172Hz each (roughly logarithmic)
+static const unsigned char spectrum_edges[SPECTRUM_BANDS + 1] =
+	{1, 2, 3, 4, 5, 6, 8, 10, 13, 16, 20, 25, 31, 38, 46, 55, 64};
+
+// One decimation-in-time butterfly, with the 1/2 per-stage scaling that keeps Q15 from overflowing:
+//	t = b * (c - js);  a = (a + t) / 2;  b = (a - t) / 2;
+//
+static inline void
+spectrum_butterfly (int *a, int *b, int c, int s)
+{
+	__asm__ __volatile__(
+	"ldmia	%1, {r4, r5}		@ br, bi		\n"
+	"mul	r6, r4, %2		@ br*c			\n"
+	"mla	r6, r5, %3, r6		@ tr = br*c + bi*s	\n"
+	"mul	r7, r5, %2		@ bi*c			\n"
+	"rsb	r4, r4, #0					\n"
+	"mla	r7, r4, %3, r7		@ ti = bi*c - br*s	\n"
+	"ldmia	%0, {r4, r5}		@ ar, ai		\n"
+	"add	r8, r4, r6, asr #15				\n"
+	"add	r9, r5, r7, asr #15				\n"
+	"sub	r4, r4, r6, asr #15				\n"
+	"sub	r5, r5, r7, asr #15				\n"
+	"mov	r8, r8, asr #1					\n"
+	"mov	r9, r9, asr #1					\n"
+	"mov	r4, r4, asr #1					\n"
+	"mov	r5, r5, asr #1					\n"
+	"stmia	%0, {r8, r9}					\n"
+	"stmia	%1, {r4, r5}					\n"
+	: /* no outputs */
+	: "r" (a), "r" (b), "r" (c), "r" (s)
+	: "r4", "r5", "r6", "r7", "r8", "r9", "memory");
+}
+
+static void
+spectrum_fft (int *x)	// x[] holds SPECTRUM_POINTS {re,im} pairs, in bit-reversed order
+{
+	unsigned int half, step, k, i;
+
+	for (half = 1, step = 64; half < SPECTRUM_POINTS; half <<= 1, step >>= 1) {
+		for (k = 0; k < half; ++k) {
+			int s = spectrum_sine[k * step], c = spectrum_sine[k * step + 32];
+			for (i = k; i < SPECTRUM_POINTS; i += 2 * half)
+				spectrum_butterfly(&x[2 * i], &x[2 * (i + half)], c, s);
+		}
+	}
+}
+
+// approximately 10*log10(power), by way of log2 in quarter steps
+static unsigned int
+spectrum_power_to_db (unsigned int power)
+{
+	unsigned int log2 = 31;
+
+	if (power < 4)
+		return power ? 3 : 0;
+	while (!(power & 0x80000000)) {
+		power <<= 1;
+		--log2;
+	}
+	log2 = (log2 << 2) | ((power >> 29) & 3);
+	return (log2 * 301) / 400;
+}
+
+// invoked from the DMA interrupt in empeg_audio3.c, for each buffer handed to the DAC
+void
+hijack_spectrum_feed (const short *buf)
+{
+	int i;
+
+	if (spectrum_state != SPECTRUM_EMPTY || jiffies_since(spectrum_wanted) >= HZ || jiffies_since(spectrum_last) < SPECTRUM_INTERVAL)
+		return;
+	// mono, and a two-tap average as a crude anti-alias filter for the decimation
+	for (i = 0; i < SPECTRUM_POINTS; ++i, buf += 2 * SPECTRUM_DECIMATE)
+		spectrum_samples[i] = (buf[0] + buf[1] + buf[2] + buf[3]) >> 2;
+	spectrum_last  = JIFFIES();
+	spectrum_state = SPECTRUM_FULL;
+}
+
+// Turn the latest frame (if any) into band levels; returns 1 if spectrum_db[] was updated
+static int
+spectrum_compute (void)
+{
+	int *x = spectrum_fftbuf;
+	unsigned int i, band;
+	unsigned long flags;
+
+	save_flags_cli(flags);
+	spectrum_wanted = JIFFIES();
+	if (spectrum_state != SPECTRUM_FULL) {
+		restore_flags(flags);
+		return 0;
+	}
+	spectrum_state = SPECTRUM_BUSY;
+	restore_flags(flags);
+
+	// Hann window, bit-reversed into the FFT buffer
+	for (i = 0; i < SPECTRUM_POINTS; ++i) {
+		unsigned int r = 0, j = i, b, w = (i << (7 - SPECTRUM_BITS));
+		for (b = SPECTRUM_BITS; b; --b) {
+			r = (r << 1) | (j & 1);
+			j >>= 1;
+		}
+		if (w > 64)
+			w = 128 - w;
+		w = (32767 - spectrum_sine[w + 32]) >> 1;
+		x[2 * r]     = (spectrum_samples[i] * (int)w) >> 15;
+		x[2 * r + 1] = 0;
+	}
+	// Stay BUSY until spectrum_db[] is written: the display (bottom half)
+	// and /proc (process context) callers share spectrum_fftbuf[]
+	spectrum_fft(x);
+
+	for (band = 0; band < SPECTRUM_BANDS; ++band) {
+		unsigned int peak = 0;
+		unsigned int lo = spectrum_edges[band]   >> (7 - SPECTRUM_BITS);
+		unsigned int hi = spectrum_edges[band+1] >> (7 - SPECTRUM_BITS);
+		if (lo == 0)
+			lo = 1;		// skip DC
+		if (hi <= lo)
+			hi = lo + 1;
+		for (i = lo; i < hi; ++i) {
+			int re = x[2 * i], im = x[2 * i + 1];
+			unsigned int power = (re * re) + (im * im);
+			if (power > peak)
+				peak = power;
+		}
+		spectrum_db[band] = spectrum_power_to_db(peak);
+	}
+	++spectrum_frames;
+	spectrum_state = SPECTRUM_EMPTY;	// buffers may be reused now
+	return 1;
+}
+
+static int
+spectrum_display (int firsttime)
+{
+	unsigned int band;
+
+	if (firsttime) {
+		memset(spectrum_bars, 0, sizeof(spectrum_bars));
+		clear_hijack_displaybuf(COLOR0);
+		(void)draw_string(ROWCOL(1,0), "Spectrum Analyser", PROMPTCOLOR);
+		(void)spectrum_compute();	// to start the flow of frames
+		return NEED_REFRESH;
+	}
+	if (!spectrum_compute())
+		return NO_REFRESH;
+	clear_hijack_displaybuf(COLOR0);
+	for (band = 0; band < SPECTRUM_BANDS; ++band) {
+		int height = spectrum_db[band] - (SPECTRUM_DB_TOP - SPECTRUM_DB_RANGE);
+		unsigned short row, col = band * SPECTRUM_BARWIDTH;
+		if (height < 0)
+			height = 0;
+		height = height * EMPEG_SCREEN_ROWS / SPECTRUM_DB_RANGE;
+		if (height > EMPEG_SCREEN_ROWS)
+			height = EMPEG_SCREEN_ROWS;
+		if (height < (spectrum_bars[band] - 2))	// let the bars fall gently
+			height = spectrum_bars[band] - 2;
+		spectrum_bars[band] = height;
+		for (row = EMPEG_SCREEN_ROWS - height; row < EMPEG_SCREEN_ROWS; ++row)
+			draw_hline(row, col, col + SPECTRUM_BARWIDTH - 2, (row == (EMPEG_SCREEN_ROWS - height)) ? COLOR3 : COLOR2);
+	}
+	return NEED_REFRESH;
+}
+
+// /proc/empeg_spectrum read() routine:
+static int
+spectrum_proc_read (char *buf, char **start, off_t offset, int len, int unused)
+{
+	unsigned int band, tries;
+
+	if (!offset) {	// wait up to HZ/5 for a fresh frame
+		for (tries = 10; !spectrum_compute() && tries; --tries) {
+			current->state = TASK_INTERRUPTIBLE;
+			schedule_timeout(HZ/50);
+			current->state = TASK_RUNNING;
+		}
+	}
+	len = sprintf(buf, "# %u-point FFT at %uHz, %lu frames\n# lo_hz hi_hz dB\n", SPECTRUM_POINTS, SPECTRUM_RATE, spectrum_frames);
+	for (band = 0; band < SPECTRUM_BANDS; ++band) {
+		len += sprintf(buf+len, "%5u %5u %3u\n",
+			spectrum_edges[band] * (44100 / 2 / 128), spectrum_edges[band+1] * (44100 / 2 / 128), spectrum_db[band]);
+	}
+	return len;
+}
+
+// /proc/empeg_spectrum directory entry:
+static struct proc_dir_entry proc_spectrum_entry = {
+	0,			/* inode (dynamic) */
+	14,			/* length of name */
+	"empeg_spectrum",	/* name */
+	S_IFREG | S_IRUGO, 	/* mode */
+	1, 0, 0, 		/* links, owner, group */
+	0,			/* size */
+	NULL, 			/* use default operations */
+	&spectrum_proc_read,	/* get_info() */
+};
+
 static menu_item_t menu_table [MENU_MAX_ITEMS] = {
 	{"Auto Volume Adjust",		voladj_display,		voladj_move,		0},
 	{"Boot Graphics",		    bootg_display,	bootg_move,		0},
@@ -3762,6 +4209,7 @@ static menu_item_t menu_table [MENU_MAX_ITEMS] = {
 	{ blanker_menu_label,		blanker_display,	blanker_move,		0},
 	{ saveserial_menu_label,	saveserial_display,	saveserial_move,	0},
 	{"Show Flash Savearea",		savearea_display,	savearea_move,		0},
+	{"Spectrum Analyser",		spectrum_display,	NULL,			0},
 	{ bass_menu_label,		bass_display,		tone_move,		0},
 	{ treble_menu_label,		treble_display,		tone_move,		0},
 #ifdef CONFIG_HIJACK_TUNER
@@ -4728,16 +5176,20 @@ hijack_handle_buttons (const char *player_buf)
 
 	if (hijack_status == HIJACK_IDLE)
 		player_ui_flags = get_player_ui_flags(player_buf);
+	save_flags_cli(flags);	// also keeps the button fastpath from interleaving with us
 	while (hijack_button_deq(&hijack_inputq, &data, 1)) {
-		save_flags_cli(flags);
+		hijack_trace = data.stamps;
+		if (hijack_trace.queued)
+			hijack_trace.handled = latency_stamp();
 		hijack_handle_button(data.button, data.delay, player_ui_flags, player_buf);
-		restore_flags(flags);
 	}
+	hijack_trace.edge = hijack_trace.queued = hijack_trace.handled = 0;
+	restore_flags(flags);
 	if (!hijack_playerq_deq(NULL))
 		input_wakeup_waiters();		// wake-up the player software
 }
 
-static unsigned int ir_downkey = IR_NULL_BUTTON, ir_delayed_rotate = 0;
+static unsigned int ir_downkey = IR_NULL_BUTTON, ir_delayed_rotate = 0, ir_untranslated = 0;
 static unsigned long do_keypress_flash = 0, last_keypress_flash = 0;
 
 static void
@@ -4783,12 +5235,13 @@ input_append_code2 (unsigned int rawbutton)
 		int		was_waiting	= (ir_current_longpress != NULL);
 		ir_translation_t *t		= NULL;
 		ir_current_longpress = NULL;
+		ir_match_cost = 0;
 		while (NULL != (t = ir_next_match(t, button))) {
 			unsigned short t_flags = t->flags;
 			if (t_flags & IR_FLAGS_POPUP)
 				break;	// no translations here for PopUp's //FIXME: continue instead of break?
 			if (hijack_ir_debug)
-				printk("%lu: IA2: tflags=%02x, flags=%02x, match=%d\n", jiffies, t_flags, flags, (t_flags & flags) == t_flags);
+				printk("%lu: IA2: tflags=%02x, flags=%02x, match=%d, cost=%u\n", jiffies, t_flags, flags, (t_flags & flags) == t_flags, ir_match_cost);
 			if ((t_flags & flags) == flags) {
 				if (released) {	// button release?
 					if ((t_flags & IR_FLAGS_LONGPRESS) && was_waiting) {
@@ -4819,6 +5272,8 @@ input_append_code2 (unsigned int rawbutton)
 				return;
 			}
 		}
+		if (hijack_ir_debug)
+			printk("%lu: IA2: no translation, cost=%u\n", jiffies, ir_match_cost);
 		if (delayed_send) {
 			// we just released a non-translated shortpress, but haven't sent the "press" yet
 			hijack_enq_button(&hijack_inputq, button, 0);
@@ -4826,6 +5281,7 @@ input_append_code2 (unsigned int rawbutton)
 	}
 	hijack_enq_button(&hijack_inputq, rawbutton, 0);
 	ir_lasttime = jiffies;
+	ir_untranslated = 1;
 }
 
 static void
@@ -4851,12 +5307,21 @@ input_append_code(void *dev, unsigned int button)  // empeg_input.c
 			input_send_delayed_rotate();
 		ir_delayed_rotate = 0;
 	}
+	hijack_trace.edge   = input_edge_time;
+	hijack_trace.queued = latency_stamp();
+	ir_untranslated = 0;
 	if (hijack_status == HIJACK_IDLE || (button != IR_KNOB_LEFT && button != IR_KNOB_RIGHT)) {
 		input_append_code2(button);
 	} else if (ir_downkey == IR_NULL_BUTTON) {
 		ir_delayed_rotate = button;
 		ir_lasttime = jiffies;
 	}
+	hijack_trace.edge = hijack_trace.queued = 0;
+
+	// Untranslated buttons need nothing from the display refresh,
+	// so optionally pass them to the player right away:
+	if (ir_untranslated && hijack_button_fastpath && hijack_status == HIJACK_IDLE && last_player_buf)
+		hijack_handle_buttons((const char *)last_player_buf);
 	restore_flags(flags);
 }
 
@@ -5385,10 +5850,59 @@ ir_setup_translations2 (unsigned char *s, unsigned int *table, int *had_errors)
 	return index * sizeof(unsigned long);
 }
 
+// Build the ir_translate_index for a freshly parsed table
+static ir_index_t *
+ir_build_index (unsigned int *table, int words)
+{
+	ir_translation_t *t;
+	ir_index_t	*index;
+	ir_index_slot_t	*slot;
+	unsigned int	offset, count = 0, nslots = 8, i, first;
+
+	if (words > 0xffff)
+		return NULL;	// offsets wouldn't fit: just search the table
+	for (offset = 0; (t = (ir_translation_t *)&table[offset])->old != -1; ++count)
+		offset += (sizeof(ir_translation_t) / sizeof(unsigned int)) + t->count;
+	while (nslots < (count * 2))
+		nslots <<= 1;	// keep it at most half full
+	index = kmalloc(sizeof(ir_index_t) + nslots * sizeof(ir_index_slot_t) + count * sizeof(unsigned short), GFP_KERNEL);
+	if (!index)
+		return NULL;
+	memset(index, 0, sizeof(ir_index_t) + nslots * sizeof(ir_index_slot_t));
+	index->mask = nslots - 1;
+	index->entries = (unsigned short *)&index->slots[nslots];
+
+	// Count the translations for each button, then lay out their runs of entries[]
+	for (offset = 0; (t = (ir_translation_t *)&table[offset])->old != -1;) {
+		unsigned int button = t->old & ~BUTTON_FLAGS;
+		for (i = ir_index_hash(button, index->mask); (slot = &index->slots[i])->count; i = (i + 1) & index->mask) {
+			if (slot->button == button)
+				break;
+		}
+		slot->button = button;
+		++slot->count;
+		offset += (sizeof(ir_translation_t) / sizeof(unsigned int)) + t->count;
+	}
+	for (i = first = 0; i < nslots; ++i) {
+		slot = &index->slots[i];
+		slot->first = first;
+		first += slot->count;
+		slot->count = 0;
+	}
+	for (offset = 0; (t = (ir_translation_t *)&table[offset])->old != -1;) {
+		unsigned int button = t->old & ~BUTTON_FLAGS;
+		for (i = ir_index_hash(button, index->mask); (slot = &index->slots[i])->button != button; i = (i + 1) & index->mask);
+		index->entries[slot->first + slot->count++] = offset;
+		offset += (sizeof(ir_translation_t) / sizeof(unsigned int)) + t->count;
+	}
+	return index;
+}
+
 static int
 ir_setup_translations (unsigned char *buf)
 {
 	unsigned int *table = NULL;
+	ir_index_t *index = NULL;
 	unsigned long flags;
 	int size, had_errors = 0;
 
@@ -5397,6 +5911,10 @@ ir_setup_translations (unsigned char *buf)
 		kfree(ir_translate_table);
 		ir_translate_table = NULL;
 	}
+	if (ir_translate_index) {
+		kfree(ir_translate_index);
+		ir_translate_index = NULL;
+	}
 	restore_flags(flags);
 	size = ir_setup_translations2(buf, NULL, &had_errors);	// first pass to calculate table size
 	if (size > 0) {
@@ -5407,8 +5925,10 @@ ir_setup_translations (unsigned char *buf)
 		} else {
 			memset(table, 0, size);
 			(void)ir_setup_translations2(buf, table, &had_errors);// second pass actually saves the data
+			index = ir_build_index(table, size / sizeof(unsigned int));
 			save_flags_cli(flags);
 			ir_translate_table = table;
+			ir_translate_index = index;
 			restore_flags(flags);
 		}
 	}
@@ -6552,6 +7072,8 @@ hijack_init (void *animptr)
 	hijack_initq(&hijack_playerq, 'P');
 	hijack_initq(&hijack_userq, 'U');
 	hijack_notify_init();
+	proc_register(&proc_root, &proc_spectrum_entry);
+	proc_register(&proc_root, &proc_latency_entry);
 	if (failed) {
 		if (failed == 2)
 			show_message("Hijack Settings Reset", HZ*7);
@@ -0,0 +1,145 @@
+// hijack_gzip.c:  streaming gzip (RFC 1952) compression for khttpd,
+// built on the zlib already in the tree for PPP (drivers/net/zlib.c).
+//
+// Memory use is kept small (about 40KB per stream, in 8KB pieces),
+// at some cost in compression ratio, since several khttpd workers
+// may be compressing at once alongside the music player.
+
+#include <linux/config.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/malloc.h>
+#include <linux/errno.h>
+
+#ifdef CONFIG_PPP_DEFLATE	// ppp_deflate.o is built in, and has zlib.c in it already: share that copy
+#include "../../../drivers/net/zlib.h"
+#else				// otherwise (even as a module, which keeps its symbols to itself) have our own
+#include "../../../drivers/net/zlib.c"
+#endif
+#include "fast_crc32.c"
+
+#define GZIP_WINDOW_BITS	12	// 4KB history
+#define GZIP_MEM_LEVEL		5
+
+typedef struct hijack_gzip_s {
+	z_stream	z;
+	unsigned long	crc;		// running crc32 of the uncompressed data
+	unsigned long	isize;		// total uncompressed bytes
+	unsigned char	state;		// 0: header pending, 1: compressing, 2: trailer pending, 3: finished
+	unsigned char	hdr_used;	// bytes of header/trailer already emitted
+	unsigned char	hdr[10];	// gzip header or trailer
+} hijack_gzip_t;
+
+static void *
+gzip_zalloc (void *opaque, unsigned int items, unsigned int size)
+{
+	return kmalloc(items * size, GFP_KERNEL);
+}
+
+static void
+gzip_zfree (void *opaque, void *ptr)
+{
+	kfree(ptr);
+}
+
+// Copy out as much of the pending header (or trailer) as fits in out[].
+//
+static unsigned int
+gzip_emit_hdr (hijack_gzip_t *gz, unsigned int hdr_size, unsigned char *out, unsigned int outsize)
+{
+	unsigned int len = hdr_size - gz->hdr_used;
+
+	if (len > outsize)
+		len = outsize;
+	memcpy(out, gz->hdr + gz->hdr_used, len);
+	gz->hdr_used += len;
+	if (gz->hdr_used == hdr_size) {
+		gz->hdr_used = 0;
+		++gz->state;
+	}
+	return len;
+}
+
+static void
+gzip_put_le32 (unsigned char *p, unsigned long val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+// Returns a new compression stream, or NULL if memory is short.
+//
+hijack_gzip_t *
+hijack_gzip_open (int level)
+{
+	hijack_gzip_t *gz;
+
+	if (!(gz = kmalloc(sizeof(hijack_gzip_t), GFP_KERNEL)))
+		return NULL;
+	memset(gz, 0, sizeof(hijack_gzip_t));
+	gz->z.zalloc = gzip_zalloc;
+	gz->z.zfree  = gzip_zfree;
+	if (Z_OK != deflateInit2(&gz->z, level, Z_DEFLATED, -GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY)) {
+		kfree(gz);
+		return NULL;
+	}
+	gz->crc = 0xffffffff;
+	gz->hdr[0] = 0x1f;	// magic
+	gz->hdr[1] = 0x8b;
+	gz->hdr[2] = Z_DEFLATED;
+	gz->hdr[9] = 3;		// OS: unix; flags and mtime are all zero
+	return gz;
+}
+
+void
+hijack_gzip_close (hijack_gzip_t *gz)
+{
+	deflateEnd(&gz->z);
+	kfree(gz);
+}
+
+// Compress as much of *in as will fit into out[], advancing *in and *inlen.
+// Returns the number of bytes placed into out[], which is zero once all
+// input has been absorbed, or (when finish is set) once the gzip trailer
+// has been emitted.  Callers just repeat until it returns zero (or < 0 on error).
+//
+int
+hijack_gzip_output (hijack_gzip_t *gz, const unsigned char **in, unsigned int *inlen, unsigned char *out, unsigned int outsize, int finish)
+{
+	unsigned int	used = 0;
+	int		rc;
+
+	if (gz->state == 0)
+		used = gzip_emit_hdr(gz, 10, out, outsize);
+	if (gz->state == 1 && used < outsize) {
+		const unsigned char *p = *in;
+		unsigned long c = gz->crc;
+		unsigned int n;
+
+		gz->z.next_in   = (Bytef *)p;
+		gz->z.avail_in  = *inlen;
+		gz->z.next_out  = out + used;
+		gz->z.avail_out = outsize - used;
+		rc = deflate(&gz->z, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+			return -EIO;
+		n = gz->z.next_in - p;
+		gz->isize += n;
+		while (n--)
+			c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+		gz->crc = c;
+		*in     = p;
+		*inlen  = gz->z.avail_in;
+		used    = gz->z.next_out - out;
+		if (rc == Z_STREAM_END) {
+			gz->state = 2;
+			gzip_put_le32(gz->hdr,     gz->crc ^ 0xffffffff);
+			gzip_put_le32(gz->hdr + 4, gz->isize);
+		}
+	}
+	if (gz->state == 2 && used < outsize)
+		used += gzip_emit_hdr(gz, 8, out + used, outsize - used);
+	return used;
+}
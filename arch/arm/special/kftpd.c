@@ -8,6 +8,7 @@
 #include <linux/proc_fs.h>
 #include <linux/unistd.h>
 #include <linux/mm.h>
+#include <linux/malloc.h>
 #include <linux/smp_lock.h>
 #include <linux/socket.h>
 #include <linux/file.h>
@@ -56,11 +57,18 @@ extern int hijack_ktelnetd_port;			// from arch/arm/special/hijack.c
 extern int hijack_khttpd_new_fid_dirs;			// from arch/arm/special/hijack.c
 extern int hijack_kftpd_control_port;			// from arch/arm/special/hijack.c
 extern int hijack_kftpd_data_port;			// from arch/arm/special/hijack.c
+extern int hijack_kftpd_pasv_ports[2];			// from arch/arm/special/hijack.c
 extern int hijack_kftpd_verbose;			// from arch/arm/special/hijack.c
 extern int hijack_rootdir_dotdot;			// from arch/arm/special/hijack.c
 extern int hijack_kftpd_show_dotfiles;			// from arch/arm/special/hijack.c
 extern int hijack_khttpd_show_dotfiles;			// from arch/arm/special/hijack.c
 extern int hijack_max_connections;			// from arch/arm/special/hijack.c
+extern int hijack_khttpd_slots;				// from arch/arm/special/hijack.c
+extern int hijack_khttpd_keepalive_timeout;		// from arch/arm/special/hijack.c
+extern int hijack_khttpd_keepalive_max;			// from arch/arm/special/hijack.c
+extern int hijack_khttpd_gzip;				// from arch/arm/special/hijack.c
+extern int hijack_khttpd_screen_fps;			// from arch/arm/special/hijack.c
+extern const char *hijack_months[12];			// from arch/arm/special/notify.c
 extern char hijack_kftpd_password[];			// from arch/arm/special/hijack.c
 extern char hijack_khttpd_basic[];			// from arch/arm/special/hijack.c
 extern char hijack_khttpd_full[];			// from arch/arm/special/hijack.c
@@ -78,6 +86,11 @@ extern int sys_fsync(int);
 extern int sys_sync(void);
 extern pid_t kernel_thread(int (*fn)(void *), void *arg, unsigned long flags);
 extern int sys_wait4 (pid_t pid,unsigned int * stat_addr, int options, struct rusage * ru);
+extern ssize_t hijack_sendfile(struct socket *sock, struct file *in_file, loff_t *ppos, size_t count); // mm/filemap.c
+typedef struct hijack_gzip_s hijack_gzip_t;	// arch/arm/special/hijack_gzip.c
+extern hijack_gzip_t *hijack_gzip_open (int level);
+extern int hijack_gzip_output (hijack_gzip_t *gz, const unsigned char **in, unsigned int *inlen, unsigned char *out, unsigned int outsize, int finish);
+extern void hijack_gzip_close (hijack_gzip_t *gz);
 
 #define INET_ADDRSTRLEN		16
 
@@ -93,6 +106,7 @@ typedef struct server_parms_s {
 	struct socket		*clientsock;
 	struct socket		*servsock;
 	struct socket		*datasock;
+	struct socket		*pasvsock;		// FTP only: listening socket from PASV/EPSV, or NULL
 	struct sockaddr_in	clientaddr;
 	enum {nolist, html, m3u, xml} generate_playlist;
 	char			verbose;		// bool
@@ -102,6 +116,7 @@ typedef struct server_parms_s {
 	char			streaming;		// bool
 	char			need_password;		// bool, FTP only
 	char			rename_pending;		// bool
+	char			rest_pending;		// bool, FTP only: REST given for the next transfer, even "REST 0"
 	char			nocache;		// bool
 	char			show_dotfiles;		// bool
 	char			nodata;			// bool
@@ -109,12 +124,20 @@ typedef struct server_parms_s {
 	char			running_playlist;	// bool
 	char			auth;			// khttpd_auth_t
 	char			is_mozilla;		// HTTP only
+	char			keepalive;		// bool, HTTP only: leave connection open after response
+	char			keepalive_ok;		// bool, HTTP only: server is willing to do keepalive
+	char			http11;			// bool, HTTP only: client speaks HTTP/1.1
+	char			accept_gzip;		// bool, HTTP only: client sent "Accept-Encoding: gzip"
+	char			gzip_sibling;		// bool, HTTP only: serving "file.gz" in place of "file"
 	unsigned short		data_port;
 	off_t			start_offset;		// starting offset for next FTP/HTTP file transfer
 	off_t			end_offset;		// for current HTTP file read
 	unsigned int		umask;
 	unsigned int		offset;			// for HTTP "OFFSET=nnnn" value
 	unsigned int		count;			// for HTTP "COUNT=nnnn" value
+	time_t			if_modified_since;	// HTTP only: from "If-Modified-Since:", or 0
+	char			*if_none_match;		// HTTP only: "If-None-Match:" value within buf[], or NULL
+	char			etag[32];		// HTTP only: validator for the current response (unquoted), if any
 	struct sockaddr_in	portaddr;
 	char			clientip[INET_ADDRSTRLEN];
 	char			user_passwd[24];	// khttpd
@@ -126,6 +149,8 @@ typedef struct server_parms_s {
 	unsigned char		tmp3[768];
 } server_parms_t;
 
+#define CONNECTION_HEADER(parms)	((parms)->keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n")
+
 static const char *
 inet_ntop2 (struct sockaddr_in *addr, char *ipaddr)
 {
@@ -177,6 +202,20 @@ extract_portaddr (struct sockaddr_in *addr, unsigned char *s)
 	return -1;	// failure
 }
 
+static int
+ksock_recv_nowait (struct socket *sock, char *buf, int len)
+{
+	struct msghdr	msg;
+	struct iovec	iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base	= buf;
+	iov.iov_len	= len;
+	msg.msg_iov	= &iov;
+	msg.msg_iovlen	= 1;
+	return sock_recvmsg(sock, &msg, len, MSG_DONTWAIT);
+}
+
 // Adapted from various examples in the kernel
 static int
 ksock_rw (struct socket *sock, const char *buf, int buf_size, int minimum)
@@ -254,8 +293,14 @@ static response_t response_table[] = {
 		"   USER    PORT    STOR    NLST    MKD     CDUP    PASS    ABOR*\r\n"
 		"   SITE    TYPE*   DELE    SYST*   RMD     STRU*   CWD     MODE*\r\n"
 		"   HELP    PWD     QUIT    RETR    LIST    NOOP    XMKD    XRMD\r\n"
-		"   REST    SIZE\r\n"
+		"   REST    SIZE    PASV    EPSV    FEAT\r\n"
 		"214 Okay"},
+	{211,	"-Features:\r\n"
+		" PASV\r\n"
+		" EPSV\r\n"
+		" REST STREAM\r\n"
+		" SIZE\r\n"
+		"211 End"},
 	{216,	"-The following SITE commands are recognized\r\n"
 		"   BUTTON  CHMOD   EXEC    HELP    POPUP   REBOOT  RO      RW\r\n"
 		"216 Okay"},
@@ -371,6 +416,91 @@ make_socket (server_parms_t *parms, struct socket **sockp, int port)
 	return rc;
 }
 
+static void
+close_pasvsock (server_parms_t *parms)
+{
+	if (parms->pasvsock) {
+		sock_release(parms->pasvsock);
+		parms->pasvsock = NULL;
+	}
+}
+
+// PASV/EPSV:  listen on a port from the kftpd_pasv_ports range,
+// and tell the client where to connect for the next data transfer.
+//
+static int
+kftpd_open_pasvsock (server_parms_t *parms, int extended)
+{
+	static unsigned short	next_port;	// shared by all connections, to spread the ports around
+	struct sockaddr_in	addr;
+	unsigned char		*ip = (unsigned char *)&addr.sin_addr.s_addr;
+	int			port = 0, tries, len = sizeof(addr), lo = hijack_kftpd_pasv_ports[0], hi = hijack_kftpd_pasv_ports[1];
+	char			text[64];
+
+	close_pasvsock(parms);
+	parms->have_portaddr = 0;
+	if (hi < lo)
+		hi = lo;
+	for (tries = hi - lo + 1; tries > 0; --tries) {
+		port = next_port;
+		if (port < lo || port > hi)
+			port = lo;
+		next_port = port + 1;
+		if (!make_socket(parms, &parms->pasvsock, port))
+			break;
+	}
+	if (!parms->pasvsock)
+		return 425;
+	if (parms->pasvsock->ops->listen(parms->pasvsock, 1) < 0
+	 || parms->clientsock->ops->getname(parms->clientsock, (struct sockaddr *)&addr, &len, 0)) {
+		close_pasvsock(parms);
+		return 425;
+	}
+	if (extended)
+		sprintf(text, " Entering Extended Passive Mode (|||%u|)", port);
+	else
+		sprintf(text, " Entering Passive Mode (%u,%u,%u,%u,%u,%u)", ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xff);
+	kftpd_send_response2(parms, extended ? 229 : 227, text, "");
+	return 0;
+}
+
+// Wait for the client to connect to our PASV/EPSV port.
+//
+static int
+kftpd_accept_pasvsock (server_parms_t *parms)
+{
+	struct socket		*sock = parms->pasvsock, *newsock;
+	struct sockaddr_in	peer, client;
+	int			len, timeout = 30 * HZ;
+
+	while (!(sock->ops->poll(NULL, sock, NULL) & POLLIN)) {
+		if (timeout <= 0 || signal_pending(current))
+			return 425;
+		current->state = TASK_INTERRUPTIBLE;
+		timeout -= HZ/10 - schedule_timeout(HZ/10);
+	}
+	if (!(newsock = sock_alloc()))
+		return 425;
+	newsock->type = sock->type;
+	if (sock->ops->dup(newsock, sock) < 0 || newsock->ops->accept(sock, newsock, O_NONBLOCK) < 0) {
+		sock_release(newsock);
+		return 425;
+	}
+	// only accept data connections from the same host as the control connection:
+	len = sizeof(peer);
+	if (newsock->ops->getname(newsock, (struct sockaddr *)&peer, &len, 1)
+	 || (len = sizeof(client), parms->clientsock->ops->getname(parms->clientsock, (struct sockaddr *)&client, &len, 1))
+	 || peer.sin_addr.s_addr != client.sin_addr.s_addr) {
+		if (!hijack_silent)
+			printk(KFTPD": rejected PASV data connection from a foreign host\n");
+		sock_release(newsock);
+		return 425;
+	}
+	parms->datasock = newsock;
+	(void) set_sockopt(parms, newsock, SOL_TCP, TCP_NODELAY, 1); // don't care
+	return 0;
+}
+
 static int
 open_datasock (server_parms_t *parms)
 {
@@ -379,6 +509,12 @@ open_datasock (server_parms_t *parms)
 
 	if (parms->protocol == khttpd) {
 		parms->datasock = parms->clientsock;
+	} else if (parms->pasvsock) {
+		if (kftpd_send_response(parms, 150))
+			response = 451;
+		else
+			response = kftpd_accept_pasvsock(parms);
+		close_pasvsock(parms);	// one data connection per PASV
 	} else if (!parms->have_portaddr) {
 		response = 425;
 	} else {
@@ -407,7 +543,6 @@ static char *
 format_time (tm_t *tm, int current_year, char *buf)
 {
 	int t, y;
-	extern const char *hijack_months[12];
 	const char *s = hijack_months[tm->tm_mon];
 
 	*buf++ = ' ';
@@ -452,6 +587,138 @@ append_string (char *b, const char *s, int quoted)
 	return b;
 }
 
+// Output stage for generated khttpd responses, whose length is unknown
+// when the header goes out.  The body is gzip'd when the client allows it,
+// and is framed with chunked transfer encoding for HTTP/1.1 clients,
+// so that the connection can be kept open.  Older clients get an unframed
+// body, and the connection is closed at the end of it.
+//
+#define BODY_CHUNK_HEAD	8			// room for "%x\r\n" in front of a chunk
+#define BODY_CHUNK_TAIL	8			// room for "\r\n0\r\n\r\n" after a chunk
+#define BODY_CHUNK_MAX	(PAGE_SIZE - BODY_CHUNK_HEAD - BODY_CHUNK_TAIL)
+
+typedef struct khttpd_body_s {
+	server_parms_t	*parms;
+	char		chunked;		// bool
+	hijack_gzip_t	*gzip;			// NULL when sending uncompressed
+	unsigned char	*buf;			// one page, for framing and compression; NULL if not needed
+} khttpd_body_t;
+
+// Send BODY_CHUNK_HEAD+len bytes from body->buf, framing them as required.
+//
+static int
+khttpd_body_send (khttpd_body_t *body, unsigned int len, int final)
+{
+	unsigned char	*data = body->buf + BODY_CHUNK_HEAD;
+
+	if (body->chunked) {
+		if (len) {
+			char	hdr[BODY_CHUNK_HEAD];
+			int	hlen = sprintf(hdr, "%x\r\n", len);
+			data -= hlen;
+			memcpy(data, hdr, hlen);
+			len += hlen;
+			data[len++] = '\r';
+			data[len++] = '\n';
+		}
+		if (final) {
+			memcpy(data + len, "0\r\n\r\n", 5);
+			len += 5;
+		}
+	}
+	if (!len || len == ksock_rw(body->parms->datasock, data, len, -1))
+		return 0;
+	body->parms->keepalive = 0;
+	return -ECOMM;
+}
+
+// Pass along some (more) of the body, and finish it off if final is set.
+//
+static int
+khttpd_body_write (khttpd_body_t *body, const unsigned char *buf, unsigned int len, int final)
+{
+	int	size;
+
+	if (body->parms->method_head)
+		return 0;
+	if (body->gzip) {
+		do {
+			size = hijack_gzip_output(body->gzip, &buf, &len, body->buf + BODY_CHUNK_HEAD, BODY_CHUNK_MAX, final);
+			if (size < 0 || (size && khttpd_body_send(body, size, 0)))
+				return -ECOMM;
+		} while (size);
+	} else if (body->chunked) {
+		while (len) {
+			size = (len < BODY_CHUNK_MAX) ? len : BODY_CHUNK_MAX;
+			memcpy(body->buf + BODY_CHUNK_HEAD, buf, size);
+			if (khttpd_body_send(body, size, 0))
+				return -ECOMM;
+			buf += size;
+			len -= size;
+		}
+	} else if (len && len != ksock_rw(body->parms->datasock, buf, len, -1)) {
+		body->parms->keepalive = 0;
+		return -ECOMM;
+	}
+	if (final && body->chunked)
+		return khttpd_body_send(body, 0, 1);
+	return 0;
+}
+
+// Send the response header for a generated body, and set up the output stage.
+// A non-negative length means the (uncompressed) body is already complete.
+//
+static int
+khttpd_body_start (server_parms_t *parms, khttpd_body_t *body, const char *content_type, int length)
+{
+	char	hdr[256];
+	int	hlen;
+
+	body->parms   = parms;
+	body->chunked = 0;
+	body->gzip    = NULL;
+	body->buf     = NULL;
+	if (parms->accept_gzip && hijack_khttpd_gzip && (length < 0 || length > 512) && !parms->method_head) {	// not worth it for tiny bodies
+		if ((body->buf = (unsigned char *)__get_free_page(GFP_KERNEL)))
+			body->gzip = hijack_gzip_open(hijack_khttpd_gzip);
+		if (!body->gzip && body->buf) {
+			free_page((unsigned long)body->buf);
+			body->buf = NULL;
+		}
+	}
+	hlen = sprintf(hdr, "HTTP/1.1 200 OK\r\n");
+	if (length >= 0 && !body->gzip) {
+		hlen += sprintf(hdr+hlen, "Content-Length: %u\r\n", length);
+	} else if (parms->http11) {
+		if (body->buf || (body->buf = (unsigned char *)__get_free_page(GFP_KERNEL))) {
+			body->chunked = 1;
+			hlen += sprintf(hdr+hlen, "Transfer-Encoding: chunked\r\n");
+		}
+	}
+	if (!body->chunked && (length < 0 || body->gzip))
+		parms->keepalive = 0;
+	if (body->gzip)
+		hlen += sprintf(hdr+hlen, "Content-Encoding: gzip\r\n");
+	if (hijack_khttpd_gzip)
+		hlen += sprintf(hdr+hlen, "Vary: Accept-Encoding\r\n");
+	if (parms->etag[0])	// the gzip'd variant gets its own (strong) validator
+		hlen += sprintf(hdr+hlen, "ETag: \"%s%s\"\r\nCache-Control: max-age=0\r\n", parms->etag, body->gzip ? "-gz" : "");
+	hlen += sprintf(hdr+hlen, "%sContent-Type: %s\r\n\r\n", CONNECTION_HEADER(parms), content_type);
+	if (hlen == ksock_rw(parms->datasock, hdr, hlen, -1))
+		return 0;
+	parms->keepalive = 0;
+	return -ECOMM;
+}
+
+static void
+khttpd_body_end (khttpd_body_t *body)
+{
+	if (body->gzip)
+		hijack_gzip_close(body->gzip);
+	if (body->buf)
+		free_page((unsigned long)body->buf);
+}
+
 typedef struct filldir_parms_s {
 	unsigned short		current_year;	// current calendar year (YYYY), according to the Empeg
 	unsigned short		full_listing;	// 0 == names only, 1 == "ls -l"
@@ -468,6 +735,7 @@ typedef struct filldir_parms_s {
 	unsigned int		nam_size;	// size (bytes) of nam[]
 	unsigned int		nam_used;	// number of bytes used in nam[]
 	char			*nam;		// allocated buffer for names from filldir()
+	khttpd_body_t		*body;		// output stage for khttpd; NULL for kftpd
 	int			path_len;	// length of (non-zero terminated) base path in path[]
 	char			path[768];	// full dir prefix, plus current name appended for dentry lookups
 } filldir_parms_t;
@@ -539,7 +807,10 @@ send_dirlist_buf (server_parms_t *parms, filldir_parms_t *p, int send_trailer)
 			p->buf_used += sprintf(p->buf + p->buf_used, "total %lu\r\n", p->blockcount);
 		}
 	}
-	sent = ksock_rw(parms->datasock, p->buf, p->buf_used, -1);
+	if (p->body)
+		sent = khttpd_body_write(p->body, p->buf, p->buf_used, send_trailer) ? -ECOMM : p->buf_used;
+	else
+		sent = ksock_rw(parms->datasock, p->buf, p->buf_used, -1);
 	if (sent != p->buf_used) {
 		if (parms->verbose && !hijack_silent)
 			printk("%s: send_dirlist_buf(): ksock_rw(%u) returned %d\n", parms->servername, p->buf_used, sent);
@@ -689,9 +960,6 @@ exit:
 }
 
 static const char dirlist_header[] =
-	"HTTP/1.1 200 OK\r\n"
-	"Connection: close\r\n"
-	"Content-Type: text/html\r\n\r\n"
 	"<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\r\n"
 	"<html>"
 	"<head><title>Index of %s</title></head>"
@@ -706,6 +974,7 @@ send_dirlist (server_parms_t *parms, char *path, int full_listing)
 	struct file	*filp;
 	unsigned int	response = 0;
 	filldir_parms_t	p;
+	khttpd_body_t	body;
 
 	current->policy = SCHED_OTHER;
 	memset(&p, 0, sizeof(p));
@@ -767,9 +1036,13 @@ send_dirlist (server_parms_t *parms, char *path, int full_listing)
 			p.name		= p.path + pathlen;
 			p.sb		= dentry->d_sb;
 			p.use_http	= (parms->protocol == khttpd);
-			if (p.use_http)
+			rc = 0;
+			if (p.use_http) {
+				p.body = &body;
+				rc = khttpd_body_start(parms, &body, "text/html", -1);
 				p.buf_used = sprintf(p.buf, dirlist_header, path, path);
-			do {
+			}
+			if (!rc) do {
 				p.nam_used = 0;
 				p.filecount = 0;
 				schedule(); // give the music player a chance to run
@@ -798,7 +1071,9 @@ send_dirlist (server_parms_t *parms, char *path, int full_listing)
 			} while (!rc && p.filecount);
 			if (rc || (rc = send_dirlist_buf(parms, &p, 1)))
 				response = 426;
-			if (!p.use_http)
+			if (p.use_http)
+				khttpd_body_end(&body);
+			else
 				sock_release(parms->datasock);
 			if (p.nam)
 				free_page((unsigned long)p.nam);
@@ -813,14 +1088,34 @@ send_dirlist (server_parms_t *parms, char *path, int full_listing)
 
 typedef enum {auth_none, auth_basic, auth_full} khttpd_auth_t;
 
+// Send a canned response: the header (which carries a Content-Length:),
+// followed by the body unless this was a HEAD request.
+//
+static void
+khttpd_send_response (server_parms_t *parms, const char *hdr, unsigned int hlen, const char *body, unsigned int len)
+{
+	unsigned int rc;
+
+	rc = ksock_rw(parms->clientsock, hdr, hlen, -1);
+	if (rc == hlen && !parms->method_head)
+		rc = ksock_rw(parms->clientsock, body, len, -1) + hlen - len;
+	if (rc != hlen) {
+		parms->keepalive = 0;
+		if (parms->verbose && !hijack_silent)
+			printk(KHTTPD": respond(): ksock_rw(%d) returned %d, data=\"%s\"\n", len, rc, body);
+	}
+}
+
 static int
 khttpd_check_auth (server_parms_t *parms, khttpd_auth_t authtype)
 {
-	static const char khttpd_response[] =
+	static const char khttpd_header[] =
 		"HTTP/1.1 401 Unauthorized\r\n"
-		"Connection: close\r\n"
+		"%s"
 		"WWW-Authenticate: Basic realm=\"Empeg-%s\"\r\n"
-		"Content-Type: text/html\r\n\r\n"
+		"Content-Length: %u\r\n"
+		"Content-Type: text/html\r\n\r\n";
+	static const char khttpd_response[] =
 		"<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
 		"<html><head>"
 		"<title>401 Unauthorized</title>"
@@ -834,13 +1129,11 @@ khttpd_check_auth (server_parms_t *parms, khttpd_auth_t authtype)
 	if (parms->auth >= authtype) {
 		return 0;
 	} else {
-		char		*buf = parms->cwd, *auths = (authtype == auth_full) ? "Full" : "Basic";
-		unsigned int	len, rc;
+		char		*buf = parms->cwd, *auths = (authtype == auth_full) ? "Full" : "Basic", hdr[160];
+		unsigned int	len;
 
-		len = sprintf(buf, khttpd_response, auths, auths);
-		rc = ksock_rw(parms->clientsock, buf, len, -1);
-		if (rc != len && parms->verbose && !hijack_silent)
-			printk(KHTTPD": respond(): ksock_rw(%d) returned %d, data=\"%s\"\n", len, rc, buf);
+		len = sprintf(buf, khttpd_response, auths);
+		khttpd_send_response(parms, hdr, sprintf(hdr, khttpd_header, CONNECTION_HEADER(parms), auths, len), buf, len);
 		return 1;
 	}
 }
@@ -848,11 +1141,13 @@ khttpd_check_auth (server_parms_t *parms, khttpd_auth_t authtype)
 static void
 khttpd_respond (server_parms_t *parms, int rcode, const char *title, const char *text)
 {
-	static const char khttpd_response[] =
+	static const char khttpd_header[] =
 		"HTTP/1.1 %d %s\r\n"
-		"Connection: close\r\n"
+		"%s"
 		"Allow: GET, HEAD\r\n"
-		"Content-Type: text/html\r\n\r\n"
+		"Content-Length: %u\r\n"
+		"Content-Type: text/html\r\n\r\n";
+	static const char khttpd_response[] =
 		"<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
 		"<html><head>"
 		"<title>%d %s</title>"
@@ -861,23 +1156,23 @@ khttpd_respond (server_parms_t *parms, int rcode, const char *title, const char
 		"%s<p>"
 		"</body></html>\r\n";
 
-	char		*buf = parms->cwd;
-	unsigned int	len, rc;
+	char		*buf = parms->cwd, hdr[160];
+	unsigned int	len;
 
-	len = sprintf(buf, khttpd_response, rcode, title, rcode, title, rcode, title, text ? text : "");
-	rc = ksock_rw(parms->clientsock, buf, len, -1);
-	if (rc != len && parms->verbose && !hijack_silent)
-		printk(KHTTPD": respond(): ksock_rw(%d) returned %d, data=\"%s\"\n", len, rc, buf);
+	len = sprintf(buf, khttpd_response, rcode, title, rcode, title, text ? text : "");
+	khttpd_send_response(parms, hdr, sprintf(hdr, khttpd_header, rcode, title, CONNECTION_HEADER(parms), len), buf, len);
 }
 
 static void
 khttpd_redirect (server_parms_t *parms, const char *path, char *slash)
 {
-	static const char http_redirect[] =
+	static const char http_header[] =
 		"HTTP/1.1 302 Found\r\n"
 		"Location: %s%s\r\n"
-		"Connection: close\r\n"
-		"Content-Type: text/html\r\n\r\n"
+		"%s"
+		"Content-Length: %u\r\n"
+		"Content-Type: text/html\r\n\r\n";
+	static const char http_redirect[] =
 		"<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
 		"<html><head>"
 		"<title>301 Moved</title>"
@@ -885,14 +1180,11 @@ khttpd_redirect (server_parms_t *parms, const char *path, char *slash)
 		"<h1>Moved</h1>"
 		"The document has moved <a href=\"%s%s\">here</a>.<p>"
 		"</body></html>\r\n";
-	char *buf = parms->tmp3;
-
-	unsigned int	len, rc;
+	char		*buf = parms->tmp3, *hdr = parms->tmp2;
+	unsigned int	len;
 
-	len = sprintf(buf, http_redirect, path, slash, path, slash);
-	rc = ksock_rw(parms->clientsock, buf, len, -1);
-	if (rc != len && !hijack_silent)
-		printk(KHTTPD": redirect(): ksock_rw(%d) returned %d\n", len, rc);
+	len = sprintf(buf, http_redirect, path, slash);
+	khttpd_send_response(parms, hdr, sprintf(hdr, http_header, path, slash, CONNECTION_HEADER(parms), len), buf, len);
 }
 
 static const char audio_mpeg[]		= "audio/mpeg";
@@ -1034,8 +1326,94 @@ open_fid_file (char *path)
 	return fd;
 }
 
+// Conditional GET support.  Files are validated by inode, size and mtime.
+// Generated playlists are validated by fid plus hijack_fids_generation,
+// which changes whenever anything on the music partitions does.
+//
+static const char *http_weekdays[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static unsigned int khttpd_etag_stamp;			// set at startup, so playlist ETags differ across reboots
+
 static int
-khttp_send_file_header (server_parms_t *parms, char *path, off_t length, char *buf, int bufsize)
+khttpd_format_date (char *buf, time_t time)
+{
+	tm_t	tm;
+
+	hijack_convert_time(time, &tm);
+	return sprintf(buf, "%s, %02d %s %d %02d:%02d:%02d GMT", http_weekdays[tm.tm_wday],
+		tm.tm_mday, hijack_months[tm.tm_mon], tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// Parse an RFC1123 date, eg. "Sun, 06 Nov 1994 08:49:37 GMT".  Returns 0 on failure.
+//
+static time_t
+khttpd_parse_date (unsigned char *s)
+{
+	static const unsigned short month_days[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+	int	mday, mon, year, hour, min, sec;
+	time_t	days;
+
+	while (*s != ',') {
+		if (!*s || *s == '\r' || *s == '\n')
+			return 0;
+		++s;
+	}
+	s += 2;
+	if (!get_number(&s, &mday, 10, " ") || !*s++)
+		return 0;
+	for (mon = 0; mon < 12 && strxcmp(s, hijack_months[mon], 1); ++mon);
+	s += 4;
+	if (mon >= 12 || !get_number(&s, &year, 10, " ") || year < 1970 || !*s++
+	 || !get_number(&s, &hour, 10, ":") || !*s++ || !get_number(&s, &min, 10, ":") || !*s++ || !get_number(&s, &sec, 10, " "))
+		return 0;
+	days = (year - 1970) * 365 + (year - 1969) / 4 + month_days[mon] + mday - 1;
+	if (mon > 1 && !(year % 4))
+		++days;
+	return (((days * 24) + hour) * 60 + min) * 60 + sec;
+}
+
+// Check the client's "If-None-Match:" list for parms->etag, or for its "-gz"
+// variant when this client would be sent the gzip'd body again.
+//
+static int
+khttpd_etag_match (const char *list, const char *etag, int gzip_ok)
+{
+	int	len = strlen(etag);
+	char	c;
+
+	while ((c = *list) && c != '\r' && c != '\n') {
+		if (c == '*')
+			return 1;
+		if (c == '"' && !strncmp(list + 1, etag, len)
+		 && (list[len + 1] == '"' || (gzip_ok && !strxcmp(list + len + 1, "-gz\"", 1))))
+			return 1;
+		++list;
+	}
+	return 0;
+}
+
+// Returns non-zero if the client's cached copy is still good,
+// in which case a "304 Not Modified" has been sent in place of the response.
+//
+static int
+khttpd_not_modified (server_parms_t *parms, time_t mtime)
+{
+	char	hdr[96];
+	int	len;
+
+	if (parms->if_none_match) {
+		if (!khttpd_etag_match(parms->if_none_match, parms->etag, parms->accept_gzip && hijack_khttpd_gzip))
+			return 0;
+	} else if (!mtime || !parms->if_modified_since || mtime > parms->if_modified_since) {
+		return 0;
+	}
+	len = sprintf(hdr, "HTTP/1.1 304 Not Modified\r\n%sETag: \"%s\"\r\n\r\n", CONNECTION_HEADER(parms), parms->etag);
+	if (len != ksock_rw(parms->clientsock, hdr, len, -1))
+		parms->keepalive = 0;
+	return 1;
+}
+
+static int
+khttp_send_file_header (server_parms_t *parms, char *path, struct stat *st, off_t length, char *buf, int bufsize)
 {
 	static char	*labels[] = {"type=", "artist=", "title=", "codec=", NULL};
 	struct 		{char *type, *artist, *title, *codec;} tags;
@@ -1043,7 +1421,14 @@ khttp_send_file_header (server_parms_t *parms, char *path, off_t length, char *b
 	const char	*mimetype = application_octet, *rcode = "200 OK";
 	off_t		clength = length;
 	char		artist_title[128];
+	int		cacheable;
 
+	cacheable = !(parms->nocache || parms->running_playlist || !strxcmp(path, "/proc/", 1) || !strxcmp(path, "/dev/", 1));
+	if (cacheable) {
+		sprintf(parms->etag, "%lx-%lx-%lx", st->st_ino, st->st_size, st->st_mtime);
+		if (khttpd_not_modified(parms, st->st_mtime))
+			return 304;
+	}
 	artist_title[0] = '\0';
 	if (hijack_glob_match(path, "/empeg/fids?/*0")) {
 		char c, *lastc = path + strlen(path) - 1;
@@ -1078,19 +1463,27 @@ khttp_send_file_header (server_parms_t *parms, char *path, off_t length, char *b
 		clength = parms->end_offset + 1 - parms->start_offset;
 		rcode = "206 Partial content";
 	}
-	len = sprintf(buf, "HTTP/1.1 %s\r\nConnection: close\r\n", rcode);
+	if (!clength)
+		parms->keepalive = 0;	// eg. /proc files: no way to know the length in advance
+	len = sprintf(buf, "HTTP/1.1 %s\r\n%s", rcode, CONNECTION_HEADER(parms));
 	if (clength) {
 		len += sprintf(buf+len, "Accept-Ranges: bytes\r\nContent-Length: %lu\r\n", clength);
 		if (parms->end_offset != -1)
 			len += sprintf(buf+len, "Content-Range: bytes %lu-%lu/%lu\r\n", parms->start_offset, parms->end_offset, length);
 	}
-	if (parms->nocache || !strxcmp(path, "/proc/", 1) || !strxcmp(path, "/dev/", 1)) {
+	if (cacheable) {
+		len += sprintf(buf+len, "ETag: \"%s\"\r\nCache-Control: max-age=0\r\nLast-Modified: ", parms->etag);
+		len += khttpd_format_date(buf+len, st->st_mtime);
+		len += sprintf(buf+len, "\r\n");
+	} else {
 		len += sprintf(buf+len,	"Cache-Control: no-cache,must-revalidate,max-age=0,no-store\r\n"
 					"Pragma: no-cache,no-store\r\n"
 					"Expires: -1\r\n" );
 	}
 	if (mimetype)
 		len += sprintf(buf+len, "Content-Type: %s\r\n", mimetype);
+	if (parms->gzip_sibling)
+		len += sprintf(buf+len, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
 	if (artist_title[0]) {	// tune title for WinAmp, XMMS, Save-To-Disk, etc..
 		if (parms->icy_metadata) {
 			len += sprintf(buf+len, "icy-name:%s\r\n", artist_title);
@@ -1128,8 +1521,10 @@ prepare_file_xfer (server_parms_t *parms, char *path, file_xfer_t *xfer, int wri
 	xfer->buf = NULL;
 	xfer->writing = writing;
 	xfer->redirected = 0;
+	// REST+STOR may arrive (on parallel connections) in any order, so any
+	// REST (even "REST 0") means no truncation, and may lie beyond the current EOF.
 	if (writing)
-		flags = start_offset ? O_RDWR : O_RDWR|O_CREAT|O_TRUNC;
+		flags = parms->rest_pending ? O_RDWR|O_CREAT : O_RDWR|O_CREAT|O_TRUNC;
 	else
 		flags = O_RDONLY;
 	if (!writing && parms->protocol && hijack_glob_match(path, "/empeg/fids?/*"))
@@ -1157,7 +1552,7 @@ prepare_file_xfer (server_parms_t *parms, char *path, file_xfer_t *xfer, int wri
 			}
 		} else if (end_offset != -1 && (xfer->st.st_size && end_offset >= xfer->st.st_size)) {
 			response = parms->protocol ? 416 : 553;
-		} else if (start_offset && ((xfer->st.st_size && start_offset > xfer->st.st_size) || start_offset != lseek(fd, start_offset, 0))) {
+		} else if (start_offset && ((!writing && xfer->st.st_size && start_offset > xfer->st.st_size) || start_offset != lseek(fd, start_offset, 0))) {
 			if (!hijack_silent)
 				printk("%s: lseek(%s,%lu/%lu) failed\n", parms->servername, path, start_offset, xfer->st.st_size);
 			response = parms->protocol ? 416 : 553;
@@ -1185,6 +1580,7 @@ cleanup_file_xfer (server_parms_t *parms, file_xfer_t *xfer)
 		free_page((unsigned long)xfer->buf);
 	parms->start_offset =  0;
 	parms->end_offset   = -1;
+	parms->rest_pending =  0;
 }
 
 static unsigned int
@@ -1281,6 +1677,154 @@ encode_tag2 (unsigned char *out, const char *tagname, unsigned char *s)
 	return out - start;
 }
 
+// Cache of parsed tagfiles for send_playlist().
+//
+// Generating a large playlist otherwise means an open()/read()/find_tags()
+// for every child fid on every request, which takes many seconds and stalls
+// the player's disk accesses.  Entries hold just the tag values we use,
+// and are kept in LRU order.  Everything cached before the most recent
+// change to the music partitions (see hijack_fids_generation in fs/open.c)
+// is treated as stale.
+//
+extern unsigned int hijack_fids_generation;		// from fs/open.c
+extern int hijack_khttpd_tagcache;			// from arch/arm/special/hijack.c
+
+static char *playlist_labels[] = {"type=", "artist=", "title=", "codec=", "duration=", "source=", "length=", "genre=", "year=", "comment=", "tracknr=", "offset=", "options=", "bitrate=", "samplerate=", NULL};
+#define PLAYLIST_NLABELS	((sizeof(playlist_labels) / sizeof(playlist_labels[0])) - 1)
+
+typedef struct playlist_tags_s {
+	char *type, *artist, *title, *codec, *duration, *source, *length, *genre, *year, *comment, *tracknr, *offset, *options, *bitrate, *samplerate;
+} playlist_tags_t;
+
+#define TAGCACHE_HASHSIZE	64	// must be a power of two
+
+typedef struct tagcache_entry_s {
+	struct list_head	lru;		// most recently used at head
+	struct tagcache_entry_s	*next;		// hash chain
+	unsigned int		fid;		// tagfile fid (ends in 1)
+	unsigned int		generation;	// hijack_fids_generation when read from disk
+	unsigned short		size;		// bytes used in data[]
+	unsigned char		drive;		// '0' or '1': where the tagfile was found
+	unsigned short		values[PLAYLIST_NLABELS];	// offsets into data[]
+	char			data[0];	// zero-terminated tag values
+} tagcache_entry_t;
+
+static struct semaphore		tagcache_sem = MUTEX;
+static tagcache_entry_t		*tagcache_hash[TAGCACHE_HASHSIZE];
+static LIST_HEAD(tagcache_lru);
+static unsigned int		tagcache_count, tagcache_hits, tagcache_misses;
+
+static void
+tagcache_remove (tagcache_entry_t *e)
+{
+	tagcache_entry_t **pp = &tagcache_hash[(e->fid >> 4) & (TAGCACHE_HASHSIZE - 1)];
+
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	list_del(&e->lru);
+	kfree(e);
+	--tagcache_count;
+}
+
+static void
+tagcache_insert (unsigned int fid, unsigned char drive, playlist_tags_t *tags, unsigned int bufsize, unsigned int generation)
+{
+	char			**values = (char **)tags;
+	tagcache_entry_t	*e;
+	unsigned int		i, size = 0;
+
+	for (i = 0; i < PLAYLIST_NLABELS; ++i)
+		size += strlen(values[i]) + 1;
+	if (size > bufsize)	// must fit back into the caller's buffer on a cache hit
+		return;
+	while (tagcache_count >= hijack_khttpd_tagcache && !list_empty(&tagcache_lru))
+		tagcache_remove(list_entry(tagcache_lru.prev, tagcache_entry_t, lru));
+	if (!hijack_khttpd_tagcache || !(e = kmalloc(sizeof(tagcache_entry_t) + size, GFP_KERNEL)))
+		return;
+	e->fid		= fid;
+	e->generation	= generation;
+	e->drive	= drive;
+	e->size		= 0;
+	for (i = 0; i < PLAYLIST_NLABELS; ++i) {
+		e->values[i] = e->size;
+		strcpy(e->data + e->size, values[i]);
+		e->size += strlen(values[i]) + 1;
+	}
+	e->next = tagcache_hash[(fid >> 4) & (TAGCACHE_HASHSIZE - 1)];
+	tagcache_hash[(fid >> 4) & (TAGCACHE_HASHSIZE - 1)] = e;
+	list_add(&e->lru, &tagcache_lru);
+	++tagcache_count;
+}
+
+// Fetch the tags for the tagfile named by subpath[], filling in tags
+// with pointers into buf[] (which must be at least as large as parms->tmp3).
+// Updates the drive number in subpath[] to wherever the file was found.
+// Returns the (non-zero) number of bytes in buf[], or <= 0 on failure.
+//
+static int
+get_playlist_tags (char *subpath, unsigned int fid, char *buf, int bufsize, playlist_tags_t *tags)
+{
+	tagcache_entry_t	*e;
+	int			fd, size;
+	unsigned int		generation;
+
+	down(&tagcache_sem);
+	for (e = tagcache_hash[(fid >> 4) & (TAGCACHE_HASHSIZE - 1)]; e; e = e->next) {
+		if (e->fid == fid) {
+			if (e->generation != hijack_fids_generation) {
+				tagcache_remove(e);
+				break;
+			}
+			list_del(&e->lru);
+			list_add(&e->lru, &tagcache_lru);
+			memcpy(buf, e->data, e->size);
+			for (size = 0; size < PLAYLIST_NLABELS; ++size)
+				((char **)tags)[size] = buf + e->values[size];
+			subpath[11] = e->drive;
+			size = e->size;
+			++tagcache_hits;
+			up(&tagcache_sem);
+			return size;
+		}
+	}
+	++tagcache_misses;
+	up(&tagcache_sem);
+
+	// Note the generation before reading, so a write that lands
+	// during the read leaves the new entry already stale.
+	generation = hijack_fids_generation;
+	fd = open_fid_file(subpath);
+	if (fd < 0)
+		return fd;
+	size = read(fd, buf, bufsize - 1);
+	close(fd);
+	if (size > 0) {
+		buf[size] = '\0';	// Ensure zero-termination of the data
+		find_tags(buf, size, playlist_labels, (char **)tags);
+		down(&tagcache_sem);
+		tagcache_insert(fid, subpath[11], tags, bufsize, generation);
+		up(&tagcache_sem);
+	}
+	return size;
+}
+
+// Send the accumulated playlist text.  The HTTP header is held back until
+// the first send, so that a playlist which fits entirely within one buffer
+// can go out with a Content-Length.  Anything larger is streamed out
+// as it is generated, by way of khttpd_body_write().
+//
+static int
+send_playlist_buf (khttpd_body_t *body, char *buf, int used, int final, const char *content_type, int *header_sent)
+{
+	if (!*header_sent) {
+		*header_sent = 1;
+		if (khttpd_body_start(body->parms, body, content_type, final ? used : -1))
+			return -1;
+	}
+	return khttpd_body_write(body, buf, used, final);
+}
+
 static const http_response_t *
 send_playlist (server_parms_t *parms, char *path)
 {
@@ -1288,10 +1832,12 @@ send_playlist (server_parms_t *parms, char *path)
 	unsigned int	secs = 0, start = 0, count = 0, limit = 0x7fffffff, playlist_len = 0, running_len = 0;
 	unsigned char	*p, subpath[] = "/empeg/fids0/XXXXXXXXXX", artist_title[128], fidtype;
 	int		pfid, fid, size, used = 0, xmit_threshold, fidfiles[16], fidx = -1;	// up to 16 levels of nesting
+	int		header_sent = 0;
+	khttpd_body_t	body = {parms, 0, NULL, NULL};
+	char		content_type[48];
 	static const char *playlist_format[3] = {text_html, audio_m3u, text_xml};
 	static char	*tagtypes[2] = {"playlist", "tune"};
-	static char	*labels[] = {"type=", "artist=", "title=", "codec=", "duration=", "source=", "length=", "genre=", "year=", "comment=", "tracknr=", "offset=", "options=", "bitrate=", "samplerate=", NULL};
-	struct 		{char *type, *artist, *title, *codec, *duration, *source, *length, *genre, *year, *comment, *tracknr, *offset, *options, *bitrate, *samplerate;} tags;
+	playlist_tags_t	tags;
 	const char	*tagtype, *encoding;
 	file_xfer_t	xfer;
 
@@ -1301,6 +1847,18 @@ send_playlist (server_parms_t *parms, char *path)
 		return &invalid_playlist_path;
 	fid = pfid |= 1;	// we know the fid ends in "1", but make sure anyway..
 
+	// the output also depends upon the Host: and user:password, which get embedded in the links
+	if (fid != 1 && !parms->nocache) {
+		unsigned int hash = khttpd_etag_stamp;
+		for (p = parms->hostname; *p; ++p)
+			hash = (hash * 31) + *p;
+		for (p = parms->user_passwd; *p; ++p)
+			hash = (hash * 31) + *p;
+		sprintf(parms->etag, "p%x-%x-%x", fid, hijack_fids_generation, hash);
+		if (khttpd_not_modified(parms, 0))
+			return NULL;
+	}
+
 	start = parms->offset;
 	if (parms->count)
 		limit = parms->count;
@@ -1341,7 +1899,7 @@ send_playlist (server_parms_t *parms, char *path)
 		parms->tmp3[size] = '\0';	// Ensure zero-termination of the data
 
 		// parse the tagfile for the tags we are interested in:
-		find_tags(parms->tmp3, size, labels, (char **)&tags);
+		find_tags(parms->tmp3, size, playlist_labels, (char **)&tags);
 		fidtype = TOUPPER(tags.type[0]);
 		if (fidtype != 'T' && fidtype != 'P') {
 			response = &(http_response_t){408, "Invalid tag file"};
@@ -1356,11 +1914,11 @@ send_playlist (server_parms_t *parms, char *path)
 		if (fidtype == 'T') {
 			if (parms->generate_playlist != xml) {
 				secs = str_val(tags.duration) / 1000;
-				used  = sprintf(xfer.buf, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: %s\r\n\r\n"
-					"#EXTM3U\r\n#EXTINF:%u,%s\r\nhttp://%s%s/", audio_m3u, secs, artist_title, parms->user_passwd, parms->hostname);
+				used  = sprintf(xfer.buf, "#EXTM3U\r\n#EXTINF:%u,%s\r\nhttp://%s%s/",
+					secs, artist_title, parms->user_passwd, parms->hostname);
 				used += encode_url(xfer.buf+used, artist_title, 0);
 				used += sprintf(xfer.buf+used, ".%s?FID=%x&EXT=.%s\r\n", tags.codec, pfid^1, tags.codec);
-				(void)ksock_rw(parms->datasock, xfer.buf, used, -1);
+				(void) send_playlist_buf(&body, xfer.buf, used, 1, audio_m3u, &header_sent);
 				goto cleanup;
 			}
 		}
@@ -1368,8 +1926,7 @@ send_playlist (server_parms_t *parms, char *path)
 
 	// Send the playlist header, in either html, m3u, or xml format:
 	encoding = (player_version >= MK2_PLAYER_v3a1) ? "UTF-8" : "ISO-8859-1";
-	used += sprintf(xfer.buf+used, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: %s; charset=%s\r\n\r\n",
-					playlist_format[parms->generate_playlist - 1], encoding);
+	sprintf(content_type, "%s; charset=%s", playlist_format[parms->generate_playlist - 1], encoding);
 
 	switch (parms->generate_playlist) {
 		case html:
@@ -1449,7 +2006,7 @@ open_fidfile:
 	xmit_threshold = (parms->generate_playlist == xml) ? 1536 : 512;
 	while (fidx >= 0) {
 		while (count < limit) {
-			int sublen, fd, entries = 0;
+			int sublen, entries = 0;
 			if (parms->running_playlist && fidx == 0) {
 				unsigned int fidTableIndex, rc;
 		 		/*
@@ -1492,35 +2049,33 @@ open_fidfile:
 			}
 			++count;
 
-			if (used >= xmit_threshold && (used -= ksock_rw(parms->datasock, xfer.buf, used, -1)))
-				goto cleanup;
+			if (used >= xmit_threshold) {
+				if (send_playlist_buf(&body, xfer.buf, used, 0, content_type, &header_sent))
+					goto cleanup;
+				used = 0;
+			}
 
 			schedule(); // give the music player a chance to run
 			// read in the tagfile for this fid
 			fid |= 1;
 			sublen = 13+sprintf(subpath+13, "%x", fid);
-			fd = open_fid_file(subpath);
-			if (fd < 0) {
+			size = get_playlist_tags(subpath, fid, parms->tmp3, sizeof(parms->tmp3), &tags);
+			if (size < 0) {
 				// Hmmm.. missing tags file.  This IS a database error, and should never happen.  But it does..
 				// But we'll just ignore it here.
 				if (parms->generate_playlist == html && !hijack_silent)
-					printk(KHTTPD": open(\"%s\") failed, rc=%d\n", subpath, fd);
+					printk(KHTTPD": open(\"%s\") failed, rc=%d\n", subpath, size);
 				continue;
 			}
-			size = read(fd, parms->tmp3, sizeof(parms->tmp3)-1);
-			close(fd);
 			path[11] = subpath[11];	// update the drive number '0'|'1'
-			if (size <= 0) {
+			if (size == 0) {
 				// Hmmm.. empty tags file.  This IS a database error, and should never happen.
 				// But we'll just ignore it here.
 				if (parms->generate_playlist == html && !hijack_silent)
 					printk(KHTTPD": read(\"%s\") failed, rc=%d\n", subpath, size);
 				continue;
 			}
-			parms->tmp3[size] = '\0';	// Ensure zero-termination of the data
 
-			// parse the tagfile for the tags we are interested in:
-			find_tags(parms->tmp3, size, labels, (char **)&tags);
 			fidtype = TOUPPER(tags.type[0]);
 			if (fidtype == 'P') {
 				if (parms->generate_playlist == m3u) {
@@ -1627,15 +2182,78 @@ aborted:
 		default:
 	}
 sendit:
-	if (used)
-		(void) ksock_rw(parms->datasock, xfer.buf, used, -1);
+	(void) send_playlist_buf(&body, xfer.buf, used, 1, content_type, &header_sent);
 cleanup:
 	while (fidx >= 0)
 		close(fidfiles[fidx--]);
+	khttpd_body_end(&body);
 	cleanup_file_xfer(parms, &xfer);
 	return response;
 }
 
+// Send a regular file straight from the page cache to the data socket,
+// without first copying it through xfer->buf.  Returns -EINVAL when the
+// file cannot be mapped through the page cache (eg. /proc), in which case
+// the caller falls back to read() + ksock_rw().
+//
+#define SENDFILE_CHUNK	(16 * PAGE_SIZE)
+
+static int
+send_file_pages (server_parms_t *parms, file_xfer_t *xfer, off_t filepos, off_t filesize)
+{
+	struct file	*filp;
+	loff_t		pos = filepos;
+	off_t		endpos = filesize;
+	int		rc = 0;
+
+	if (!(filp = fget(xfer->fd)))
+		return -EINVAL;
+	if (parms->end_offset != -1)
+		endpos = parms->end_offset + 1;
+	while (pos < endpos) {
+		size_t count = endpos - pos;
+		if (count > SENDFILE_CHUNK)
+			count = SENDFILE_CHUNK;
+		schedule(); // give the music player a chance to run
+		rc = hijack_sendfile(parms->datasock, filp, &pos, count);
+		if (rc <= 0) {
+			if (rc == -EINVAL && pos == filepos)
+				break;		// not page-cache backed: use the old method
+			if (!hijack_silent && rc)
+				printk("%s: sendfile() failed; rc=%d\n", parms->servername, rc);
+			if (!rc)
+				rc = -EIO;
+			break;
+		}
+		rc = 0;
+	}
+	fput(filp);
+	return rc;
+}
+
+// Static files (eg. the stylesheet, or the root index.html) may be stored
+// precompressed alongside the originals, as "file.gz".  When the client
+// accepts gzip, send that instead, with a Content-Encoding: header.
+//
+static void
+khttpd_find_gzip_sibling (server_parms_t *parms, char *path)
+{
+	int len;
+
+	parms->gzip_sibling = 0;
+	if (!parms->protocol || !parms->accept_gzip || parms->generate_playlist
+	 || !strxcmp(path, "/proc/", 1) || !strxcmp(path, "/dev/", 1) || !strxcmp(path, "/empeg/fids", 1))
+		return;
+	len = strlen(path);
+	if (len < 4 || (len + 4) > sizeof(parms->cwd) || path[len-1] == '/' || !strxcmp(path + len - 3, ".gz", 0))
+		return;
+	strcpy(path + len, ".gz");
+	if (1 == classify_path(path))
+		parms->gzip_sibling = 1;
+	else
+		path[len] = '\0';
+}
+
 static int
 send_file (server_parms_t *parms, char *path)
 {
@@ -1643,7 +2261,10 @@ send_file (server_parms_t *parms, char *path)
 	unsigned int	response = 0;
 	file_xfer_t	xfer;
 
+	khttpd_find_gzip_sibling(parms, path);
 	response = prepare_file_xfer(parms, path, &xfer, 0);
+	if (parms->gzip_sibling)
+		path[strlen(path) - 3] = '\0';	// back to the original name, for the mime type
 	if (!response && !xfer.redirected) {
 		off_t	filepos, filesize = xfer.st.st_size;
 		if (parms->protocol) {
@@ -1654,10 +2275,19 @@ send_file (server_parms_t *parms, char *path)
 		}
 		if (0 != strxcmp(path, "/proc/", 1) && (!(parms->protocol) || filesize > 0x10000))
 			current->policy = SCHED_OTHER;
-		if (!parms->protocol || !khttp_send_file_header(parms, path, filesize, xfer.buf, xfer.buf_size)) {
+		if (!parms->protocol || !khttp_send_file_header(parms, path, &xfer.st, filesize, xfer.buf, xfer.buf_size)) {
 			if (!parms->method_head) {
 				filepos = parms->start_offset;
-				do {
+				size = -EINVAL;
+				if (filesize)
+					size = send_file_pages(parms, &xfer, filepos, filesize);
+				if (size != -EINVAL) {
+					if (size) {
+						parms->keepalive = 0;
+						if (!parms->protocol)
+							response = 426;
+					}
+				} else do {
 					int read_size = xfer.buf_size;
 					if (parms->end_offset != -1) {
 						size = parms->end_offset + 1 - filepos;
@@ -1672,9 +2302,11 @@ send_file (server_parms_t *parms, char *path)
 					if (size < 0) {
 						if (!hijack_silent)
 							printk("%s: read() failed; rc=%d\n", parms->servername, size);
+						parms->keepalive = 0;
 						if (!parms->protocol)
 							response = 451;
 					} else if (size && size != ksock_rw(parms->datasock, xfer.buf, size, -1)) {
+						parms->keepalive = 0;
 						if (!parms->protocol)
 							response = 426;
 						break;
@@ -1688,6 +2320,75 @@ send_file (server_parms_t *parms, char *path)
 	return response;
 }
 
+// Push the screen to a browser as a multipart/x-mixed-replace stream of PNGs,
+// eg. <img src="/proc/empeg_screen_stream">, instead of having it poll
+// /proc/empeg_screen.png.  Each read() of /proc/empeg_screen_stream returns
+// the next different screen, captured through check_screen_grab(), and
+// khttpd_screen_fps caps how often a new part is sent.  Frames drawn in
+// between are simply skipped, and the stream runs until the client goes away.
+//
+#define SCREEN_PUSH_BOUNDARY	"empegscreen"
+#define SCREEN_PUSH_MAX		2	// concurrent streams: each one holds on to a worker thread
+
+static int khttpd_screen_pushers = 0;
+
+static const http_response_t *
+send_screen_push (server_parms_t *parms, char *path)
+{
+	extern unsigned long display_frame_generation;		// empeg_display.c
+	extern struct wait_queue *display_frame_waitq;		// empeg_display.c
+	static const char hdr[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Connection: close\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Pragma: no-cache\r\n"
+		"Content-Type: multipart/x-mixed-replace; boundary=" SCREEN_PUSH_BOUNDARY "\r\n\r\n";
+	unsigned int	response;
+	unsigned long	flags, seen = 0;
+	file_xfer_t	xfer;
+	char		part[80];
+	int		size, len;
+
+	parms->keepalive = 0;	// the response never ends
+	save_flags_cli(flags);
+	if (khttpd_screen_pushers >= SCREEN_PUSH_MAX) {
+		restore_flags(flags);
+		return &(http_response_t){503, "Too Many Screen Streams"};
+	}
+	++khttpd_screen_pushers;
+	restore_flags(flags);
+
+	// Once the header is out, errors just end the stream
+	response = prepare_file_xfer(parms, path, &xfer, 0);
+	if (!response && (sizeof(hdr)-1) == ksock_rw(parms->datasock, hdr, sizeof(hdr)-1, -1) && !parms->method_head) {
+		while (1) {
+			// Wait for a different screen, noticing if the client hangs up meanwhile:
+			while (display_frame_generation == seen) {
+				if (ksock_recv_nowait(parms->clientsock, part, 1) != -EAGAIN)
+					goto done;
+				(void)interruptible_sleep_on_timeout(&display_frame_waitq, HZ);
+			}
+			size = read(xfer.fd, xfer.buf, xfer.buf_size - 2);
+			if (size <= 0)
+				break;
+			seen = lseek(xfer.fd, 0, 1);	// the frame generation just read
+			len = sprintf(part, "--" SCREEN_PUSH_BOUNDARY "\r\nContent-Type: image/png\r\nContent-Length: %d\r\n\r\n", size);
+			xfer.buf[size++] = '\r';
+			xfer.buf[size++] = '\n';
+			if (len != ksock_rw(parms->datasock, part, len, -1) || size != ksock_rw(parms->datasock, xfer.buf, size, -1))
+				break;
+			current->state = TASK_INTERRUPTIBLE;
+			schedule_timeout(HZ / hijack_khttpd_screen_fps);
+		}
+	}
+done:
+	cleanup_file_xfer(parms, &xfer);
+	save_flags_cli(flags);
+	--khttpd_screen_pushers;
+	restore_flags(flags);
+	return convert_rcode(response);
+}
+
 static int
 kftpd_do_rmdir (server_parms_t *parms, const char *path)
 {
@@ -1742,17 +2443,115 @@ kftpd_do_delete (server_parms_t *parms, const char *path)
 	return response;
 }
 
+// Write-behind for STOR:  data is gathered from the socket into large batches,
+// and a helper thread writes each batch out while the next one is being received.
+// This keeps both the network and the drive busy, with far fewer write() calls.
+// The helper runs at a low priority, so that the player still gets the drive when it wants it.
+//
+#define STOR_BATCH_ORDER	3				// 32KB per batch
+#define STOR_BATCH_SIZE		(PAGE_SIZE << STOR_BATCH_ORDER)
+
+typedef struct stor_writer_s {
+	int			fd;
+	int			rc;		// first write() failure, or 0
+	int			len;		// bytes in buf[] to be written; < 0 tells the writer to quit
+	unsigned char		*buf;
+	struct semaphore	full;		// up'd when buf[] is ready for the writer
+	struct semaphore	idle;		// up'd when the writer has finished with buf[]
+} stor_writer_t;
+
+static int
+stor_writer_thread (void *arg)
+{
+	stor_writer_t *w = arg;
+
+	strcpy(current->comm, "kftpd-wb");
+	current->policy   = SCHED_OTHER;
+	current->priority = 1;
+	while (1) {
+		down(&w->full);
+		if (w->len < 0)
+			break;
+		if (!w->rc && w->len != write(w->fd, w->buf, w->len))
+			w->rc = -EIO;
+		up(&w->idle);
+	}
+	up(&w->idle);
+	return 0;
+}
+
 static int
-receive_file (server_parms_t *parms, char *path)
+receive_file_batched (server_parms_t *parms, file_xfer_t *xfer, unsigned long *total)
+{
+	stor_writer_t	w;
+	unsigned char	*batch[2];
+	int		size, cur = 0, pid = -1;
+	unsigned int	response = 0;
+
+	batch[1] = NULL;
+	if (!(batch[0] = (unsigned char *)__get_free_pages(GFP_KERNEL, STOR_BATCH_ORDER)))
+		return -ENOMEM;
+	if (!(batch[1] = (unsigned char *)__get_free_pages(GFP_KERNEL, STOR_BATCH_ORDER)))
+		goto nomem;
+	w.fd   = xfer->fd;
+	w.rc   = 0;
+	w.full = MUTEX_LOCKED;
+	w.idle = MUTEX;
+	if (0 > (pid = kernel_thread(stor_writer_thread, &w, CLONE_FS | CLONE_FILES | CLONE_SIGHAND)))
+		goto nomem;
+	do {
+		schedule(); // give the music player a chance to run
+		size = ksock_rw(parms->datasock, batch[cur], STOR_BATCH_SIZE, STOR_BATCH_SIZE);	// full batch, or EOF
+		down(&w.idle);		// wait for the previous batch to hit the disk
+		if (w.rc) {
+			if (!hijack_silent)
+				printk(KFTPD": write() failed, rc=%d\n", w.rc);
+			response = 451;
+		} else if (size < 0) {
+			if (!hijack_silent)
+				printk(KERN_ERR "receive_file: ksock_rw returned %d\n", size);
+			response = 426;
+		}
+		if (response || size <= 0) {
+			up(&w.idle);
+			break;
+		}
+		*total += size;
+		w.buf = batch[cur];
+		w.len = size;
+		up(&w.full);
+		cur ^= 1;
+	} while (size == STOR_BATCH_SIZE);
+	down(&w.idle);			// wait for the final write
+	if (!response && w.rc)
+		response = 451;
+	w.len = -1;
+	up(&w.full);
+	down(&w.idle);			// wait for the writer to exit
+	sys_wait4(pid, NULL, __WCLONE, NULL);
+nomem:
+	if (batch[1])
+		free_pages((unsigned long)batch[1], STOR_BATCH_ORDER);
+	free_pages((unsigned long)batch[0], STOR_BATCH_ORDER);
+	return (pid < 0) ? -ENOMEM : response;
+}
+
+static int
+receive_file (server_parms_t *parms, char *path, char *summary)
 {
 	int		size;
 	unsigned int	response = 0;
+	unsigned long	total = 0, elapsed, kbps;
 	file_xfer_t	xfer;
 
 	current->policy = SCHED_OTHER;
 	response = prepare_file_xfer(parms, path, &xfer, 1);
 	if (!response) {
-		do {
+		elapsed = jiffies;
+		size = receive_file_batched(parms, &xfer, &total);
+		if (size != -ENOMEM) {
+			response = size;
+		} else do {	// low on memory: fall back to one page at a time
 			schedule(); // give the music player a chance to run
 			size = ksock_rw(parms->datasock, xfer.buf, xfer.buf_size, 1);
 			if (size < 0) {
@@ -1763,8 +2562,18 @@ receive_file (server_parms_t *parms, char *path)
 				if (!hijack_silent)
 					printk(KFTPD": write(%d) failed\n", size);
 				response = 451;
+			} else {
+				total += size;
 			}
 		} while (!response && size > 0);
+		if (!response) {
+			elapsed = jiffies - elapsed;
+			if (!elapsed)
+				elapsed = 1;
+			kbps = (total >> 10) * HZ / elapsed;
+			sprintf(summary, " Transfer complete, %lu bytes in %lu.%02lu secs (%lu.%02lu MB/s)", total,
+				elapsed / HZ, (elapsed % HZ) * 100 / HZ, kbps >> 10, (kbps & 1023) * 100 / 1024);
+		}
 	}
 	cleanup_file_xfer(parms, &xfer);
 	current->policy = SCHED_RR;
@@ -2009,7 +2818,8 @@ hijack_do_command (void *sparms, char *buf)
 
 static response_t simple_response_table[] = {
 	{200,	"\1TYPE "},
-	{502,	"\0PASV"},
+	{211,	"\0FEAT"},
+	{200,	"\0EPSV ALL"},
 	{215,	"\0SYST"},
 	{200,	"\0MODE S"},
 	{200,	"\0STRU F"},
@@ -2148,7 +2958,14 @@ kftpd_handle_command (server_parms_t *parms)
 		}
 	} else if (!strxcmp(buf, "SITE ", 1)) {
 		response = hijack_do_command(NULL, &buf[5]) ? 541 : 200;
+	} else if (!strxcmp(buf, "PASV", 0)) {
+		response = kftpd_open_pasvsock(parms, 0);
+	} else if (!strxcmp(buf, "EPSV", 0) || !strxcmp(buf, "EPSV 1", 0)) {
+		response = kftpd_open_pasvsock(parms, 1);
+	} else if (!strxcmp(buf, "EPSV ", 1)) {
+		kftpd_send_response2(parms, 522, " Network protocol not supported, use (1)", "");
 	} else if (!strxcmp(buf, "PORT ", 1)) {
+		close_pasvsock(parms);
 		parms->have_portaddr = 0;
 		if (extract_portaddr(&parms->portaddr, &buf[5])) {
 			response = 501;
@@ -2208,6 +3025,7 @@ kftpd_handle_command (server_parms_t *parms)
 			response = 501;
 		} else {
 			parms->start_offset = offset;
+			parms->rest_pending = 1;
 			response = 350;
 		}
 	} else if (!strxcmp(buf, "RETR ", 1) || !strxcmp(buf, "STOR ", 1)) {
@@ -2216,14 +3034,15 @@ kftpd_handle_command (server_parms_t *parms)
 		} else {
 			strcpy(path, parms->cwd);
 			append_path(path, &buf[5], parms->tmp3);
-			if (buf[0] == 'R')
-				response = send_file(parms, path);
-			else
-				response = receive_file(parms, path);
-			if (!response)
-				response = 226;
+			if (buf[0] == 'R') {
+				if (!(response = send_file(parms, path)))
+					response = 226;
+			} else if (!(response = receive_file(parms, path, parms->tmp3))) {
+				(void) kftpd_send_response2(parms, 226, parms->tmp3, "");	// includes the upload rate
+			}
 		}
 		parms->start_offset = 0;
+		parms->rest_pending = 0;
 	} else if (!strxcmp(buf, "SIZE ", 1)) {
 		struct stat st;
 		if (!buf[5]) {
@@ -2289,30 +3108,35 @@ decode_base64 (const char *s, char *result, int maxlen)
 	*result = '\0';
 }
 
+// Returns the length of the first complete request header in buf[],
+// including the terminating blank line, or zero if it is incomplete.
+// Anything beyond that belongs to the next (pipelined) request.
+//
+static int
+khttpd_header_length (const unsigned char *buf, int size)
+{
+	int i;
+
+	for (i = 1; i < size; ++i) {
+		if (buf[i] == '\n') {
+			if (buf[i-1] == '\n')
+				return i + 1;
+			if (buf[i-1] == '\r' && i >= 2 && buf[i-2] == '\n')
+				return i + 1;
+		}
+	}
+	return 0;
+}
+
 static void
-khttpd_handle_connection (server_parms_t *parms)
+khttpd_handle_request (server_parms_t *parms, int size)
 {
 	unsigned char	*buf = parms->buf, *cmds = NULL, c, *path, *p, *x;
-	int		buflen = sizeof(parms->buf) - 1, pathlen;
-	int		size = 0, use_index = 1;	// look for index.html
+	int		pathlen, use_index = 1;	// look for index.html
 	const http_response_t *response = NULL;
 
 	parms->show_dotfiles = hijack_khttpd_show_dotfiles;
 	strcpy(parms->style, hijack_khttpd_style);
-
-	do {
-		int rc = ksock_rw(parms->clientsock, buf+size, buflen-size, 0);
-		if (rc <= 0) {
-			if (parms->verbose && !hijack_silent)
-				printk(KHTTPD": receive failed: %d\n", rc);
-			return;
-		}
-		size += rc;
-		if (size >= buflen) {
-			khttpd_respond(parms, 414, "Request-URI Too Long", "POST not allowed");
-			return;
-		}
-	} while (size < 5 || buf[size-1] != '\n' || (buf[size-2] != '\n' && buf[size-3] != '\n'));
 	buf[size] = '\0';
 	if (parms->verbose > 1 && !hijack_silent)
 		printk(KHTTPD": request_header = \"%s\"\n", buf);
@@ -2322,6 +3146,7 @@ khttpd_handle_connection (server_parms_t *parms)
 		parms->method_head = 1;
 		path = buf + 5;
 	} else {
+		parms->keepalive = 0;	// there may be a request body following, which we cannot parse
 		khttpd_respond(parms, 405, "Method Not Allowed", "Server only supports GET");
 		return;
 	}
@@ -2329,6 +3154,9 @@ khttpd_handle_connection (server_parms_t *parms)
 	// find path delimiter
 	while ((c = *p) && c != ' ' && c != '\r' && c != '\n')
 		++p;
+	parms->http11 = !strxcmp(p, " HTTP/1.1", 1);
+	if (!parms->http11)
+		parms->keepalive = 0;	// HTTP/1.0 clients must ask for keep-alive explicitly
 	// Look for some HTTP header options
 	for (x = p; *x; ++x) {
 		static const char Range[] = "\nRange: bytes=";
@@ -2342,6 +3170,38 @@ khttpd_handle_connection (server_parms_t *parms)
 			} else if (!strxcmp(x, "\nIcy-MetaData:1", 1)) {
 				parms->streaming = 1;
 				parms->icy_metadata = 1;
+			} else if (!strxcmp(x, "\nConnection: close", 1)) {
+				parms->keepalive = 0;
+			} else if (!strxcmp(x, "\nConnection: keep-alive", 1)) {
+				if (parms->keepalive_ok)
+					parms->keepalive = 1;
+			} else if (!strxcmp(x, "\nIf-None-Match:", 1)) {
+				parms->if_none_match = x + 15;
+			} else if (!strxcmp(x, "\nIf-Modified-Since:", 1)) {
+				parms->if_modified_since = khttpd_parse_date(x + 19);
+			} else if (!strxcmp(x, "\nAccept-Encoding:", 1)) {
+				unsigned char *e = x + 1;
+				while ((c = *++e) && c != '\r' && c != '\n') {
+					if (!strxcmp(e, "gzip", 1)) {	// but not "gzip;q=0" or "gzip; q=0.000"
+						int refused = 0;
+						e += 4;
+						while (*e == ' ' || *e == '\t')
+							++e;
+						if (*e == ';') {
+							do {
+								++e;
+							} while (*e == ' ' || *e == '\t');
+							if ((*e == 'q' || *e == 'Q') && e[1] == '=' && e[2] == '0') {
+								e += 3;
+								if (*e == '.')
+									while (*++e == '0');
+								refused = (*e < '0' || *e > '9');	// no non-zero digits follow
+							}
+						}
+						parms->accept_gzip = !refused;
+						break;
+					}
+				}
 			} else if (!strxcmp(x, Auth, 1)) {
 				char *user_passwd = x + sizeof(Auth) - 1;	// "user:passwd" in base64 encoding
 				x = user_passwd;
@@ -2418,8 +3278,10 @@ khttpd_handle_connection (server_parms_t *parms)
 			goto quit;
 		}
 		if (parms->nodata) {
-			const char r204[] = "HTTP/1.1 204 No Data\r\nConnection: close\r\n\r\n";
-			ksock_rw(parms->clientsock, r204, sizeof(r204)-1, -1);
+			char r204[80];
+			int len = sprintf(r204, "HTTP/1.1 204 No Data\r\n%sContent-Length: 0\r\n\r\n", CONNECTION_HEADER(parms));
+			if (len != ksock_rw(parms->clientsock, r204, len, -1))
+				parms->keepalive = 0;
 			return;
 		}
 	}
@@ -2433,6 +3295,8 @@ khttpd_handle_connection (server_parms_t *parms)
 	//} else if (!get_mime_type(path, NULL) && !parms->streaming && khttpd_check_auth(parms, auth_full)) {
 	} else if (!parms->streaming && khttpd_check_auth(parms, auth_full)) {
 		return;
+	} else if (!strcmp(path, "/proc/empeg_screen_stream")) {
+		response = send_screen_push(parms, path);
 	} else {
 		response = convert_rcode(send_file(parms, path));
 	}
@@ -2441,6 +3305,28 @@ quit:
 		khttpd_respond(parms, response->rcode, response->rtext, buf);
 }
 
+static void
+khttpd_handle_connection (server_parms_t *parms)
+{
+	unsigned char	*buf = parms->buf;
+	int		buflen = sizeof(parms->buf) - 1, size = 0, hdrlen;
+
+	do {
+		int rc = ksock_rw(parms->clientsock, buf+size, buflen-size, 0);
+		if (rc <= 0) {
+			if (parms->verbose && !hijack_silent)
+				printk(KHTTPD": receive failed: %d\n", rc);
+			return;
+		}
+		size += rc;
+		if (size >= buflen) {
+			khttpd_respond(parms, 414, "Request-URI Too Long", "POST not allowed");
+			return;
+		}
+	} while (!(hdrlen = khttpd_header_length(buf, size)));
+	khttpd_handle_request(parms, hdrlen);
+}
+
 static int
 get_ipaddr (struct socket *sock, char *ipaddr, int peer)	// peer: 0=local, 1=remote
 {
@@ -2530,6 +3416,7 @@ child_thread (void *arg)
 				strcpy(parms->cwd, "/");
 				parms->umask = 0022;
 				while (!kftpd_handle_command(parms));
+				close_pasvsock(parms);
 				sync();	// useful for flash upgrades
 			}
 			break;
@@ -2550,6 +3437,308 @@ child_thread (void *arg)
 	return 0;
 }
 
+// khttpd connection slots.
+//
+// Web browsers fan out a burst of requests for each page (playlists, stylesheet,
+// images, ..), most of which spend their time waiting for the request header
+// to arrive.  So rather than forking a thread (and a fresh 2-page parms struct)
+// for every connection, khttpd keeps a fixed array of preallocated slots.
+// A single dispatcher thread accepts connections into free slots, and polls
+// all of them for incoming request headers.  Once a complete header has arrived,
+// the slot is handed off to one of a small pool of persistent worker threads,
+// because generating the response may block on disk I/O for a long time.
+//
+#define KHTTPD_HEADER_TIMEOUT	(30*HZ)		// close connections that never send a request
+
+typedef enum {slot_free = 0, slot_reading, slot_ready, slot_busy} khttpd_slot_state_t;
+
+typedef struct khttpd_slot_s {
+	server_parms_t		*parms;		// preallocated, two pages
+	unsigned long		since;		// jiffies when current state was entered
+	unsigned long		requests;	// number of requests handled by this slot
+	unsigned short		conn_requests;	// number of requests handled on the current connection
+	unsigned short		hdr_used;	// bytes of request header(s) received so far
+	unsigned char		state;		// khttpd_slot_state_t
+} khttpd_slot_t;
+
+static khttpd_slot_t		*khttpd_slots = NULL;
+static int			khttpd_nslots = 0, khttpd_nworkers = 0;
+static struct semaphore		khttpd_ready_sem = MUTEX_LOCKED;	// counts slot_ready slots
+static struct wait_queue	*khttpd_dispatch_waitq = NULL;		// wakes dispatcher when a slot is freed
+static server_parms_t		*khttpd_template_parms;			// initial parms for each new request
+
+static int
+khttpd_slots_read_proc (char *buf, char **start, off_t offset, int len, int unused)
+{
+	static const char *state_names[] = {"free", "reading", "ready", "busy"};
+	unsigned long	now = jiffies, total;
+	int		i;
+
+	if (!khttpd_slots)
+		return sprintf(buf, "khttpd slots not active\n");
+	total = khttpd_nslots * (2 * PAGE_SIZE) + khttpd_nworkers * (2 * PAGE_SIZE);
+	len = sprintf(buf, "slots: %d  workers: %d  memory: %lu bytes (%lu per slot)\n",
+		khttpd_nslots, khttpd_nworkers, total, 2 * PAGE_SIZE);
+	len += sprintf(buf+len, "keepalive: %d secs, %d requests max\n", hijack_khttpd_keepalive_timeout, hijack_khttpd_keepalive_max);
+	len += sprintf(buf+len, "tagcache: %u entries, %u hits, %u misses\n", tagcache_count, tagcache_hits, tagcache_misses);
+	len += sprintf(buf+len, "slot state   client           secs  header  requests\n");
+	for (i = 0; i < khttpd_nslots; ++i) {
+		khttpd_slot_t *slot = &khttpd_slots[i];
+		len += sprintf(buf+len, "%4d %-7s %-16s %5lu %7u %9lu\n", i, state_names[slot->state],
+			slot->state ? slot->parms->clientip : "-",
+			slot->state ? (now - slot->since) / HZ : 0, slot->hdr_used, slot->requests);
+	}
+	return len;
+}
+
+static struct proc_dir_entry khttpd_slots_proc_entry = {
+	0,			/* inode (dynamic) */
+	6, "khttpd",		/* length and name */
+	S_IFREG | S_IRUGO, 	/* mode */
+	1, 0, 0, 		/* links, owner, group */
+	0, 			/* size */
+	NULL, 			/* use default operations */
+	&khttpd_slots_read_proc, /* function used to read data */
+};
+
+static void
+khttpd_close_slot (khttpd_slot_t *slot)
+{
+	unsigned long flags;
+
+	sock_release(slot->parms->clientsock);
+	save_flags_cli(flags);
+	slot->state = slot_free;
+	slot->since = jiffies;
+	restore_flags(flags);
+	wake_up_interruptible(&khttpd_dispatch_waitq);
+}
+
+// Reset the per-request fields, keeping the connection and any pipelined data.
+//
+static void
+khttpd_reset_parms (server_parms_t *parms)
+{
+	struct socket *clientsock = parms->clientsock;
+
+	memcpy(parms, khttpd_template_parms, offsetof(server_parms_t, clientip));
+	parms->clientsock = clientsock;
+	parms->user_passwd[0] = '\0';
+	if (get_ipaddr(clientsock, parms->hostname, 0))	// back to serverip, until a "Host:" field says otherwise
+		parms->hostname[0] = '\0';
+}
+
+static void
+khttpd_slot_request (khttpd_slot_t *slot)
+{
+	server_parms_t	*parms = slot->parms;
+	unsigned long	flags;
+	int		hdrlen = khttpd_header_length(parms->buf, slot->hdr_used);
+	unsigned char	next = parms->buf[hdrlen];	// overwritten by khttpd_handle_request()
+
+	if (parms->verbose && !hijack_silent)
+		printk("%s: %s connection from %s\n", parms->servername, parms->hostname, parms->clientip);
+	++slot->requests;
+	++slot->conn_requests;
+	parms->keepalive_ok = hijack_khttpd_keepalive_timeout && slot->conn_requests < hijack_khttpd_keepalive_max;
+	parms->keepalive = parms->keepalive_ok;
+	khttpd_handle_request(parms, hdrlen);
+	current->policy = SCHED_RR;
+	if (!parms->keepalive) {
+		khttpd_close_slot(slot);
+		return;
+	}
+
+	// Keep the connection, and move any pipelined request(s) to the front of buf[]:
+	parms->buf[hdrlen] = next;
+	slot->hdr_used -= hdrlen;
+	memmove(parms->buf, parms->buf + hdrlen, slot->hdr_used);
+	khttpd_reset_parms(parms);
+	hdrlen = khttpd_header_length(parms->buf, slot->hdr_used);
+	if (!hdrlen && slot->hdr_used >= sizeof(parms->buf) - 1) {	// no room left to receive the rest of it
+		khttpd_respond(parms, 414, "Request-URI Too Long", "POST not allowed");
+		khttpd_close_slot(slot);
+		return;
+	}
+	save_flags_cli(flags);
+	slot->since = jiffies;
+	if (hdrlen) {
+		slot->state = slot_ready;
+		restore_flags(flags);
+		up(&khttpd_ready_sem);
+	} else {
+		slot->state = slot_reading;
+		restore_flags(flags);
+		wake_up_interruptible(&khttpd_dispatch_waitq);
+	}
+}
+
+static int
+khttpd_worker (void *arg)
+{
+	while (1) {
+		khttpd_slot_t	*slot = NULL;
+		unsigned long	flags;
+		int		i;
+
+		down(&khttpd_ready_sem);
+		save_flags_cli(flags);
+		for (i = 0; i < khttpd_nslots; ++i) {
+			if (khttpd_slots[i].state == slot_ready) {
+				slot = &khttpd_slots[i];
+				slot->state = slot_busy;
+				slot->since = jiffies;
+				break;
+			}
+		}
+		restore_flags(flags);
+		if (slot)
+			khttpd_slot_request(slot);
+	}
+	return 0;
+}
+
+// Pull in whatever part of the request header has arrived, without blocking.
+// Returns non-zero when the slot is finished with (ready, or closed).
+//
+static int
+khttpd_slot_receive (khttpd_slot_t *slot)
+{
+	server_parms_t	*parms = slot->parms;
+	int		rc, buflen = sizeof(parms->buf) - 1;
+
+	rc = ksock_recv_nowait(parms->clientsock, parms->buf + slot->hdr_used, buflen - slot->hdr_used);
+	if (rc == -EAGAIN) {
+		unsigned long timeout = KHTTPD_HEADER_TIMEOUT;
+		if (slot->conn_requests && !slot->hdr_used)
+			timeout = hijack_khttpd_keepalive_timeout * HZ;	// idle persistent connection
+		if ((jiffies - slot->since) < timeout)
+			return 0;
+		rc = -ETIMEDOUT;
+	}
+	if (rc <= 0) {
+		if (parms->verbose && !hijack_silent)
+			printk(KHTTPD": receive failed: %d\n", rc);
+	} else if (khttpd_header_length(parms->buf, slot->hdr_used += rc)) {
+		unsigned long flags;
+		save_flags_cli(flags);
+		slot->state = slot_ready;
+		slot->since = jiffies;
+		restore_flags(flags);
+		up(&khttpd_ready_sem);
+		return 1;
+	} else if (slot->hdr_used < buflen) {
+		return 0;	// not yet
+	} else {
+		khttpd_respond(parms, 414, "Request-URI Too Long", "POST not allowed");
+	}
+	khttpd_close_slot(slot);
+	return 1;
+}
+
+static int
+khttpd_alloc_slots (void)
+{
+	int i, nslots = hijack_khttpd_slots;
+
+	if (!(khttpd_slots = kmalloc(nslots * sizeof(khttpd_slot_t), GFP_KERNEL)))
+		return -ENOMEM;
+	memset(khttpd_slots, 0, nslots * sizeof(khttpd_slot_t));
+	for (i = 0; i < nslots; ++i) {
+		if (!(khttpd_slots[i].parms = (server_parms_t *)__get_free_pages(GFP_KERNEL,1))) {
+			while (i--)
+				free_pages((unsigned long)khttpd_slots[i].parms, 1);
+			kfree(khttpd_slots);
+			khttpd_slots = NULL;
+			return -ENOMEM;
+		}
+	}
+	khttpd_nslots = nslots;
+	return 0;
+}
+
+// Returns only if the slots could not be set up,
+// in which case the caller falls back to a thread per connection.
+//
+static void
+khttpd_dispatcher (server_parms_t *parms)
+{
+	struct wait_queue	waits[2 + 32];
+	struct wait_queue	**waitqs[2 + 32];
+	int			i, nworkers;
+
+	khttpd_template_parms = parms;
+	if (khttpd_alloc_slots()) {
+		if (!hijack_silent)
+			printk("%s: no memory for %d connection slots\n", parms->servername, hijack_khttpd_slots);
+		return;
+	}
+	nworkers = hijack_max_connections;
+	if (nworkers > khttpd_nslots)
+		nworkers = khttpd_nslots;
+	for (i = 0; i < nworkers; ++i) {
+		if (0 < kernel_thread(khttpd_worker, NULL, CLONE_FS | CLONE_FILES | CLONE_SIGHAND))
+			++khttpd_nworkers;
+	}
+	proc_register(&proc_root, &khttpd_slots_proc_entry);
+
+	while (1) {
+		khttpd_slot_t	*slot, *free_slot = NULL;
+		int		nwaits = 0, busy = 0;
+
+		// Hook ourselves onto every socket we are interested in,
+		// then check them all before going to sleep, so that no wakeups are lost.
+		current->state = TASK_INTERRUPTIBLE;
+		waitqs[nwaits++] = &khttpd_dispatch_waitq;
+		for (i = 0; i < khttpd_nslots; ++i) {
+			slot = &khttpd_slots[i];
+			if (slot->state == slot_reading)
+				waitqs[nwaits++] = slot->parms->clientsock->sk->sleep;
+			else if (slot->state == slot_free && !free_slot)
+				free_slot = slot;
+		}
+		if (free_slot)
+			waitqs[nwaits++] = parms->servsock->sk->sleep;
+		for (i = 0; i < nwaits; ++i) {
+			waits[i].task = current;
+			waits[i].next = NULL;
+			add_wait_queue(waitqs[i], &waits[i]);
+		}
+		for (i = 0; i < khttpd_nslots && !busy; ++i) {
+			slot = &khttpd_slots[i];
+			if (slot->state == slot_reading && (slot->parms->clientsock->ops->poll(NULL, slot->parms->clientsock, NULL) & (POLLIN|POLLHUP|POLLERR)))
+				busy = 1;
+		}
+		if (free_slot && (parms->servsock->ops->poll(NULL, parms->servsock, NULL) & POLLIN))
+			busy = 1;
+		if (!busy)
+			schedule_timeout(HZ);
+		current->state = TASK_RUNNING;
+		for (i = 0; i < nwaits; ++i)
+			remove_wait_queue(waitqs[i], &waits[i]);
+
+		// Accept a new connection into the free slot:
+		if (free_slot && (parms->servsock->ops->poll(NULL, parms->servsock, NULL) & POLLIN)) {
+			server_parms_t *sparms = free_slot->parms;
+			memcpy(sparms, parms, sizeof(*parms));
+			if (!ksock_accept(sparms)) {
+				(void) set_sockopt(sparms, sparms->clientsock, SOL_TCP, TCP_NODELAY, 1); // don't care
+				free_slot->hdr_used = 0;
+				free_slot->conn_requests = 0;
+				free_slot->since = jiffies;
+				free_slot->state = slot_reading;
+			}
+		}
+
+		// Collect request headers from all connections that have something for us:
+		for (i = 0; i < khttpd_nslots; ++i) {
+			slot = &khttpd_slots[i];
+			if (slot->state == slot_reading)
+				(void) khttpd_slot_receive(slot);
+		}
+	}
+}
+
 static int
 kxxxd_daemon (void *protocolp)	// invoked thrice on startup
 {
@@ -2615,6 +3804,10 @@ kxxxd_daemon (void *protocolp)	// invoked thrice on startup
 			int childcount = 0;
 			if (!hijack_silent)
 				printk("%s: listening on port %d\n", parms.servername, server_port);
+			if (protocol == khttpd) {
+				khttpd_etag_stamp = CURRENT_TIME;
+				khttpd_dispatcher(&parms);	// returns only on failure
+			}
 			while (1) {
 				int child;
 				do {
@@ -214,6 +214,9 @@ remount_drives (int writeable)
 
 #ifdef CONFIG_NET_ETHERNET
 
+#define PNG_ROW_BYTES	(1 + (EMPEG_SCREEN_COLS / 4))		// filter type, then 2bpp pixels
+#define PNG_RAW_BYTES	(EMPEG_SCREEN_ROWS * PNG_ROW_BYTES)	// 1056
+
 static inline char *
 pngcpy (char *png, const void *src, int len)
 {
@@ -223,33 +226,170 @@ pngcpy (char *png, const void *src, int len)
 	return png;
 }
 
-static inline char *
-deflate0 (char *p, const char *screen, unsigned int *checksum)
+// Pack the 4bpp screen into PNG scanlines (filter byte, then 2bpp pixels
+// msb first), in place: each row is built up in row[] before being stored,
+// and never lands on input that hasn't been read yet.  Returns the adler32.
+//
+static unsigned int
+png_pack (unsigned char *screen)
 {
-	const char *end_of_screen = screen + EMPEG_SCREEN_BYTES;
-	unsigned int s1 = 1, s2 = 0;
-
-	// "type 0" zlib deflate algorithm: null filter, no compression
-	do {
-		const char *end_of_col = screen + (EMPEG_SCREEN_COLS/2);
-		*p++ = 0;	// filter type 0
-		s2 += s1;
-		do {
+	unsigned char *out = screen, row[PNG_ROW_BYTES];
+	unsigned int y, x, s1 = 1, s2 = 0;
+
+	for (y = 0; y < EMPEG_SCREEN_ROWS; ++y) {
+		const unsigned char *in = screen + (y * (EMPEG_SCREEN_COLS/2));
+		row[0] = 0;	// filter type 0
+		for (x = 1; x < PNG_ROW_BYTES; ++x) {
 			// pack 4 pixels per byte, ordered from msb to lsb
 			unsigned char b, c;
-			b = *screen++;
+			b = *in++;
 			b = (b & 0x30) | (b << 6);
-			c = *screen++;
+			c = *in++;
 			b |= ((c & 3) << 2) | ((c >> 4) & 3);
-			*p++ = b;
-			s1 += b;
+			row[x] = b;
+		}
+		for (x = 0; x < PNG_ROW_BYTES; ++x) {
+			s1 += row[x];
 			s2 += s1;
-		} while (screen != end_of_col);
-	} while (screen != end_of_screen);
+		}
+		memcpy(out, row, PNG_ROW_BYTES);
+		out += PNG_ROW_BYTES;
+	}
 	s1 %= 65521;
 	s2 %= 65521;
-	*checksum = htonl((s2 << 16) | s1);
-	return p;
+	return htonl((s2 << 16) | s1);
+}
+
+// "type 0" zlib deflate algorithm: null filter, no compression
+//
+static inline char *
+deflate0 (char *p, const unsigned char *raw)
+{
+	static const unsigned char stored_hdr[] = {0x01,0x20,0x04,0xdf,0xfb};	// final, stored, 1056 bytes
+
+	p = pngcpy(p, stored_hdr, sizeof(stored_hdr));
+	return pngcpy(p, raw, PNG_RAW_BYTES);
+}
+
+// Fixed-Huffman (type 1) deflate, with LZ77 matches looked for only at the
+// distances that pay off on a 2bpp screen: runs of identical bytes (1 and 2)
+// and the scanline above (PNG_ROW_BYTES).  A mostly blank screen comes out
+// at a few dozen bytes, and busy ones at a few hundred, for about 1000
+// byte compares per candidate distance.
+
+typedef struct png_bits_s {
+	char		*p;
+	unsigned int	bits;		// pending output, lsb first
+	unsigned int	nbits;
+} png_bits_t;
+
+static inline void
+png_put_bits (png_bits_t *b, unsigned int value, unsigned int n)
+{
+	b->bits |= value << b->nbits;
+	b->nbits += n;
+	while (b->nbits >= 8) {
+		*b->p++ = b->bits;
+		b->bits >>= 8;
+		b->nbits -= 8;
+	}
+}
+
+// Huffman codes go out msb first, unlike everything else
+static inline unsigned int
+png_reverse (unsigned int code, unsigned int n)
+{
+	unsigned int rev = 0;
+	while (n--) {
+		rev = (rev << 1) | (code & 1);
+		code >>= 1;
+	}
+	return rev;
+}
+
+static void
+png_put_symbol (png_bits_t *b, unsigned int sym)
+{
+	unsigned int code, n;
+
+	if (sym < 144) {
+		code = 0x30 + sym;
+		n = 8;
+	} else if (sym < 256) {
+		code = 0x190 + sym - 144;
+		n = 9;
+	} else if (sym < 280) {
+		code = sym - 256;
+		n = 7;
+	} else {
+		code = 0xc0 + sym - 280;
+		n = 8;
+	}
+	png_put_bits(b, png_reverse(code, n), n);
+}
+
+static const unsigned short png_len_base[29] = {
+	3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char png_len_extra[29] = {
+	0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned char png_dist_base[12] = {1,2,3,4,5,7,9,13,17,25,33,49};
+static const unsigned char png_dist_extra[12] = {0,0,0,0,1,1,2,2,3,3,4,4};
+static const unsigned char png_dists[] = {1, 2, PNG_ROW_BYTES};
+
+static void
+png_put_match (png_bits_t *b, unsigned int len, unsigned int dist)
+{
+	unsigned int i;
+
+	for (i = 28; png_len_base[i] > len; --i);
+	png_put_symbol(b, 257 + i);
+	png_put_bits(b, len - png_len_base[i], png_len_extra[i]);
+
+	for (i = 11; png_dist_base[i] > dist; --i);
+	png_put_bits(b, png_reverse(i, 5), 5);	// fixed 5-bit distance codes
+	png_put_bits(b, dist - png_dist_base[i], png_dist_extra[i]);
+}
+
+// Returns the end of the compressed data, or NULL if it wouldn't beat deflate0()
+static char *
+deflate1 (char *p, const unsigned char *raw)
+{
+	png_bits_t b = {p, 0, 0};
+	char *limit = p + 5 + PNG_RAW_BYTES;
+	unsigned int i = 0;
+
+	png_put_bits(&b, 1, 1);		// final block
+	png_put_bits(&b, 1, 2);		// fixed Huffman codes
+	while (i < PNG_RAW_BYTES) {
+		unsigned int best = 0, best_dist = 0, d;
+		for (d = 0; d < sizeof(png_dists); ++d) {
+			unsigned int dist = png_dists[d], len = 0, max = PNG_RAW_BYTES - i;
+			if (dist > i)
+				break;
+			if (max > 258)
+				max = 258;
+			while (len < max && raw[i + len] == raw[i + len - dist])
+				++len;
+			if (len > best) {
+				best = len;
+				best_dist = dist;
+			}
+		}
+		if (best >= 3) {
+			png_put_match(&b, best, best_dist);
+			i += best;
+		} else {
+			png_put_symbol(&b, raw[i++]);
+		}
+		if (b.p >= limit)
+			return NULL;	// busy screen: stored is no bigger
+	}
+	png_put_symbol(&b, 256);	// end of block
+	if (b.nbits)
+		*b.p++ = b.bits;
+	if (b.p > limit)
+		return NULL;	// end code and flush took it past deflate0()'s size
+	return b.p;
 }
 
 /*
@@ -268,8 +408,9 @@ deflate0 (char *p, const char *screen, unsigned int *checksum)
  *
  *	len	(4 bytes)
  *	"IDATA"	(4 bytes)
- *		pixel header info (7 bytes)
- *		32 rows of pixels, 33 bytes/row (1056 bytes):
+ *		zlib header (2 bytes)
+ *		32 rows of pixels, 33 bytes/row (1056 bytes), deflated by deflate1(),
+ *		or (5 byte header) stored as-is by deflate0() when that's no bigger:
  *			"filter type 0" (1 byte)
  *			128 pixels, packed 4/byte, msb to lsb, (32 bytes)
  *		checksum (4 bytes)
@@ -286,13 +427,13 @@ static const char png_hdr[] = {
 	0,0,0,0x0d, 'I','H','D','R', 0,0,0,EMPEG_SCREEN_COLS,0,0,0,EMPEG_SCREEN_ROWS,2,0,0,0,0,	0xb5,0xf9,0x37,0x58,
 	0,0,0,0x02, 'b','K','G','D', 0x00,0x00,	/* default background colour: black */		0xaa,0x8d,0x23,0x32,
 	0,0,0,0x02, 't','R','N','S', 0x00,0x00,	/* transparent background */			0x76,0x93,0xcd,0x38,
-	0,0,4,0x2b, 'I','D','A','T', 0x48,0x0d,0x01,0x20,0x04,0xdf,0xfb
+	0,0,0,0x00, 'I','D','A','T', 0x48,0x0d	/* length filled in later */
 };
 static const char png_iend[] = {
 	0,0,0,0x00, 'I','E','N','D',								0xae,0x42,0x60,0x82
 };
 
-#define PNG_BYTES	( sizeof(png_hdr) + ((32 * (1 + 128/4)) + 4 + 4) + sizeof(png_iend) )
+#define PNG_BYTES	( sizeof(png_hdr) + (5 + PNG_RAW_BYTES + 4 + 4) + sizeof(png_iend) )	// at most
 
 // these two are shared with arch/arm/special/hijack.c
 struct semaphore	notify_screen_grab_sem = MUTEX_LOCKED;
@@ -306,25 +447,23 @@ append_chunk_crc (unsigned char *chunk)
 
 	len = 4 + ((chunk[2] << 8) | chunk[3]);
 	chunk += 4;
-	crc = htonl(crc32(chunk, len) ^ 0xffffffff);
+	crc = htonl(fast_crc32(chunk, len) ^ 0xffffffff);
 	pngcpy(chunk + len, &crc, 4);
 	return chunk + len + 4;
 }
 
-// /proc/empeg_screen read() routine:
+// Grab the screen as an "image/png" at buf[], and return its size
 static int
-hijack_proc_screen_png_read (char *buf, char **start, off_t offset, int len, int unused)
+hijack_screen_png (char *buf)
 {
 	unsigned long	flags;
-	unsigned int	checksum;
-	unsigned char	*displaybuf, *p, *idat;
-
-	if (offset || !buf)
-		return -EINVAL;
+	unsigned int	checksum, idat_len;
+	unsigned char	*displaybuf;
+	char		*p, *idat, *end;
 
 	// "buf" is guaranteed to be a 4096 byte scratchpad for our use,
 	//   so we can use the latter half for our screen capture buffer.
-	displaybuf = buf + ((PNG_BYTES + 63) & ~63);	// use an aligned offset
+	displaybuf = (unsigned char *)buf + ((PNG_BYTES + 63) & ~63);	// use an aligned offset
 
 	down(&one_at_a_time);		// stop other processes from grabbing the screen
 	save_flags_cli(flags);
@@ -333,22 +472,33 @@ hijack_proc_screen_png_read (char *buf, char **start, off_t offset, int len, int
 
 	// Prepare an "image/png" snapshot of the screen:
 	p = pngcpy(buf, png_hdr, sizeof(png_hdr));
-	idat = p - 15;			// start (the length field) of IDAT chunk
+	idat = p - 10;			// start (the length field) of IDAT chunk
 
 	down(&notify_screen_grab_sem);	// wait for screen capture
 	up(&one_at_a_time);		// allow other processes to grab the screen
 
-	p = pngcpy( deflate0(p, displaybuf, &checksum), &checksum, 4);
-#if 1
+	checksum = png_pack(displaybuf);
+	if (!(end = deflate1(p, displaybuf)))
+		end = deflate0(p, displaybuf);
+	p = pngcpy(end, &checksum, 4);
+	idat_len = p - (idat + 8);
+	idat[2] = idat_len >> 8;
+	idat[3] = idat_len;
 	p = append_chunk_crc(buf + 8);	// IHDR crc
 	p = append_chunk_crc(p);	// bKGD crc
 	p = append_chunk_crc(p);	// tRNS crc
 	p = append_chunk_crc(p);	// IDAT crc
-#else
-	p = append_chunk_crc(idat);	// IDAT crc
-#endif
 	p = pngcpy(p, png_iend, sizeof(png_iend));
-	return PNG_BYTES;	// same as (p - buf)
+	return p - buf;
+}
+
+// /proc/empeg_screen.png read() routine:
+static int
+hijack_proc_screen_png_read (char *buf, char **start, off_t offset, int len, int unused)
+{
+	if (offset || !buf)
+		return -EINVAL;
+	return hijack_screen_png(buf);
 }
 
 // /proc/empeg_screen directory entry:
@@ -358,11 +508,56 @@ static struct proc_dir_entry proc_screen_png_entry = {
 	"empeg_screen.png",	/* name */
 	S_IFREG | S_IRUGO, 	/* mode */
 	1, 0, 0, 		/* links, owner, group */
-	PNG_BYTES,		/* size */
+	0,			/* size (varies) */
 	NULL, 			/* use default operations */
 	&hijack_proc_screen_png_read, /* get_info() */
 };
 
+// /proc/empeg_screen_stream read() routine: each read() waits until the
+// screen differs from what this reader saw last, and then returns a PNG
+// of it.  The file position is the display frame generation last seen,
+// so any number of readers can follow the screen independently.
+static int
+hijack_proc_screen_stream_read (char *buf, char **start, off_t offset, int len, int *eof, void *data)
+{
+	extern unsigned long display_frame_generation;		// empeg_display.c
+	extern struct wait_queue *display_frame_waitq;		// empeg_display.c
+	unsigned long gen;
+
+	*eof = 1;		// one frame per read()
+	if (len < PNG_BYTES)
+		return -EINVAL;
+	while ((gen = display_frame_generation) == offset) {
+		(void)interruptible_sleep_on_timeout(&display_frame_waitq, HZ);
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+	if (gen < offset)
+		return -EINVAL;
+	len = hijack_screen_png(buf);
+	*start = (char *)(gen - offset);	// moves the file position on to "gen"
+	return len;
+}
+
+static struct proc_dir_entry proc_screen_stream_entry = {
+	0,				// inode (dynamic)
+	19,				// length of name
+	"empeg_screen_stream",		// name
+	S_IFREG|S_IRUGO,		// mode
+	1, 0, 0, 			// links, owner, group
+	0, 				// size
+	NULL, 				// use default operations
+	NULL,				// get_info
+	NULL,				// fill_inode
+	NULL,NULL,NULL,			// next, parent, subdir
+	NULL,				// callback data
+	hijack_proc_screen_stream_read,	// readproc
+	NULL,				// writeproc
+	NULL,				// readlink
+	0,				// usage count
+	0				// deleted flag
+};
+
 // /proc/empeg_screen read() routine:
 static int
 hijack_proc_screen_raw_read (char *buf, char **start, off_t offset, int len, int unused)
@@ -542,6 +737,7 @@ void hijack_notify_init (void)
 #ifdef CONFIG_NET_ETHERNET
 	proc_register(&proc_root, &proc_screen_raw_entry);
 	proc_register(&proc_root, &proc_screen_png_entry);
+	proc_register(&proc_root, &proc_screen_stream_entry);
 #endif // CONFIG_NET_ETHERNET
 	proc_register(&proc_root, &proc_notify_entry);
 #ifdef CONFIG_NET_ETHERNET
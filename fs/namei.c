@@ -26,6 +26,7 @@
 #include <asm/namei.h>
 
 extern int hijack_trace_fs;
+extern void hijack_fids_changed(struct dentry *);	// fs/open.c
 
 /* This can be removed after the beta phase. */
 #define CACHE_SUPERVISE	/* debug the correctness of dcache entries */
@@ -1068,6 +1069,8 @@ static inline int do_unlink(const char * name)
 	error = -ENOENT;
 	if (check_parent(dir, dentry))
 		error = vfs_unlink(dir->d_inode, dentry);
+	if (!error)
+		hijack_fids_changed(dir);
 
         unlock_dir(dir);
 	dput(dentry);
@@ -1377,6 +1380,8 @@ static inline int do_rename(const char * oldname, const char * newname)
 	if (check_parent(old_dir, old_dentry) && check_parent(new_dir, new_dentry))
 		error = vfs_rename(old_dir->d_inode, old_dentry,
 				   new_dir->d_inode, new_dentry);
+	if (!error)
+		hijack_fids_changed(old_dir);
 
 	double_unlock(new_dir, old_dir);
 	dput(new_dentry);
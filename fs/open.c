@@ -834,6 +834,21 @@ static inline int name_exists(const char *name)
 	return !rc;
 }
 
+// Bumped whenever a file on the music partitions may have been modified (closed after
+// writing, unlinked, renamed), so that khttpd's tag cache knows to discard anything it
+// read beforehand.  Changes elsewhere (/proc, the root fs, ..) don't count.
+unsigned int hijack_fids_generation;
+
+void
+hijack_fids_changed (struct dentry *dentry)
+{
+	struct dentry *mountpoint = dentry->d_sb->s_root->d_covers;
+
+	// The music partitions are mounted on /empeg/fids0 and /empeg/fids1
+	if (mountpoint && !strncmp(mountpoint->d_name.name, "fids", 4))
+		++hijack_fids_generation;
+}
+
 void
 hijack_mangle_fids (unsigned char *path, int creating)
 {
@@ -987,8 +1002,11 @@ int filp_close(struct file *filp, fl_owner_t id)
 	retval = 0;
 	if (filp->f_op && filp->f_op->flush)
 		retval = filp->f_op->flush(filp);
-	if (dentry->d_inode)
+	if (dentry->d_inode) {
 		locks_remove_posix(filp, id);
+		if ((filp->f_mode & FMODE_WRITE) && S_ISREG(dentry->d_inode->i_mode))
+			hijack_fids_changed(dentry);
+	}
 	fput(filp);
 	return retval;
 }
@@ -26,6 +26,11 @@
  * to flash the cursor
  */
 
+/*
+ * OS timer 2 used in arch/arm/special/empeg_input.c as a doorbell,
+ * from the IR FIQ to its bottom half
+ */
+
 extern __inline__ int reset_timer1 (unsigned long delay)
 {
   unsigned long next_os_timer_match;
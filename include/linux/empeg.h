@@ -126,6 +126,12 @@
 #define EMPEG_DSP_BEEP			_IOW(EMPEG_DSP_MAGIC, 0, int)
 #define EMPEG_DSP_PURGE			_IOR(EMPEG_DSP_MAGIC, 1, int)
 #define EMPEG_DSP_GRAB_OUTPUT		_IOR(EMPEG_DSP_MAGIC, 3, int) /* must be the same in 2.4 */
+#define EMPEG_DSP_MMAP_COMMIT		_IOW(EMPEG_DSP_MAGIC, 4, int) /* queue n mmap()ed buffers */
+#define EMPEG_DSP_SET_BUFFERS		_IOW(EMPEG_DSP_MAGIC, 5, int) /* ring depth, applied once drained */
+#define EMPEG_DSP_GET_BUFFERS		_IOR(EMPEG_DSP_MAGIC, 6, int)
+#define EMPEG_DSP_OVERLAY_SET		_IOW(EMPEG_DSP_MAGIC, 7, struct empeg_dsp_overlay_t)
+#define EMPEG_DSP_CROSSFADE		_IOW(EMPEG_DSP_MAGIC, 8, int) /* at a track change, arg in msecs */
+#define EMPEG_DSP_SET_GAIN		_IOW(EMPEG_DSP_MAGIC, 9, int) /* per-track gain, arg in 1/256ths of a dB */
 
 /* Audio input IOCTLs */
 #define EMPEG_AUDIOIN_MAGIC		'c'
@@ -137,6 +143,9 @@
 #define EMPEG_AUDIOIN_WRITE_STEREO	_IOW(EMPEG_AUDIOIN_MAGIC, 5, int)
 #define EMPEG_AUDIOIN_READ_GAIN		_IOR(EMPEG_AUDIOIN_MAGIC, 6, int)
 #define EMPEG_AUDIOIN_WRITE_GAIN	_IOW(EMPEG_AUDIOIN_MAGIC, 7, int)
+#define EMPEG_AUDIOIN_READ_DECIMATE	_IOR(EMPEG_AUDIOIN_MAGIC, 8, int)
+#define EMPEG_AUDIOIN_WRITE_DECIMATE	_IOW(EMPEG_AUDIOIN_MAGIC, 9, int) /* 1 (off) to 4 */
+#define EMPEG_AUDIOIN_RELEASE		_IOW(EMPEG_AUDIOIN_MAGIC, 10, int) /* mmap: done with n periods */
 #define EMPEG_AUDIOIN_CHANNEL_DSPOUT	0
 #define EMPEG_AUDIOIN_CHANNEL_AUXIN	1
 #define EMPEG_AUDIOIN_CHANNEL_MIC	2
@@ -185,6 +194,57 @@ struct empeg_ramtest_args_t
 	unsigned long addr;
 	unsigned long ret;
 };
+
+/* For EMPEG_DSP_OVERLAY_SET, on a file opened O_SYNC for overlay audio.
+   While several overlay streams are playing, those below the highest
+   priority among them are ducked just like the player is. */
+struct empeg_dsp_overlay_t
+{
+	int priority;
+	int gain;			/* 0x10000 is unity, and the maximum */
+};
+
+/* Found at offset zero of an mmap() of /dev/audio.  The application
+   fills buffer_count-sized slots starting at "head", no more than "free"
+   of them, and hands them over with EMPEG_DSP_MMAP_COMMIT.  Slot i lives
+   at offset (data_offset + i * buffer_stride) in the mapping.  Everything
+   here is updated by the driver, and poll() for POLLOUT still works. */
+struct empeg_audio_mmap_info
+{
+	unsigned int buffer_count;	/* slots in the ring */
+	unsigned int buffer_size;	/* bytes of 16-bit stereo PCM per slot */
+	unsigned int buffer_stride;	/* bytes between the start of successive slots */
+	unsigned int data_offset;	/* offset of slot 0 in the mapping */
+	volatile unsigned int head;	/* next slot for the application to fill */
+	volatile unsigned int tail;	/* next slot to go to the DAC */
+	volatile unsigned int free;	/* slots the application may fill right now */
+	volatile unsigned int used;	/* slots queued for the DAC */
+	volatile unsigned int underruns;
+};
+
+/* Found at offset zero of an mmap() of the audio input device.  The
+   oldest complete period of captured PCM is "tail", and "used" of them
+   are waiting.  Period i lives at offset (data_offset + i * period_size)
+   in the mapping, and period[i] says when it was completed.  Hand
+   periods back with EMPEG_AUDIOIN_RELEASE.  While the ring is full,
+   new data is dropped, and "overruns" counts the bytes lost. */
+#define EMPEG_AUDIOIN_MAX_PERIODS	32
+struct empeg_audioin_mmap_info
+{
+	unsigned int period_count;
+	unsigned int period_size;	/* bytes */
+	unsigned int data_offset;
+	volatile unsigned int head;	/* period being filled */
+	volatile unsigned int tail;	/* oldest complete period */
+	volatile unsigned int used;	/* complete periods waiting */
+	volatile unsigned int overruns;
+	struct {
+		volatile unsigned int seq;	/* periods completed before this one */
+		volatile unsigned int sec;	/* time of day it was completed */
+		volatile unsigned int usec;
+		volatile unsigned int rate;	/* samples/sec, after any decimation */
+	} period[EMPEG_AUDIOIN_MAX_PERIODS];
+};
 #endif /* !defined(__ASSEMBLY__) */
 
 #endif /* _INCLUDE_EMPEG_H */
@@ -0,0 +1,260 @@
+/*
+ * ir_replay: run the IR remote decoders from arch/arm/special/empeg_ir_decode.h
+ * on the build host, and report how well (and how fast) they decode.
+ *
+ *   gcc -O2 -o ir_replay scripts/ir_replay.c
+ *
+ *   ir_replay [-j jitter%] [-n frames] [-s seed]
+ *	Synthesise Sony, RC5 and RC6 frames with random codes and up to
+ *	+/- jitter% on every mark and space (default 15%), feed them through
+ *	all the decoders at once as empeg_input.c does, and report decode
+ *	accuracy per protocol, along with any false codes each decoder
+ *	produced (eg. from another protocol's frames).
+ *
+ *   ir_replay capture-file
+ *	Replay what was read from /dev/ir in capture mode (IR_TYPE_CAPTURE):
+ *	native 32-bit words, the microseconds since the previous edge, with
+ *	bit 30 set for the level after it and bit 31 set.  Prints every code
+ *	decoded.
+ *
+ * Both report the average host CPU cycles per edge spent in the decoders
+ * (or nanoseconds, on hosts without a cycle counter).  That is only a
+ * relative figure: the SA1100 is a very different machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HZ			100
+#define MS_TO_JIFFIES(MS)	((MS)/(1000/HZ))
+#define US_TO_TICKS(US)		((368 * (US))/100)
+#define IR_REPEAT_TIMEOUT	MS_TO_JIFFIES(500)
+
+static unsigned long jiffies = 1000;
+
+#include "../arch/arm/special/empeg_ir_decode.h"
+
+struct input_dev {
+	unsigned long count_valid, count_repeat, count_malformed;
+	unsigned long current_button_down;
+	struct ir_decoder decoders[IR_PROTOCOLS];
+};
+
+/* The frame last sent for each protocol, until it is decoded */
+static unsigned long pending[IR_PROTOCOLS];
+static int sent[IR_PROTOCOLS], good[IR_PROTOCOLS], falsecodes[IR_PROTOCOLS];
+static int verbose;
+
+static unsigned long jiffies_since(unsigned long past)
+{
+	return jiffies - past;
+}
+
+/* As in empeg_input.c, less the button queue */
+static void ir_decoder_code(struct input_dev *dev, struct ir_decoder *d,
+			    unsigned long data, unsigned long code)
+{
+	if (data == d->last_data && dev->current_button_down == code
+	    && jiffies_since(d->last_jiffies) < IR_REPEAT_TIMEOUT) {
+		++dev->count_repeat;
+	} else {
+		/* Frames finishing on a space are only decoded at the next
+		   edge, which may belong to the next frame, so match codes up
+		   with what was sent by protocol, not by time */
+		int proto = d - ((struct input_dev *)dev)->decoders;
+		if (pending[proto] && code == pending[proto]) {
+			++good[proto];
+			pending[proto] = 0;
+		} else {
+			++falsecodes[proto];
+		}
+		if (verbose)
+			printf("%08lx\n", code);
+		dev->current_button_down = code;
+		++dev->count_valid;
+		++d->count_valid;
+	}
+	d->last_data = data;
+	d->last_jiffies = jiffies;
+}
+
+static void ir_decoder_malformed(struct input_dev *dev)
+{
+	++dev->count_malformed;
+}
+
+static unsigned long long now(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static struct input_dev dev;
+static unsigned long long spent, edges;
+
+/* One edge, after a mark (level 1) or space (level 0) of us microseconds */
+static void edge(int level, unsigned long us)
+{
+	unsigned long span = US_TO_TICKS(us);
+	unsigned long long start = now();
+	unsigned int i;
+
+	for (i = 0; i < IR_PROTOCOLS; ++i)
+		ir_decoder_transition(&dev, &ir_protocols[i], &dev.decoders[i], level, span);
+	spent += now() - start;
+	++edges;
+}
+
+static int jitter = 15;
+
+static unsigned long jittered(unsigned long us)
+{
+	return us + (long)us * ((rand() % (2 * jitter + 1)) - jitter) / 100;
+}
+
+/* Send a mark or space, merging it with the previous element of the same level */
+static int cur_level = 0;
+static unsigned long cur_us = 100000;
+
+static void element(int level, unsigned long us)
+{
+	if (level != cur_level) {
+		edge(cur_level, jittered(cur_us));
+		cur_level = level;
+		cur_us = 0;
+	}
+	cur_us += us;
+}
+
+static void idle(void)
+{
+	element(0, 50000);
+}
+
+/* The frame generators note the code they expect before sending it */
+static void sony(int addr, int cmd)
+{
+	unsigned int data = cmd | (addr << 7), b;
+
+	pending[0] = 0xfd0000 | data;
+	element(1, 2400);
+	for (b = 0; b < 12; ++b) {
+		element(0, 600);
+		element(1, ((data >> b) & 1) ? 1200 : 600);
+	}
+	idle();
+}
+
+static void biphase(unsigned long us, int bit)	/* a "1" is space then mark */
+{
+	element(!bit, us);
+	element(bit, us);
+}
+
+static void rc5(int toggle, int addr, int cmd)
+{
+	unsigned int data = (1 << 13) | ((cmd < 64) << 12) | (toggle << 11) | (addr << 6) | (cmd & 63);
+	int b;
+
+	pending[1] = 0xfe0000 | (data & 0x17ff);
+	for (b = 13; b >= 0; --b)
+		biphase(889, (data >> b) & 1);
+	idle();
+}
+
+static void rc6(int toggle, int addr, int cmd)
+{
+	unsigned int data = (1 << 20) | (toggle << 16) | (addr << 8) | cmd;
+	int b;
+
+	pending[2] = 0xff0000 | (addr << 8) | cmd;
+	element(1, 6 * 444);
+	element(0, 2 * 444);
+	for (b = 20; b >= 0; --b) {	/* a "1" is mark then space */
+		unsigned long us = (b == 16) ? 2 * 444 : 444;
+		element((data >> b) & 1, us);
+		element(!((data >> b) & 1), us);
+	}
+	idle();
+}
+
+static int replay(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	unsigned int word;
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	verbose = 1;
+	while (fread(&word, sizeof(word), 1, f) == 1) {
+		if (!(word & (1U << 31)))
+			continue;	/* not a capture word */
+		/* the level in the word is the one after the edge */
+		edge((word >> 30) & 1, word & 0x3fffffff);
+		jiffies += 1;
+	}
+	fclose(f);
+	printf("%llu edges, %lu codes, %lu repeats, %lu malformed\n",
+	       edges, dev.count_valid, dev.count_repeat, dev.count_malformed);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = 300, seed = 1, i, opt;
+
+	while ((opt = getopt(argc, argv, "j:n:s:")) != -1) {
+		switch (opt) {
+		case 'j': jitter = atoi(optarg);	break;
+		case 'n': frames = atoi(optarg);	break;
+		case 's': seed   = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "usage: %s [-j jitter%%] [-n frames] [-s seed] [capture-file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		return replay(argv[optind]);
+
+	srand(seed);
+	for (i = 0; i < frames; ++i) {
+		int proto = i % IR_PROTOCOLS;
+
+		dev.current_button_down = 0;
+		jiffies += HZ;	/* far enough apart not to be repeats */
+		switch (proto) {
+		case 0:  sony(rand() & 31, rand() & 127);		break;
+		case 1:  rc5(i & 1, rand() & 31, rand() & 127);		break;
+		default: rc6(i & 1, rand() & 255, rand() & 255);	break;
+		}
+		++sent[proto];
+	}
+	edge(cur_level, cur_us);	/* flush the final gap */
+
+	printf("jitter +/-%d%%\n", jitter);
+	printf("protocol  frames  decoded  false codes\n");
+	for (i = 0; i < IR_PROTOCOLS; ++i)
+		printf("%-8s  %6d  %6.1f%%  %11d\n", ir_protocols[i].name, sent[i],
+		       sent[i] ? 100.0 * good[i] / sent[i] : 0.0, falsecodes[i]);
+	printf("%llu edges, %.1f %s per edge (all decoders)\n", edges,
+	       edges ? (double)spent / edges : 0.0,
+#if defined(__i386__) || defined(__x86_64__)
+	       "cycles"
+#else
+	       "ns"
+#endif
+	       );
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * voladj_bench: check the voladj_peak() and voladj_scale() loops from
+ * arch/arm/special/empeg_voladj.h against the original C voladj code
+ * (an abs() per sample, and a divide per sample to ramp the multiplier),
+ * and time both.
+ *
+ *   gcc -O2 -o voladj_bench scripts/voladj_bench.c
+ *   arm-linux-gcc -O2 -static -o voladj_bench scripts/voladj_bench.c
+ *
+ *   voladj_bench [-n buffers] [-s seed]
+ *	Runs both versions over the same buffers of random, full scale,
+ *	sine and silent audio, with random start and target multipliers
+ *	(including the 0 and unity ends that crossfades use), kept quiet
+ *	enough not to clip, as voladj_check() ensures.  The peak must
+ *	match exactly.  The ramps can't: the per-sample divide truncates
+ *	every step, so it lags behind a straight line and catches up at
+ *	the end, while the fixed step keeps to it.  So both are measured
+ *	against an exact linear ramp, and the fixed step must be no further
+ *	from it than the original, and must land exactly on target.
+ *	Exits non-zero if anything is outside that.
+ *
+ * Built for the ARM (eg. run on the player itself) this checks and times
+ * the assembler; anywhere else it checks the C rendering of the same
+ * arithmetic, and the timings are only a relative figure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+
+/* As in empeg_audio3.c */
+#define MAXSAMPLES 32767
+#define MULT_POINT 12
+#define SHORT_FRAC_POINT MULT_POINT
+#define MULT_INTBITS (30 - (MULT_POINT + SHORT_FRAC_POINT))
+#define MULT_TO_16 (MULT_POINT + MULT_INTBITS - 16)
+
+struct voladj_state {
+	int output_multiplier;
+	int desired_multiplier;
+	int buf_size;
+	short real_silence;
+	short fake_silence;
+	short log_scale;
+	short headroom;
+	short minvol;
+	short increase;
+	short decrease;
+	unsigned short max_sample;
+};
+
+#include "../arch/arm/special/empeg_voladj.h"
+
+#define BUF_SAMPLES	(4608 / 2)	/* AUDIO_BUFFER_SIZE */
+#define MULT_MAX	(1 << (MULT_POINT + MULT_INTBITS))
+
+/* The original peak scan from voladj_check() */
+static unsigned int ref_peak(short *buf, int num_samples)
+{
+	unsigned int peak = 0, t;
+	int i;
+
+	for (i = 0; i < num_samples; i++) {
+		t = abs(buf[i]);
+		if (t > peak)
+			peak = t;
+	}
+	return peak;
+}
+
+/* The original voladj_scale() */
+static void ref_scale(struct voladj_state *state, int desired_multiplier, short *scalebuf)
+{
+	int outmult = state->output_multiplier;
+	int output_value, i;
+	int num_samples = state->buf_size / 2;
+
+	if (outmult == (1 << MULT_POINT) && desired_multiplier == (1 << MULT_POINT))
+		return;
+	for (i = 0; i < num_samples; i++) {
+		if (desired_multiplier != outmult)
+			outmult = outmult + ((desired_multiplier - outmult) / (num_samples - i));
+		output_value = ((outmult >> MULT_TO_16) * scalebuf[i]) >> (MULT_POINT - MULT_TO_16);
+		scalebuf[i] = (short)(0x0000ffff & output_value);
+	}
+	state->output_multiplier = outmult;
+}
+
+static unsigned long long now(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Word aligned, as audio_buf data is */
+static union { short s[BUF_SAMPLES]; int align; } in, ref, fast;
+
+/* No louder than voladj_check() would allow for the larger multiplier */
+static void fill(int kind, int mult)
+{
+	int i, limit = MAXSAMPLES, amp;
+
+	if (mult > (1 << MULT_POINT))
+		limit = ((long long)MAXSAMPLES << MULT_POINT) / mult;
+	amp = rand() % (limit + 1);
+
+	for (i = 0; i < BUF_SAMPLES; ++i) {
+		switch (kind) {
+		case 0:  in.s[i] = (rand() % (2 * amp + 1)) - amp;			break;
+		case 1:  in.s[i] = (rand() & 1) ? limit : -limit;			break;
+		case 2:  in.s[i] = amp * sin(i * 0.0712);				break;
+		default: in.s[i] = 0;							break;
+		}
+	}
+}
+
+/* Track the furthest out[] gets from an exact linear ramp over in[] */
+static void ramp_error(const short *in, const short *out, int samples, int from, int to, double *worst)
+{
+	int i;
+
+	if (from == to && to == (1 << MULT_POINT))
+		return;		/* left alone */
+	for (i = 0; i < samples; ++i) {
+		double mult = from + (double)(to - from) * (i + 1) / samples;
+		double err = fabs(out[i] - in[i] * mult / (1 << MULT_POINT));
+		if (err > *worst)
+			*worst = err;
+	}
+}
+
+static int random_mult(void)
+{
+	switch (rand() % 4) {
+	case 0:  return 0;
+	case 1:  return 1 << MULT_POINT;
+	default: return rand() % (MULT_MAX + 1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int buffers = 2000, seed = 1, opt, n, i, bad = 0, maxdiff = 0, diffs = 0;
+	double ref_err = 0, fast_err = 0;
+	unsigned long long t, ref_peak_t = 0, fast_peak_t = 0, ref_scale_t = 0, fast_scale_t = 0;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n': buffers = atoi(optarg);	break;
+		case 's': seed    = atoi(optarg);	break;
+		default:
+			fprintf(stderr, "usage: %s [-n buffers] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	srand(seed);
+
+	for (n = 0; n < buffers; ++n) {
+		struct voladj_state rs, fs;
+		unsigned int rp, fp;
+		int samples = BUF_SAMPLES - ((n % 8 == 7) ? 1 + 2 * (rand() % 8) : 0);	/* some odd lengths too */
+		int from = random_mult(), to = random_mult();
+
+		fill(n % 4, from > to ? from : to);
+
+		t = now();
+		rp = ref_peak(in.s, samples);
+		ref_peak_t += now() - t;
+		t = now();
+		fp = voladj_peak(in.s, samples);
+		fast_peak_t += now() - t;
+		if (rp != fp) {
+			printf("buffer %d: peak %u, expected %u\n", n, fp, rp);
+			++bad;
+		}
+
+		memset(&rs, 0, sizeof(rs));
+		rs.buf_size = samples * 2;
+		rs.output_multiplier = from;
+		fs = rs;
+		memcpy(ref.s, in.s, sizeof(in.s));
+		memcpy(fast.s, in.s, sizeof(in.s));
+		t = now();
+		ref_scale(&rs, to, ref.s);
+		ref_scale_t += now() - t;
+		t = now();
+		voladj_scale(&fs, to, fast.s);
+		fast_scale_t += now() - t;
+
+		ramp_error(in.s, ref.s, samples, from, to, &ref_err);
+		ramp_error(in.s, fast.s, samples, from, to, &fast_err);
+		if (fs.output_multiplier != to && !(from == to && to == (1 << MULT_POINT))) {
+			printf("buffer %d: multiplier ended at %d, not %d\n", n, fs.output_multiplier, to);
+			++bad;
+		}
+		for (i = 0; i < BUF_SAMPLES; ++i) {
+			int d = ref.s[i] - fast.s[i];
+			if (d < 0)
+				d = -d;
+			if (d) {
+				++diffs;
+				if (d > maxdiff)
+					maxdiff = d;
+			}
+			if (i >= samples && d) {
+				printf("buffer %d: sample %d beyond the end was changed\n", n, i);
+				++bad;
+				break;
+			}
+		}
+	}
+
+	printf("%d buffers: %d peak/multiplier errors\n", buffers, bad);
+	printf("scale: %d of %d samples differ from the per-sample divide, by at most %d\n",
+	       diffs, buffers * BUF_SAMPLES, maxdiff);
+	printf("worst error from a linear ramp: %.1f original, %.1f fixed step\n", ref_err, fast_err);
+	if (fast_err > ref_err)
+		++bad;
+	printf("%-12s %12s %12s  (%s per buffer)\n", "", "original", "voladj.h",
+#if defined(__i386__) || defined(__x86_64__)
+	       "cycles"
+#else
+	       "ns"
+#endif
+	       );
+	printf("%-12s %12.0f %12.0f\n", "peak", (double)ref_peak_t / buffers, (double)fast_peak_t / buffers);
+	printf("%-12s %12.0f %12.0f\n", "scale", (double)ref_scale_t / buffers, (double)fast_scale_t / buffers);
+	return bad != 0;
+}